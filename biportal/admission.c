@@ -0,0 +1,261 @@
+#include <string.h>
+#include <stdlib.h>
+#include <fnmatch.h>
+#include <arpa/inet.h>
+
+#include "biportal.h"
+#include "admission.h"
+
+#define ADMISSION_QUEUE_MAX 128
+#define ADMISSION_PER_CLIENT 4
+#define ADMISSION_RULES 16
+#define ADMISSION_STALE_MS 15000    // client stopped retransmitting its request
+#define ADMISSION_ADAPT_MS 2000
+
+typedef struct {
+    bool used;
+    struct sockaddr_in addr;
+    int priority;
+    uint64_t seq;
+    uint64_t enqueued;
+    uint64_t last_seen;
+    int len;
+    char packet[ADMISSION_PACKET_MAX];
+} admission_entry_t;
+
+typedef struct {
+    char pattern[128];
+    int priority;
+} admission_rule_t;
+
+static admission_entry_t queue[ADMISSION_QUEUE_MAX];
+static int queued = 0;
+static uint64_t next_seq = 0;
+
+static admission_rule_t rules[ADMISSION_RULES];
+static int rule_count = 0;
+
+static int queue_wait = 30;
+static int concurrency_min = 4;
+static int concurrency_max = MAX_TRANSFERS;
+static int limit = 16;
+
+// Hill climbing state for the concurrency limit
+static uint64_t interval_start = 0;
+static uint64_t interval_bytes = 0;
+static double last_rate = 0;
+static int direction = 1;
+
+static int clamp_limit(int l) {
+    if (l < concurrency_min) l = concurrency_min;
+    if (l > concurrency_max) l = concurrency_max;
+    return l;
+}
+
+bool admission_configure(const char *config) {
+    if (strncmp(config, "priority=", 9) == 0) {
+        const char *rule = config + 9;
+        const char *colon = strrchr(rule, ':');
+        if (!*rule) {
+            rule_count = 0;
+            LOG_INFO("Cleared priority rules");
+            return true;
+        }
+        if (!colon || colon == rule || (size_t)(colon - rule) >= sizeof(rules[0].pattern)) {
+            LOG_ERROR("Bad priority rule: %s", rule);
+            return true;
+        }
+
+        size_t len = colon - rule;
+        int i;
+        for (i = 0; i < rule_count; i++) {
+            if (strlen(rules[i].pattern) == len && !strncmp(rules[i].pattern, rule, len)) break;
+        }
+        if (i == rule_count) {
+            if (rule_count == ADMISSION_RULES) {
+                LOG_ERROR("Too many priority rules, ignoring %s", rule);
+                return true;
+            }
+            rule_count++;
+        }
+        memcpy(rules[i].pattern, rule, len);
+        rules[i].pattern[len] = '\0';
+        rules[i].priority = atoi(colon + 1);
+        LOG_INFO("Priority %d for '%s'", rules[i].priority, rules[i].pattern);
+        return true;
+    }
+    if (strncmp(config, "queue_wait=", 11) == 0) {
+        queue_wait = atoi(config + 11);
+        if (queue_wait < 0) queue_wait = 0;
+        return true;
+    }
+    if (strncmp(config, "concurrency_min=", 16) == 0) {
+        int v = atoi(config + 16);
+        concurrency_min = v < 1 ? 1 : (v > MAX_TRANSFERS ? MAX_TRANSFERS : v);
+        if (concurrency_max < concurrency_min) concurrency_max = concurrency_min;
+        limit = clamp_limit(limit);
+        return true;
+    }
+    if (strncmp(config, "concurrency_max=", 16) == 0) {
+        int v = atoi(config + 16);
+        concurrency_max = v < 1 ? 1 : (v > MAX_TRANSFERS ? MAX_TRANSFERS : v);
+        if (concurrency_min > concurrency_max) concurrency_min = concurrency_max;
+        limit = clamp_limit(limit);
+        return true;
+    }
+    return false;
+}
+
+int admission_limit(void) {
+    return limit;
+}
+
+int admission_queued(void) {
+    return queued;
+}
+
+static int priority_for(const char *filename) {
+    // First matching rule wins
+    for (int i = 0; i < rule_count; i++) {
+        if (fnmatch(rules[i].pattern, filename, 0) == 0) return rules[i].priority;
+    }
+    return 0;
+}
+
+static bool same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void drop(admission_entry_t *e) {
+    e->used = false;
+    queued--;
+}
+
+bool admission_enqueue(int sock, const struct sockaddr_in *addr, const char *packet, int len, const char *filename) {
+    uint64_t now = monotonic_ms();
+    int per_client = 0;
+    admission_entry_t *free_slot = NULL, *lowest = NULL;
+
+    for (int i = 0; i < ADMISSION_QUEUE_MAX; i++) {
+        admission_entry_t *e = &queue[i];
+        if (!e->used) {
+            if (!free_slot) free_slot = e;
+            continue;
+        }
+        if (same_peer(&e->addr, addr)) {
+            // Retransmitted request, it keeps its place in the queue
+            e->last_seen = now;
+            return true;
+        }
+        if (e->addr.sin_addr.s_addr == addr->sin_addr.s_addr) per_client++;
+        if (!lowest || e->priority < lowest->priority
+            || (e->priority == lowest->priority && e->seq > lowest->seq)) {
+            lowest = e;
+        }
+    }
+
+    if (len > ADMISSION_PACKET_MAX || per_client >= ADMISSION_PER_CLIENT) return false;
+
+    int priority = priority_for(filename);
+    if (!free_slot) {
+        // Full: only a more important request may push out the least important one
+        if (!lowest || lowest->priority >= priority) return false;
+        send_error(sock, &lowest->addr, TFTP_ERR_UNDEFINED, "Too many concurrent transfers");
+        drop(lowest);
+        free_slot = lowest;
+    }
+
+    free_slot->used = true;
+    free_slot->addr = *addr;
+    free_slot->priority = priority;
+    free_slot->seq = next_seq++;
+    free_slot->enqueued = now;
+    free_slot->last_seen = now;
+    free_slot->len = len;
+    memcpy(free_slot->packet, packet, len);
+    queued++;
+
+    LOG_DEBUG("Queued request for '%s' from %s:%d, priority %d, %d waiting",
+              filename, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), priority, queued);
+    return true;
+}
+
+bool admission_next(int (*active_for)(const struct in_addr *addr),
+                    struct sockaddr_in *addr, char *packet, int *len) {
+    admission_entry_t *best = NULL;
+    int best_active = 0;
+
+    for (int i = 0; i < ADMISSION_QUEUE_MAX; i++) {
+        admission_entry_t *e = &queue[i];
+        if (!e->used) continue;
+
+        if (best && e->priority < best->priority) continue;
+        int active = active_for(&e->addr.sin_addr);
+        if (best && e->priority == best->priority) {
+            if (active > best_active) continue;
+            if (active == best_active && e->seq > best->seq) continue;
+        }
+        best = e;
+        best_active = active;
+    }
+
+    if (!best) return false;
+    *addr = best->addr;
+    memcpy(packet, best->packet, best->len);
+    *len = best->len;
+    drop(best);
+    return true;
+}
+
+void admission_expire(int sock, uint64_t now) {
+    if (!queued) return;
+    for (int i = 0; i < ADMISSION_QUEUE_MAX; i++) {
+        admission_entry_t *e = &queue[i];
+        if (!e->used) continue;
+        if (now - e->last_seen > ADMISSION_STALE_MS) {
+            drop(e);
+        } else if (now - e->enqueued > (uint64_t)queue_wait * 1000) {
+            send_error(sock, &e->addr, TFTP_ERR_UNDEFINED, "Too many concurrent transfers");
+            drop(e);
+        }
+    }
+}
+
+void admission_account(size_t bytes) {
+    interval_bytes += bytes;
+}
+
+void admission_tick(uint64_t now, int active) {
+    if (!interval_start) {
+        interval_start = now;
+        return;
+    }
+    if (now - interval_start < ADMISSION_ADAPT_MS) return;
+
+    double rate = interval_bytes * 1000.0 / (now - interval_start);
+    interval_start = now;
+    interval_bytes = 0;
+
+    // Only probe while the limit is what holds requests back
+    if (!queued || active < limit) {
+        last_rate = rate;
+        direction = 1;
+        return;
+    }
+
+    if (rate < last_rate * 0.95) {
+        // The last step hurt, go back the other way
+        direction = -direction;
+    } else if (rate <= last_rate * 1.05 && direction < 0) {
+        // Shrinking didn't cost anything, hold here
+        last_rate = rate;
+        return;
+    }
+
+    int next = clamp_limit(limit + direction);
+    if (next != limit) {
+        LOG_DEBUG("Concurrency limit %d -> %d at %.0f bytes/s", limit, next, rate);
+        limit = next;
+    }
+    last_rate = rate;
+}
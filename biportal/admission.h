@@ -0,0 +1,44 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#define ADMISSION_PACKET_MAX 512    // RFC 2347 keeps requests within 512 bytes
+
+// Requests that arrive while every transfer slot is busy are parked here
+// instead of being refused. We simply don't answer a parked RRQ/WRQ (the
+// OACK is delayed) and soak up the client's retransmissions until a slot
+// frees; the next request is picked by priority, then by how few transfers
+// its client already has, then by age. The number of slots in use adapts
+// to the aggregate throughput we measure.
+
+// Handles "priority=PATTERN:LEVEL" (an empty value clears the rules),
+// "queue_wait=SECONDS", "concurrency_min=N" and "concurrency_max=N".
+// Returns false if the option isn't ours.
+bool admission_configure(const char *config);
+
+int admission_limit(void);
+int admission_queued(void);
+
+// Park a request. A repeated request from the same address only refreshes
+// the existing entry. Returns false when it can't be queued and must be
+// refused.
+bool admission_enqueue(int sock, const struct sockaddr_in *addr, const char *packet, int len, const char *filename);
+
+// Take the best parked request. active_for reports how many transfers a
+// client address already has.
+bool admission_next(int (*active_for)(const struct in_addr *addr),
+                    struct sockaddr_in *addr, char *packet, int *len);
+
+// Refuse requests that waited too long and forget clients that stopped
+// retransmitting.
+void admission_expire(int sock, uint64_t now);
+
+// Throughput accounting and the periodic concurrency adjustment
+void admission_account(size_t bytes);
+void admission_tick(uint64_t now, int active);
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef BIPORTAL_H
+#define BIPORTAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#include "log.h"
+
+#define SOCKET_PATH "/tmp/pumpkin_socket"
+#define IPC_MESSAGE_SIZE 8192
+#define TFTP_PACKET_MAX (4 + 65464)     // header and the largest blksize (RFC 2348)
+#define MAX_TRANSFERS 64
+
+#define TFTP_RRQ 1
+#define TFTP_WRQ 2
+#define TFTP_DATA 3
+#define TFTP_ACK 4
+#define TFTP_ERROR 5
+#define TFTP_OACK 6
+
+// Error codes
+#define TFTP_ERR_UNDEFINED 0
+#define TFTP_ERR_NOT_FOUND 1
+#define TFTP_ERR_ACCESS_VIOLATION 2
+#define TFTP_ERR_DISK_FULL 3
+#define TFTP_ERR_ILLEGAL_OP 4
+#define TFTP_ERR_UNKNOWN_TID 5
+#define TFTP_ERR_FILE_EXISTS 6
+#define TFTP_ERR_NO_USER 7
+#define TFTP_ERR_OPTION 8
+
+// Command types between PumpKIN and helper
+#define CMD_HELLO 1
+#define CMD_READY 2
+#define CMD_CONFIG 3
+#define CMD_TRANSFER_REQUEST 4
+#define CMD_TRANSFER_STATUS 5
+#define CMD_TRANSFER_DONE 6
+#define CMD_TRANSFER_APPROVE 7
+#define CMD_TRANSFER_DENY 8
+#define CMD_SHUTDOWN 9
+#define CMD_CAPTURE_DUMP 10   // with the output file's descriptor attached (SCM_RIGHTS)
+
+typedef struct {
+    uint16_t cmd;
+    uint16_t transfer_id;
+    char data[IPC_MESSAGE_SIZE - 4];
+} ipc_message_t;
+
+// Shared helpers from main.c
+uint64_t monotonic_ms(void);
+void send_error(int sock, struct sockaddr_in *addr, int error_code, char *error_msg);
+void send_ipc_message(int unix_sock, int cmd, int transfer_id, char *data);
+
+#endif
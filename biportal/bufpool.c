@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "biportal.h"
+#include "bufpool.h"
+
+#define BUFPOOL_MIN_SHIFT 6                 // 64 bytes
+#define BUFPOOL_CLASSES 11                  // up to 64 KiB
+#define BUFPOOL_OVERSIZE 0xff               // plain malloc, never kept
+#define BUFPOOL_DEFAULT_KEEP (1 << 20)
+
+// Precedes every buffer, keeps what follows aligned for anything
+typedef union bufpool_hdr {
+    struct {
+        unsigned char size_class;
+        size_t size;                        // of the whole block, header included
+    } h;
+    union bufpool_hdr *next;                // while on a free list
+    max_align_t align;
+} bufpool_hdr_t;
+
+static bufpool_hdr_t *free_lists[BUFPOOL_CLASSES];
+static size_t keep_limit = BUFPOOL_DEFAULT_KEEP;
+static size_t kept_bytes, in_use_bytes;
+
+bool bufpool_configure(const char *config) {
+    if (strncmp(config, "bufpool_keep=", 13) == 0) {
+        long long keep = atoll(config + 13);
+        keep_limit = keep < 0 ? 0 : (size_t)keep;
+        // Trim right away if the budget shrank
+        for (int c = BUFPOOL_CLASSES - 1; c >= 0 && kept_bytes > keep_limit; c--) {
+            while (free_lists[c] && kept_bytes > keep_limit) {
+                bufpool_hdr_t *b = free_lists[c];
+                free_lists[c] = b->next;
+                kept_bytes -= (size_t)1 << (BUFPOOL_MIN_SHIFT + c);
+                free(b);
+            }
+        }
+        LOG_INFO("Keeping up to %zu bytes of freed transfer buffers", keep_limit);
+        return true;
+    }
+    return false;
+}
+
+static int size_class(size_t size) {
+    for (int c = 0; c < BUFPOOL_CLASSES; c++) {
+        if (size <= (size_t)1 << (BUFPOOL_MIN_SHIFT + c)) return c;
+    }
+    return -1;
+}
+
+void *bufpool_alloc(size_t size) {
+    size_t total = size + sizeof(bufpool_hdr_t);
+    int c = size_class(total);
+    bufpool_hdr_t *b;
+
+    if (c < 0) {
+        if (!(b = malloc(total))) return NULL;
+        b->h.size_class = BUFPOOL_OVERSIZE;
+        b->h.size = total;
+    } else {
+        size_t class_size = (size_t)1 << (BUFPOOL_MIN_SHIFT + c);
+        if ((b = free_lists[c])) {
+            free_lists[c] = b->next;
+            kept_bytes -= class_size;
+        } else if (!(b = malloc(class_size))) {
+            return NULL;
+        }
+        b->h.size_class = (unsigned char)c;
+        b->h.size = class_size;
+    }
+    in_use_bytes += b->h.size;
+    return b + 1;
+}
+
+void bufpool_free(void *buf) {
+    if (!buf) return;
+    bufpool_hdr_t *b = (bufpool_hdr_t *)buf - 1;
+    in_use_bytes -= b->h.size;
+    if (b->h.size_class == BUFPOOL_OVERSIZE || kept_bytes + b->h.size > keep_limit) {
+        free(b);
+        return;
+    }
+    int c = b->h.size_class;
+    kept_bytes += b->h.size;
+    b->next = free_lists[c];
+    free_lists[c] = b;
+}
+
+void bufpool_usage(size_t *in_use, size_t *kept) {
+    *in_use = in_use_bytes;
+    *kept = kept_bytes;
+}
@@ -0,0 +1,25 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Per-transfer buffers (the packet kept for retransmission, the file name)
+// come from free lists by power-of-two size class, from 64 bytes to 64 KiB.
+// A transfer holds a buffer as large as its negotiated block, not the
+// largest one possible, and a finished transfer's buffers go to the next
+// transfer of a similar block size without going back through malloc. Only
+// so much freed memory is kept, the rest is returned.
+
+// Handles "bufpool_keep=BYTES", how much freed memory to keep around
+// (default 1 MiB). Returns false if the option isn't ours.
+bool bufpool_configure(const char *config);
+
+// NULL when out of memory
+void *bufpool_alloc(size_t size);
+void bufpool_free(void *buf);
+
+// Bytes handed out and bytes sitting in the free lists
+void bufpool_usage(size_t *in_use, size_t *kept);
+
+#endif
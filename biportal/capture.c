@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "biportal.h"
+#include "capture.h"
+
+#define CAPTURE_HEADER_BYTES 64
+#define CAPTURE_DEFAULT_SIZE (4 << 20)
+#define CAPTURE_MIN_SIZE (64 << 10)
+#define CAPTURE_AVG_RECORD 128      // sizes the record table against the byte ring
+#define CAPTURE_SNAPLEN 65535
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define LINKTYPE_RAW 101
+
+// The captured bytes live in a byte ring, this describes one packet in it
+typedef struct {
+    uint64_t ts_us;
+    struct in_addr src, dst;
+    uint16_t sport, dport;          // network order
+    uint16_t orig_len;
+    uint16_t cap_len;
+    size_t offset;
+} capture_rec_t;
+
+bool capture_enabled = false;
+
+static bool full_packets = false;
+static size_t capture_size = CAPTURE_DEFAULT_SIZE;
+
+static char *bytes;                 // capture_size bytes
+static size_t bytes_head;           // where the next packet's bytes go
+static size_t bytes_used;
+static capture_rec_t *recs;
+static size_t rec_max;
+static size_t rec_first;            // oldest record
+static size_t rec_count;
+static uint64_t recorded, evicted;
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void release_ring(void) {
+    free(bytes);
+    free(recs);
+    bytes = NULL;
+    recs = NULL;
+    rec_max = rec_first = rec_count = 0;
+    bytes_head = bytes_used = 0;
+}
+
+static bool allocate_ring(void) {
+    release_ring();
+    rec_max = capture_size / CAPTURE_AVG_RECORD;
+    bytes = malloc(capture_size);
+    recs = malloc(rec_max * sizeof(capture_rec_t));
+    if (!bytes || !recs) {
+        release_ring();
+        return false;
+    }
+    recorded = evicted = 0;
+    return true;
+}
+
+bool capture_configure(const char *config) {
+    if (strncmp(config, "capture=", 8) == 0) {
+        const char *mode = config + 8;
+        if (!strcmp(mode, "off")) {
+            capture_enabled = false;
+            release_ring();
+            return true;
+        }
+        if (strcmp(mode, "headers") && strcmp(mode, "full")) {
+            LOG_ERROR("Unknown capture mode '%s'", mode);
+            return true;
+        }
+        full_packets = !strcmp(mode, "full");
+        if (!bytes && !allocate_ring()) {
+            LOG_ERROR("No memory for a %zu byte capture ring", capture_size);
+            capture_enabled = false;
+            return true;
+        }
+        capture_enabled = true;
+        LOG_INFO("Capturing %s into %zu bytes", full_packets ? "full packets" : "packet headers", capture_size);
+        return true;
+    }
+    if (strncmp(config, "capture_size=", 13) == 0) {
+        long long size = atoll(config + 13);
+        capture_size = size < CAPTURE_MIN_SIZE ? CAPTURE_MIN_SIZE : (size_t)size;
+        // A running capture starts over in the new size
+        if (bytes && !allocate_ring()) {
+            LOG_ERROR("No memory for a %zu byte capture ring", capture_size);
+            capture_enabled = false;
+        }
+        return true;
+    }
+    return false;
+}
+
+static void evict_oldest(void) {
+    bytes_used -= recs[rec_first].cap_len;
+    rec_first = (rec_first + 1) % rec_max;
+    rec_count--;
+    evicted++;
+}
+
+void capture_record(const struct sockaddr_in *src, const struct sockaddr_in *dst, const void *data, size_t len) {
+    if (!bytes) return;
+
+    size_t cap = len;
+    if (!full_packets && cap > CAPTURE_HEADER_BYTES) cap = CAPTURE_HEADER_BYTES;
+    if (cap > CAPTURE_SNAPLEN) cap = CAPTURE_SNAPLEN;
+    while (rec_count && (rec_count == rec_max || bytes_used + cap > capture_size)) {
+        evict_oldest();
+    }
+
+    capture_rec_t *r = &recs[(rec_first + rec_count) % rec_max];
+    r->ts_us = monotonic_us();
+    r->src = src->sin_addr;
+    r->dst = dst->sin_addr;
+    r->sport = src->sin_port;
+    r->dport = dst->sin_port;
+    r->orig_len = len > CAPTURE_SNAPLEN ? CAPTURE_SNAPLEN : (uint16_t)len;
+    r->cap_len = (uint16_t)cap;
+    r->offset = bytes_head;
+
+    // The bytes may run over the end of the ring and continue at the start
+    size_t first = capture_size - bytes_head < cap ? capture_size - bytes_head : cap;
+    memcpy(bytes + bytes_head, data, first);
+    memcpy(bytes, (const char *)data + first, cap - first);
+    bytes_head = (bytes_head + cap) % capture_size;
+    bytes_used += cap;
+    rec_count++;
+    recorded++;
+}
+
+typedef struct {
+    int fd;
+    size_t used;
+    char buf[65536];
+} out_t;
+
+static bool flush(out_t *out) {
+    for (size_t off = 0; off < out->used; ) {
+        ssize_t w = write(out->fd, out->buf + off, out->used - off);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        off += w;
+    }
+    out->used = 0;
+    return true;
+}
+
+static bool put(out_t *out, const void *data, size_t len) {
+    if (out->used + len > sizeof(out->buf) && !flush(out)) return false;
+    memcpy(out->buf + out->used, data, len);
+    out->used += len;
+    return true;
+}
+
+static uint16_t ip_checksum(const uint8_t *p, size_t len) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) sum += (uint32_t)p[i] << 8 | p[i + 1];
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+int capture_dump(int fd) {
+    out_t *out = malloc(sizeof(out_t));
+    if (!out) return -1;
+    out->fd = fd;
+    out->used = 0;
+
+    struct {
+        uint32_t magic;
+        uint16_t major, minor;
+        int32_t zone;
+        uint32_t sigfigs, snaplen, linktype;
+    } header = { PCAP_MAGIC, 2, 4, 0, 0, CAPTURE_SNAPLEN + 28, LINKTYPE_RAW };
+    bool ok = put(out, &header, sizeof(header));
+
+    // Monotonic stamps become wall clock time as of now
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    uint64_t wall_us = (uint64_t)wall.tv_sec * 1000000 + wall.tv_nsec / 1000;
+    uint64_t now_us = monotonic_us();
+
+    int written = 0;
+    for (size_t i = 0; ok && i < rec_count; i++) {
+        const capture_rec_t *r = &recs[(rec_first + i) % rec_max];
+        uint64_t ts = wall_us - (now_us - r->ts_us);
+        struct {
+            uint32_t sec, usec, incl_len, orig_len;
+        } rec = { (uint32_t)(ts / 1000000), (uint32_t)(ts % 1000000), 28u + r->cap_len, 28u + r->orig_len };
+
+        uint8_t ip[28] = { 0x45, 0 };
+        uint16_t total = htons(28 + r->orig_len), udp_len = htons(8 + r->orig_len);
+        memcpy(ip + 2, &total, 2);
+        ip[8] = 64;                         // TTL
+        ip[9] = IPPROTO_UDP;
+        memcpy(ip + 12, &r->src, 4);
+        memcpy(ip + 16, &r->dst, 4);
+        uint16_t sum = htons(ip_checksum(ip, 20));
+        memcpy(ip + 10, &sum, 2);
+        memcpy(ip + 20, &r->sport, 2);
+        memcpy(ip + 22, &r->dport, 2);
+        memcpy(ip + 24, &udp_len, 2);       // UDP checksum 0: not computed
+
+        size_t first = capture_size - r->offset < r->cap_len ? capture_size - r->offset : r->cap_len;
+        ok = put(out, &rec, sizeof(rec)) && put(out, ip, sizeof(ip))
+            && put(out, bytes + r->offset, first) && put(out, bytes, r->cap_len - first);
+        written++;
+    }
+    if (ok) ok = flush(out);
+
+    int err = errno;
+    free(out);
+    if (!ok) {
+        errno = err;
+        return -1;
+    }
+    LOG_INFO("Wrote %d captured packets, %llu recorded, %llu overwritten",
+             written, (unsigned long long)recorded, (unsigned long long)evicted);
+    return written;
+}
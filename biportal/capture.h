@@ -0,0 +1,31 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+// Optional in-memory record of the TFTP datagrams we send and receive, for
+// when the logs can't explain what a device did on the wire. Packets are
+// kept with monotonic timestamps in a ring of bounded size, the oldest
+// falling out first, and written out as pcap (raw IPv4, with IP and UDP
+// headers made up from the addresses) on request.
+
+// Handles "capture=off|headers|full" and "capture_size=BYTES". Headers mode
+// keeps the first 64 bytes of each datagram: opcode, block number and the
+// request or error text. Returns false if the option isn't ours.
+bool capture_configure(const char *config);
+
+extern bool capture_enabled;
+
+#define CAPTURE(src, dst, data, len) do { \
+        if (capture_enabled) capture_record((src), (dst), (data), (len)); \
+    } while (0)
+
+void capture_record(const struct sockaddr_in *src, const struct sockaddr_in *dst, const void *data, size_t len);
+
+// Write what's in the ring to fd as a pcap file. Returns the number of
+// packets written or -1 with errno set.
+int capture_dump(int fd);
+
+#endif
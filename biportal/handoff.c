@@ -0,0 +1,472 @@
+#ifdef __linux__
+#define _GNU_SOURCE             // struct ucred
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "biportal.h"
+#include "bufpool.h"
+#include "handoff.h"
+
+#define HANDOFF_MAGIC "BIPHAND1"
+#define HANDOFF_TIMEOUT 5           // seconds either side waits for the other
+#define HANDOFF_MAX_CONFIGS 128
+
+// Everything about a transfer but its descriptors, which travel alongside,
+// and its names and last packet, which follow it. Both ends are the same
+// machine; a successor built with a different layout is turned away.
+typedef struct {
+    uint16_t transfer_id;
+    uint16_t block;
+    uint8_t is_write;
+    uint8_t waiting_approval;
+    uint8_t opt_blksize;
+    uint8_t opt_tsize;
+    uint8_t opt_timeout;
+    uint8_t oack_pending;
+    uint8_t last_block_sent;
+    uint8_t dallying;
+    uint8_t hashing;
+    uint8_t hashed;
+    uint8_t packed;             // served from the pack, looked up again by name
+    uint8_t compressed;         // fd is a compressed image, inflated anew up to offset
+    uint8_t has_point;          // and a checkpoint to start from follows the packet
+    uint8_t has_fd;
+    int32_t block_size;
+    int32_t timeout;
+    int32_t packet_len;
+    int32_t last_data_len;
+    int32_t retries;
+    uint32_t names_len;         // filename and mode, both terminated
+    int64_t file_size;
+    int64_t offset;
+    int64_t last_activity;
+    uint64_t bytes;
+    uint64_t started;
+    struct sockaddr_in client_addr;
+    struct stat st;
+    char sha256[HASH_SHA256_HEX];
+    char xxh64[HASH_XXH64_HEX];
+    hash_ctx_t hash;
+} handoff_transfer_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t configs;
+    uint32_t transfers;
+    int32_t next_transfer_id;
+    int32_t client_connected;
+    uint32_t ipc_peer_len;
+    struct sockaddr_un ipc_peer;
+} handoff_header_t;
+
+static char *configs[HANDOFF_MAX_CONFIGS];
+static int config_count = 0;
+
+void handoff_remember(const char *config) {
+    // A repeated option moves to the end, so the order of the last round
+    // PumpKIN sent is what gets replayed
+    int i;
+    for (i = 0; i < config_count && strcmp(configs[i], config); i++);
+    char *copy;
+    if (i < config_count) {
+        copy = configs[i];
+    } else if (!(copy = strdup(config))) {
+        return;
+    } else if (config_count < HANDOFF_MAX_CONFIGS) {
+        configs[config_count++] = copy;
+        return;
+    } else {
+        free(configs[0]);       // the oldest makes room
+        i = 0;
+    }
+    memmove(&configs[i], &configs[i + 1], (config_count - i - 1) * sizeof(char *));
+    configs[config_count - 1] = copy;
+}
+
+static struct sockaddr_un handoff_addr(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, HANDOFF_PATH, sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+static void set_timeouts(int sock) {
+    struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Sockets, settings and transfers only ever go to or come from a process of
+// our own user, root in earnest; the rendezvous is in /tmp for anyone to
+// squat on, so it's the process on the other end that counts
+static bool peer_trusted(int sock) {
+    uid_t uid;
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) return false;
+    uid = cred.uid;
+#else
+    gid_t gid;
+    if (getpeereid(sock, &uid, &gid) < 0) return false;
+#endif
+    return uid == geteuid();
+}
+
+int handoff_listen(void) {
+    struct sockaddr_un addr = handoff_addr();
+    unlink(HANDOFF_PATH);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    // Whoever connects gets our sockets, so only our own user may
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || chmod(HANDOFF_PATH, 0600) < 0 || listen(sock, 1) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+// The descriptors go with the first byte of the record
+static bool send_record(int sock, const void *data, size_t len, const int *fds, int nfds) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = { (void *)data, len };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+    ssize_t n = sendmsg(sock, &mh, 0);
+    if (n <= 0) return false;
+    for (size_t sent = n; sent < len; sent += n) {
+        n = send(sock, (const char *)data + sent, len - sent, 0);
+        if (n <= 0) return false;
+    }
+    return true;
+}
+
+// Returns how many descriptors came along, at most max, or -1
+static int recv_record(int sock, void *data, size_t len, int *fds, int max) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = { data, len };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    for (int i = 0; i < max; i++) fds[i] = -1;
+
+    ssize_t n = recvmsg(sock, &mh, 0);
+    if (n <= 0) return -1;
+    int got = 0;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (got < max) fds[got++] = fd;
+            else close(fd);
+        }
+    }
+    for (size_t received = n; received < len; received += n) {
+        n = recv(sock, (char *)data + received, len - received, 0);
+        if (n <= 0) {
+            for (int i = 0; i < got; i++) close(fds[i]);
+            return -1;
+        }
+    }
+    return got;
+}
+
+bool handoff_movable(const transfer_t *transfer) {
+    return transfer->active && !transfer->fetch && !transfer->sink;
+}
+
+static bool send_transfer(int sock, const transfer_t *t) {
+    handoff_transfer_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.transfer_id = t->transfer_id;
+    rec.block = t->block;
+    rec.is_write = t->is_write;
+    rec.waiting_approval = t->waiting_approval;
+    rec.opt_blksize = t->opt_blksize;
+    rec.opt_tsize = t->opt_tsize;
+    rec.opt_timeout = t->opt_timeout;
+    rec.oack_pending = t->oack_pending;
+    rec.last_block_sent = t->last_block_sent;
+    rec.dallying = t->dallying;
+    rec.hashing = t->hashing;
+    rec.hashed = t->hashed;
+    rec.packed = t->pack != NULL;
+    rec.compressed = t->zimage != NULL;
+    rec.has_fd = t->fd >= 0;
+    rec.block_size = t->block_size;
+    rec.timeout = t->timeout;
+    rec.packet_len = t->packet ? t->packet_len : 0;
+    rec.last_data_len = t->last_data_len;
+    rec.retries = t->retries;
+    rec.names_len = strlen(t->filename) + 1 + strlen(t->mode) + 1;
+    rec.file_size = t->file_size;
+    rec.offset = t->offset;
+    rec.last_activity = t->last_activity;
+    rec.bytes = t->bytes;
+    rec.started = t->started;
+    rec.client_addr = t->client_addr;
+    rec.st = t->st;
+    memcpy(rec.sha256, t->sha256, HASH_SHA256_HEX);
+    memcpy(rec.xxh64, t->xxh64, HASH_XXH64_HEX);
+    rec.hash = t->hash;
+
+    // The successor has to inflate its way to the offset; give it a head start
+    static zimage_point_t point;
+    rec.has_point = t->zimage && zimage_point(t->zimage, t->offset, &point);
+
+    int fds[2] = { t->client_socket, t->fd };
+    return send_record(sock, &rec, sizeof(rec), fds, rec.has_fd ? 2 : 1)
+        && send_record(sock, t->filename, rec.names_len, NULL, 0)
+        && (!rec.packet_len || send_record(sock, t->packet, rec.packet_len, NULL, 0))
+        && (!rec.has_point || send_record(sock, &point, sizeof(point), NULL, 0));
+}
+
+bool handoff_serve(int listen_fd, const handoff_state_t *state) {
+    int sock = accept(listen_fd, NULL, NULL);
+    if (sock < 0) return false;
+    if (!peer_trusted(sock)) {
+        LOG_ERROR("Handoff: the successor runs as somebody else, ignoring");
+        close(sock);
+        return false;
+    }
+    set_timeouts(sock);
+
+    char magic[8];
+    if (recv_record(sock, magic, sizeof(magic), NULL, 0) < 0 || memcmp(magic, HANDOFF_MAGIC, sizeof(magic))) {
+        LOG_ERROR("Handoff: unexpected greeting, ignoring");
+        close(sock);
+        return false;
+    }
+
+    handoff_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HANDOFF_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(handoff_transfer_t);
+    header.configs = config_count;
+    for (int i = 0; i < max_transfers; i++) {
+        if (handoff_movable(&transfers[i])) header.transfers++;
+    }
+    header.next_transfer_id = state->next_transfer_id;
+    header.client_connected = state->client_connected;
+    header.ipc_peer_len = state->ipc_peer_len;
+    header.ipc_peer = state->ipc_peer;
+
+    LOG_INFO("Handing over to a successor: %u transfers, %u options", header.transfers, header.configs);
+    int fds[2] = { state->tftp_sock, state->ipc_sock };
+    bool ok = send_record(sock, &header, sizeof(header), fds, 2);
+    for (int i = 0; ok && i < config_count; i++) {
+        uint32_t len = strlen(configs[i]) + 1;
+        ok = send_record(sock, &len, sizeof(len), NULL, 0) && send_record(sock, configs[i], len, NULL, 0);
+    }
+    for (int i = 0; ok && i < max_transfers; i++) {
+        if (handoff_movable(&transfers[i])) ok = send_transfer(sock, &transfers[i]);
+    }
+
+    // Nothing is ours to let go of until the successor says it has it all
+    char ack = 0;
+    ok = ok && recv_record(sock, &ack, 1, NULL, 0) == 0 && ack == 'K';
+    if (!ok) {
+        LOG_ERROR("Handoff failed, carrying on: %s", errno ? strerror(errno) : "successor gave up");
+    }
+    close(sock);
+    return ok;
+}
+
+// Put a transfer from the predecessor into our table as it was there
+static void restore_transfer(const handoff_transfer_t *rec, char *names, char *packet, const int *fds,
+                             const zimage_point_t *point) {
+    transfer_t *t = transfer_free_slot();
+    pack_file_t packed;
+    pack_t *pack = rec->packed ? pack_lookup(names, &packed) : NULL;
+    zimage_t *zimage = t && rec->compressed && rec->has_fd ? zimage_open(fds[1], &rec->st) : NULL;
+    if (!t || (rec->packed && (!pack || packed.size != rec->file_size)) || (rec->compressed && !zimage)) {
+        // Can't go on with it here, the client had better ask again
+        LOG_ERROR("Handoff: dropping transfer %d of '%s'", rec->transfer_id, names);
+        struct sockaddr_in client = rec->client_addr;
+        send_error(fds[0], &client, TFTP_ERR_UNDEFINED, "Server restarted");
+        if (pack) pack_release(pack);
+        close(fds[0]);
+        if (rec->has_fd) close(fds[1]);
+        bufpool_free(names);
+        bufpool_free(packet);
+        return;
+    }
+
+    memset(t, 0, sizeof(transfer_t));
+    t->filename = names;
+    t->mode = names + strlen(names) + 1;
+    t->client_socket = fds[0];
+    socklen_t local_len = sizeof(t->local_addr);
+    getsockname(t->client_socket, (struct sockaddr *)&t->local_addr, &local_len);
+    t->client_addr = rec->client_addr;
+    t->is_write = rec->is_write;
+    t->fd = rec->has_fd ? fds[1] : -1;
+    t->pack = pack;
+    t->pack_data = pack ? packed.data : NULL;
+    t->zimage = zimage;
+    if (zimage && point) zimage_adopt(zimage, point);
+    t->st = rec->st;
+    t->file_size = rec->file_size;
+    t->offset = rec->offset;
+    t->block = rec->block;
+    t->transfer_id = rec->transfer_id;
+    t->last_activity = rec->last_activity;
+    t->waiting_approval = rec->waiting_approval;
+    t->block_size = rec->block_size;
+    t->timeout = rec->timeout;
+    t->opt_blksize = rec->opt_blksize;
+    t->opt_tsize = rec->opt_tsize;
+    t->opt_timeout = rec->opt_timeout;
+    t->oack_pending = rec->oack_pending;
+    t->last_block_sent = rec->last_block_sent;
+    t->dallying = rec->dallying;
+    t->packet = packet;
+    t->packet_len = rec->packet_len;
+    t->last_data_len = rec->last_data_len;
+    t->retries = rec->retries;
+    t->bytes = rec->bytes;
+    t->started = rec->started;
+    t->hash = rec->hash;
+    t->hashing = rec->hashing;
+    t->hashed = rec->hashed;
+    memcpy(t->sha256, rec->sha256, HASH_SHA256_HEX);
+    memcpy(t->xxh64, rec->xxh64, HASH_XXH64_HEX);
+    if (t->packet_len) transfer_arm(t, monotonic_ms());
+    t->active = true;
+}
+
+static bool take_transfer(int sock) {
+    handoff_transfer_t rec;
+    int fds[2];
+    int got = recv_record(sock, &rec, sizeof(rec), fds, 2);
+    if (got < 0) return false;
+    if (got != (rec.has_fd ? 2 : 1)) {
+        for (int i = 0; i < got; i++) close(fds[i]);
+        return false;
+    }
+
+    // The names go into a pooled buffer, as setup_transfer() has them
+    char *names = rec.names_len >= 2 && rec.names_len <= TFTP_PACKET_MAX ? bufpool_alloc(rec.names_len) : NULL;
+    char *packet = NULL;
+    bool ok = names && recv_record(sock, names, rec.names_len, NULL, 0) == 0
+        && names[rec.names_len - 1] == '\0' && strlen(names) + 2 <= rec.names_len;
+    if (ok && !rec.waiting_approval) {
+        transfer_t probe = { .block_size = rec.block_size };
+        int size = transfer_packet_size(&probe);
+        ok = rec.block_size > 0 && rec.packet_len >= 0 && rec.packet_len <= size && (packet = bufpool_alloc(size))
+            && (!rec.packet_len || recv_record(sock, packet, rec.packet_len, NULL, 0) == 0);
+    }
+    static zimage_point_t point;
+    ok = ok && (!rec.has_point || recv_record(sock, &point, sizeof(point), NULL, 0) == 0);
+    if (!ok) {
+        bufpool_free(names);
+        bufpool_free(packet);
+        for (int i = 0; i < got; i++) close(fds[i]);
+        return false;
+    }
+    restore_transfer(&rec, names, packet, fds, rec.has_point ? &point : NULL);
+    return true;
+}
+
+int handoff_take(handoff_state_t *state, void (*apply)(const char *config)) {
+    struct sockaddr_un addr = handoff_addr();
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return 0;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        // Nobody running, start afresh
+        close(sock);
+        return 0;
+    }
+    if (!peer_trusted(sock)) {
+        // Not a biportal of ours; ours listens there once we're up
+        LOG_ERROR("Handoff: %s belongs to somebody else, starting afresh", HANDOFF_PATH);
+        close(sock);
+        return 0;
+    }
+    set_timeouts(sock);
+
+    handoff_header_t header;
+    int fds[2];
+    if (!send_record(sock, HANDOFF_MAGIC, 8, NULL, 0) || recv_record(sock, &header, sizeof(header), fds, 2) != 2) {
+        LOG_ERROR("Handoff: no answer from the running server");
+        close(sock);
+        return -1;
+    }
+    if (memcmp(header.magic, HANDOFF_MAGIC, sizeof(header.magic)) || header.record_size != sizeof(handoff_transfer_t)
+        || header.ipc_peer_len > sizeof(header.ipc_peer)) {
+        LOG_ERROR("Handoff: the running server speaks another format");
+        close(fds[0]);
+        close(fds[1]);
+        close(sock);
+        return -1;
+    }
+    state->tftp_sock = fds[0];
+    state->ipc_sock = fds[1];
+    state->next_transfer_id = header.next_transfer_id;
+    state->client_connected = header.client_connected;
+    state->ipc_peer = header.ipc_peer;
+    state->ipc_peer_len = header.ipc_peer_len;
+
+    // Configure as the predecessor was before taking on its transfers, the
+    // root and the pack among it
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < header.configs; i++) {
+        char config[IPC_MESSAGE_SIZE];
+        uint32_t len;
+        ok = recv_record(sock, &len, sizeof(len), NULL, 0) == 0 && len > 0 && len <= sizeof(config)
+            && recv_record(sock, config, len, NULL, 0) == 0;
+        if (ok) {
+            config[len - 1] = '\0';
+            handoff_remember(config);
+            apply(config);
+        }
+    }
+    for (uint32_t i = 0; ok && i < header.transfers; i++) {
+        ok = take_transfer(sock);
+    }
+
+    // Only now may the predecessor let go
+    char ack = 'K';
+    ok = ok && send_record(sock, &ack, 1, NULL, 0);
+    close(sock);
+    if (!ok) {
+        LOG_ERROR("Handoff: taking over failed");
+        return -1;
+    }
+    LOG_INFO("Took over %u transfers from the running server", header.transfers);
+    return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "transfer.h"
+
+// Restart without dropping anybody: a biportal that starts while another
+// one runs takes over from it instead of binding the port. The running one
+// passes the listening and IPC sockets, the configuration it was given and
+// every transfer it can (socket, open file and state, last packet
+// included) over a Unix socket with SCM_RIGHTS. The newcomer carries on
+// where it left off, at worst after a retransmission. Transfers fed by an
+// upstream fetch or feeding a sink stay with the old process, which
+// finishes them and exits.
+
+#define HANDOFF_PATH "/tmp/pumpkin_handoff"
+
+// What goes with the sockets besides the transfers
+typedef struct {
+    int tftp_sock;
+    int ipc_sock;
+    int next_transfer_id;
+    int client_connected;
+    struct sockaddr_un ipc_peer;
+    socklen_t ipc_peer_len;
+} handoff_state_t;
+
+// Keep a configuration option to pass on; they are replayed in order
+void handoff_remember(const char *config);
+
+// Listen for a successor at HANDOFF_PATH. Returns the socket or -1.
+int handoff_listen(void);
+
+// Whether a transfer can move to another process
+bool handoff_movable(const transfer_t *transfer);
+
+// Hand everything over to the successor connecting on listen_fd. Returns
+// true once it confirmed it took over; the movable transfers are then its
+// business and only need releasing here. On false nothing changed hands.
+bool handoff_serve(int listen_fd, const handoff_state_t *state);
+
+// Take over from a running biportal, replaying its configuration through
+// apply and filling the transfer table. Returns 1 when we took over, 0 if
+// nobody is running and -1 when taking over failed.
+int handoff_take(handoff_state_t *state, void (*apply)(const char *config));
+
+#endif
@@ -0,0 +1,203 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "hash.h"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_ctx_t *ctx, const uint8_t *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 |
+               (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256_init(sha256_ctx_t *ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->buffered = 0;
+}
+
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    ctx->length += len;
+
+    if (ctx->buffered) {
+        size_t n = 64 - ctx->buffered;
+        if (n > len) n = len;
+        memcpy(ctx->buffer + ctx->buffered, p, n);
+        ctx->buffered += n;
+        p += n;
+        len -= n;
+        if (ctx->buffered < 64) return;
+        sha256_block(ctx, ctx->buffer);
+        ctx->buffered = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+        sha256_block(ctx, p);
+    }
+    memcpy(ctx->buffer, p, len);
+    ctx->buffered = len;
+}
+
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[32]) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (ctx->buffered < 56 ? 56 : 120) - ctx->buffered;
+
+    for (int i = 0; i < 8; i++) {
+        pad[pad_len + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    sha256_update(ctx, pad, pad_len + 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+#define ROL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint32_t read32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = ROL64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh64_round(0, v);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+void xxh64_init(xxh64_ctx_t *ctx, uint64_t seed) {
+    ctx->v[0] = seed + XXH_P1 + XXH_P2;
+    ctx->v[1] = seed + XXH_P2;
+    ctx->v[2] = seed;
+    ctx->v[3] = seed - XXH_P1;
+    ctx->length = 0;
+    ctx->buffered = 0;
+}
+
+void xxh64_update(xxh64_ctx_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    ctx->length += len;
+
+    if (ctx->buffered + len < 32) {
+        memcpy(ctx->buffer + ctx->buffered, p, len);
+        ctx->buffered += len;
+        return;
+    }
+    if (ctx->buffered) {
+        size_t n = 32 - ctx->buffered;
+        memcpy(ctx->buffer + ctx->buffered, p, n);
+        for (int i = 0; i < 4; i++) ctx->v[i] = xxh64_round(ctx->v[i], read64(ctx->buffer + i * 8));
+        p += n;
+        len -= n;
+        ctx->buffered = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32) {
+        for (int i = 0; i < 4; i++) ctx->v[i] = xxh64_round(ctx->v[i], read64(p + i * 8));
+    }
+    memcpy(ctx->buffer, p, len);
+    ctx->buffered = len;
+}
+
+uint64_t xxh64_digest(const xxh64_ctx_t *ctx) {
+    uint64_t h;
+    if (ctx->length >= 32) {
+        h = ROL64(ctx->v[0], 1) + ROL64(ctx->v[1], 7) + ROL64(ctx->v[2], 12) + ROL64(ctx->v[3], 18);
+        for (int i = 0; i < 4; i++) h = xxh64_merge(h, ctx->v[i]);
+    } else {
+        h = ctx->v[2] + XXH_P5;
+    }
+    h += ctx->length;
+
+    const uint8_t *p = ctx->buffer, *end = ctx->buffer + ctx->buffered;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = ROL64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * XXH_P1;
+        h = ROL64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_P5;
+        h = ROL64(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+void hash_init(hash_ctx_t *ctx) {
+    sha256_init(&ctx->sha256);
+    xxh64_init(&ctx->xxh64, 0);
+}
+
+void hash_update(hash_ctx_t *ctx, const void *data, size_t len) {
+    sha256_update(&ctx->sha256, data, len);
+    xxh64_update(&ctx->xxh64, data, len);
+}
+
+void hash_final(hash_ctx_t *ctx, char sha256_hex[HASH_SHA256_HEX], char xxh64_hex[HASH_XXH64_HEX]) {
+    uint8_t digest[32];
+    sha256_final(&ctx->sha256, digest);
+    for (int i = 0; i < 32; i++) {
+        snprintf(sha256_hex + i * 2, 3, "%02x", digest[i]);
+    }
+    snprintf(xxh64_hex, HASH_XXH64_HEX, "%016llx", (unsigned long long)xxh64_digest(&ctx->xxh64));
+}
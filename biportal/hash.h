@@ -0,0 +1,46 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Incremental SHA-256 and XXH64 so transfers can be fingerprinted as the
+// blocks go by instead of re-reading the file afterwards. Shared by biportal
+// and the PumpKIN client/server engine.
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    size_t buffered;
+} sha256_ctx_t;
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t length;
+    uint8_t buffer[32];
+    size_t buffered;
+} xxh64_ctx_t;
+
+typedef struct {
+    sha256_ctx_t sha256;
+    xxh64_ctx_t xxh64;
+} hash_ctx_t;
+
+#define HASH_SHA256_HEX 65
+#define HASH_XXH64_HEX 17
+
+void sha256_init(sha256_ctx_t *ctx);
+void sha256_update(sha256_ctx_t *ctx, const void *data, size_t len);
+void sha256_final(sha256_ctx_t *ctx, uint8_t digest[32]);
+
+void xxh64_init(xxh64_ctx_t *ctx, uint64_t seed);
+void xxh64_update(xxh64_ctx_t *ctx, const void *data, size_t len);
+uint64_t xxh64_digest(const xxh64_ctx_t *ctx);
+
+// Both at once, finished into lowercase hex strings
+void hash_init(hash_ctx_t *ctx);
+void hash_update(hash_ctx_t *ctx, const void *data, size_t len);
+void hash_final(hash_ctx_t *ctx, char sha256_hex[HASH_SHA256_HEX], char xxh64_hex[HASH_XXH64_HEX]);
+
+#endif
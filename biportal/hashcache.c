@@ -0,0 +1,72 @@
+#include <string.h>
+#include <stdint.h>
+
+#include "hashcache.h"
+
+#define HASHCACHE_ENTRIES 256
+
+typedef struct {
+    bool used;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    unsigned long stamp;
+    char sha256[HASH_SHA256_HEX];
+    char xxh64[HASH_XXH64_HEX];
+} hashcache_entry_t;
+
+static hashcache_entry_t entries[HASHCACHE_ENTRIES];
+static unsigned long clock_hand = 0;
+
+static long mtime_nsec(const struct stat *st) {
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+static bool same_file(const hashcache_entry_t *e, const struct stat *st) {
+    return e->used && e->ino == st->st_ino && e->dev == st->st_dev && e->size == st->st_size
+        && e->mtime == st->st_mtime && e->mtime_nsec == mtime_nsec(st);
+}
+
+bool hashcache_lookup(const struct stat *st, char sha256[HASH_SHA256_HEX], char xxh64[HASH_XXH64_HEX]) {
+    for (int i = 0; i < HASHCACHE_ENTRIES; i++) {
+        hashcache_entry_t *e = &entries[i];
+        if (!same_file(e, st)) continue;
+        e->stamp = ++clock_hand;
+        memcpy(sha256, e->sha256, HASH_SHA256_HEX);
+        memcpy(xxh64, e->xxh64, HASH_XXH64_HEX);
+        return true;
+    }
+    return false;
+}
+
+void hashcache_store(const struct stat *st, const char *sha256, const char *xxh64) {
+    hashcache_entry_t *slot = NULL;
+
+    // Same inode again (rewritten in place) or the least recently used entry
+    for (int i = 0; i < HASHCACHE_ENTRIES; i++) {
+        hashcache_entry_t *e = &entries[i];
+        if (e->used && e->ino == st->st_ino && e->dev == st->st_dev) {
+            slot = e;
+            break;
+        }
+        if (!slot || (slot->used && (!e->used || e->stamp < slot->stamp))) slot = e;
+    }
+
+    slot->used = true;
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime = st->st_mtime;
+    slot->mtime_nsec = mtime_nsec(st);
+    slot->stamp = ++clock_hand;
+    strncpy(slot->sha256, sha256, HASH_SHA256_HEX - 1);
+    slot->sha256[HASH_SHA256_HEX - 1] = '\0';
+    strncpy(slot->xxh64, xxh64, HASH_XXH64_HEX - 1);
+    slot->xxh64[HASH_XXH64_HEX - 1] = '\0';
+}
@@ -0,0 +1,17 @@
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "hash.h"
+
+// Digests of files we have already streamed in full, keyed by device, inode,
+// size and modification time, so serving or verifying an unchanged file
+// again doesn't cost a hashing pass. Any change to the file changes its key,
+// stale entries simply age out.
+
+bool hashcache_lookup(const struct stat *st, char sha256[HASH_SHA256_HEX], char xxh64[HASH_XXH64_HEX]);
+void hashcache_store(const struct stat *st, const char *sha256, const char *xxh64);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "log.h"
+
+#define LOG_RING_SLOTS 1024 // must be a power of two
+#define LOG_LINE_MAX 256
+#define LOG_BATCH_SIZE 65536
+#define LOG_IDLE_NSEC 20000000L
+
+// Bounded multi-producer queue: each slot's sequence number says whether it
+// is free for the producer claiming position pos (seq == pos) or holds a
+// message for the consumer (seq == pos + 1).
+typedef struct {
+    atomic_size_t seq;
+    unsigned short len;
+    char line[LOG_LINE_MAX];
+} log_slot_t;
+
+volatile int log_level = LOG_LEVEL_INFO;
+
+static log_slot_t ring[LOG_RING_SLOTS];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;
+static atomic_uint_fast64_t dropped;
+static uint64_t dropped_reported;
+static atomic_bool stopping;
+static pthread_t flusher;
+static bool flusher_running = false;
+
+void log_write(const char *fmt, ...) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    log_slot_t *slot;
+
+    for (;;) {
+        slot = &ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Ring is full, never wait for the flusher
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(slot->line, LOG_LINE_MAX - 1, fmt, ap);
+    va_end(ap);
+
+    if (len < 0) len = 0;
+    if (len > LOG_LINE_MAX - 2) len = LOG_LINE_MAX - 2;
+    slot->line[len++] = '\n';
+    slot->len = (unsigned short)len;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+// Move everything queued into one buffer and write it with a single call.
+// Only ever called from one thread at a time.
+static size_t drain(void) {
+    static char batch[LOG_BATCH_SIZE];
+    size_t total = 0;
+
+    for (;;) {
+        size_t used = 0;
+
+        while (used + LOG_LINE_MAX <= sizeof(batch)) {
+            log_slot_t *slot = &ring[dequeue_pos & (LOG_RING_SLOTS - 1)];
+            size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (seq != dequeue_pos + 1) break;
+
+            memcpy(batch + used, slot->line, slot->len);
+            used += slot->len;
+            atomic_store_explicit(&slot->seq, dequeue_pos + LOG_RING_SLOTS, memory_order_release);
+            dequeue_pos++;
+        }
+
+        uint64_t d = atomic_load_explicit(&dropped, memory_order_relaxed);
+        if (d != dropped_reported && used + LOG_LINE_MAX <= sizeof(batch)) {
+            used += snprintf(batch + used, LOG_LINE_MAX, "WARNING: %llu log messages dropped\n",
+                             (unsigned long long)(d - dropped_reported));
+            dropped_reported = d;
+        }
+
+        if (!used) break;
+        for (size_t off = 0; off < used; ) {
+            ssize_t w = write(STDERR_FILENO, batch + off, used - off);
+            if (w <= 0) break;
+            off += w;
+        }
+        total += used;
+    }
+    return total;
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    struct timespec idle = { 0, LOG_IDLE_NSEC };
+
+    while (!atomic_load(&stopping)) {
+        if (!drain()) nanosleep(&idle, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+void log_init(void) {
+    for (size_t i = 0; i < LOG_RING_SLOTS; i++) {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_init(&enqueue_pos, 0);
+    dequeue_pos = 0;
+
+    const char *env = getenv("BIPORTAL_LOG_LEVEL");
+    if (env) {
+        int level = log_level_from_name(env);
+        if (level >= 0) log_level = level;
+    }
+
+    atomic_store(&stopping, false);
+    flusher_running = pthread_create(&flusher, NULL, flusher_main, NULL) == 0;
+}
+
+void log_shutdown(void) {
+    if (flusher_running) {
+        atomic_store(&stopping, true);
+        pthread_join(flusher, NULL);
+        flusher_running = false;
+    } else {
+        drain();
+    }
+}
+
+int log_level_from_name(const char *name) {
+    if (!strcasecmp(name, "error")) return LOG_LEVEL_ERROR;
+    if (!strcasecmp(name, "info")) return LOG_LEVEL_INFO;
+    if (!strcasecmp(name, "debug")) return LOG_LEVEL_DEBUG;
+    if (name[0] >= '0' && name[0] <= '9') {
+        int level = atoi(name);
+        return level > LOG_LEVEL_DEBUG ? LOG_LEVEL_DEBUG : level;
+    }
+    return -1;
+}
+
+uint64_t log_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
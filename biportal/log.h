@@ -0,0 +1,39 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Logging goes through a lock-free ring drained by a background thread that
+// writes to stderr in batches, so the packet path never blocks on I/O. When
+// the ring is full messages are dropped and counted instead.
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_DEBUG 2
+
+// Messages above this level are compiled out entirely
+#ifndef BIPORTAL_LOG_LEVEL
+#define BIPORTAL_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern volatile int log_level;
+
+#define LOG_AT(level, prefix, fmt, ...) do { \
+        if ((level) <= BIPORTAL_LOG_LEVEL && (level) <= log_level) \
+            log_write(prefix fmt, ##__VA_ARGS__); \
+    } while (0)
+
+#define LOG_ERROR(fmt, ...) LOG_AT(LOG_LEVEL_ERROR, "ERROR: ", fmt, ##__VA_ARGS__)
+#define LOG_INFO(fmt, ...) LOG_AT(LOG_LEVEL_INFO, "INFO: ", fmt, ##__VA_ARGS__)
+// Per-packet and per-option chatter, off unless log_level=debug is configured
+#define LOG_DEBUG(fmt, ...) LOG_AT(LOG_LEVEL_DEBUG, "DEBUG: ", fmt, ##__VA_ARGS__)
+
+void log_init(void);
+void log_shutdown(void);
+void log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Parses "error", "info", "debug" or a number; returns -1 if unrecognised
+int log_level_from_name(const char *name);
+uint64_t log_dropped(void);
+
+#endif
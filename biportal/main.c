@@ -1,3 +1,6 @@
+#ifdef __linux__
+#define _GNU_SOURCE             // struct ucred, SCM_CREDENTIALS
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -7,6 +10,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <spawn.h>
 #include <sys/un.h>
 #include <fcntl.h>
@@ -16,84 +20,116 @@
 #include <signal.h>
 #include <limits.h>   // For PATH_MAX
 #include <time.h>     // For time() function
+#include <stddef.h>
+
+#include "biportal.h"
+#include "pathcache.h"
+#include "admission.h"
+#include "hashcache.h"
+#include "capture.h"
+#include "pmtu.h"
+#include "bufpool.h"
+#include "relay.h"
+#include "packet.h"
+#include "transfer.h"
+#include "sink.h"
+#include "pack.h"
+#include "warm.h"
+#include "handoff.h"
+#include "ratelimit.h"
+#include "shaper.h"
+#include "zimage.h"
+
+#define TFTP_MAX_RETRIES 5
 
-#define SOCKET_PATH "/tmp/pumpkin_socket"
-#define LOG_ERROR(fmt, ...) fprintf(stderr, "ERROR: " fmt "\n", ##__VA_ARGS__)
-#define LOG_INFO(fmt, ...) fprintf(stderr, "INFO: " fmt "\n", ##__VA_ARGS__)
-#define BUFFER_SIZE 8192
-
-#define TFTP_RRQ 1
-#define TFTP_WRQ 2
-#define TFTP_DATA 3
-#define TFTP_ACK 4
-#define TFTP_ERROR 5
-#define TFTP_OACK 6
-
-// Error codes
-#define TFTP_ERR_UNDEFINED 0
-#define TFTP_ERR_NOT_FOUND 1
-#define TFTP_ERR_ACCESS_VIOLATION 2
-#define TFTP_ERR_DISK_FULL 3
-#define TFTP_ERR_ILLEGAL_OP 4
-#define TFTP_ERR_UNKNOWN_TID 5
-#define TFTP_ERR_FILE_EXISTS 6
-#define TFTP_ERR_NO_USER 7
-#define TFTP_ERR_OPTION 8
-
-// Command types between PumpKIN and helper
-#define CMD_HELLO 1
-#define CMD_READY 2
-#define CMD_CONFIG 3
-#define CMD_TRANSFER_REQUEST 4
-#define CMD_TRANSFER_STATUS 5
-#define CMD_TRANSFER_DONE 6
-#define CMD_TRANSFER_APPROVE 7
-#define CMD_TRANSFER_DENY 8
-#define CMD_SHUTDOWN 9
-
-typedef struct {
-    uint16_t cmd;
-    uint16_t transfer_id;
-    char data[BUFFER_SIZE - 4];
-} ipc_message_t;
-
-typedef struct {
-    int client_socket;
-    struct sockaddr_in client_addr;
-    char filename[256];
-    char mode[32];
-    bool is_write;
-    FILE *file;
-    uint16_t block;
-    uint16_t transfer_id;
-    time_t last_activity;
-    bool waiting_approval;
-    int block_size;
-    bool active;
-} transfer_t;
 
 // Global variables
 char tftp_root[PATH_MAX] = "/tmp";
 int client_connected = 0;
-int max_transfers = 20;
-transfer_t transfers[20]; // Support up to 20 concurrent transfers
 int next_transfer_id = 1;
-bool shutdown_requested = false;
+volatile sig_atomic_t shutdown_requested = 0;
+volatile sig_atomic_t shutdown_signal = 0;
+struct sockaddr_in listen_addr;
+int ipc_sock = -1;
+struct sockaddr_un ipc_peer;
+socklen_t ipc_peer_len = 0;
+bool pmtu_clamp = true;         // keep blocks within the path MTU
+uid_t ipc_owner;                // who besides root may use the IPC socket
+
+// Room for the sender's credentials where the kernel passes them along
+#ifdef SCM_CREDENTIALS
+#define IPC_CRED_SPACE CMSG_SPACE(sizeof(struct ucred))
+#else
+#define IPC_CRED_SPACE 0
+#endif
 
 // Function prototypes
 void handle_tftp_request(int sock, struct sockaddr_in *client_addr, char *buffer, int len);
-void handle_ipc_message(int unix_sock, ipc_message_t *msg, size_t msg_len);
+void handle_ipc_message(int unix_sock, ipc_message_t *msg, size_t msg_len, int passed_fd,
+                        const struct sockaddr_un *from, socklen_t from_len);
+void apply_config(const char *config);
+static int open_listening_socket(const char *address, const char *port);
+static int open_ipc_socket(void);
+static void send_ipc_reply(int unix_sock, const struct sockaddr_un *to, socklen_t to_len,
+                           int cmd, int transfer_id, const char *data);
 void cleanup_transfers(void);
-void send_error(int sock, struct sockaddr_in *addr, int error_code, char *error_msg);
 void handle_read_request(int sock, struct sockaddr_in *client_addr, char *filename, char *mode, char *options, int options_len);
 void handle_write_request(int sock, struct sockaddr_in *client_addr, char *filename, char *mode, char *options, int options_len);
+void handle_transfer_packet(transfer_t *transfer, struct sockaddr_in *from, char *buffer, int len);
+void start_transfer(transfer_t *transfer);
+static void send_next_block(transfer_t *transfer);
+static void transmit(transfer_t *transfer);
+static void acknowledge_data(transfer_t *transfer);
+static void sink_failed(transfer_t *transfer);
 void process_transfer(int sock, transfer_t *transfer);
-void send_ipc_message(int unix_sock, int cmd, int transfer_id, char *data);
+void finish_transfer(transfer_t *transfer, const char *status);
+void release_transfer(transfer_t *transfer);
+void admit_queued_requests(int sock);
+int errno_to_tftp(int err);
 void signal_handler(int signum);
 
 int main(int argc, const char * argv[]) {
-    // Check privileges
-    if (geteuid() != 0) {
+    // Compile a TFTP root into a pack, needs no privileges
+    if (argc == 4 && !strcmp(argv[1], "-P")) {
+        int err = pack_build(argv[2], argv[3]);
+        if (err) {
+            fprintf(stderr, "Packing %s failed: %s\n", argv[2], strerror(err));
+            return 1;
+        }
+        return 0;
+    }
+    
+    // Options come before the address: "-u UID" is the user the IPC socket
+    // is for, PumpKIN's own, since it starts us as root; otherwise it is
+    // whoever started us. "-s RULE" sends matching uploads to a command or
+    // socket (sink.h); that is never up to whoever can reach the socket.
+    ipc_owner = getuid();
+    const char *sink_rules[SINK_MAX_RULES];
+    int sink_rule_count = 0;
+    while (argc >= 3 && (!strcmp(argv[1], "-u") || !strcmp(argv[1], "-s"))) {
+        if (argv[1][1] == 's') {
+            if (sink_rule_count == SINK_MAX_RULES) {
+                fprintf(stderr, "Too many sink rules\n");
+                return 1;
+            }
+            sink_rules[sink_rule_count++] = argv[2];
+        } else {
+            char *end;
+            long uid = strtol(argv[2], &end, 10);
+            if (!*argv[2] || *end || uid < 0) {
+                fprintf(stderr, "Bad user id: %s\n", argv[2]);
+                return 1;
+            }
+            ipc_owner = (uid_t)uid;
+        }
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
+    
+    // Check privileges; only serving an unprivileged port (e.g. for
+    // testing on a plain box) may go without them
+    if (geteuid() != 0 && !(argc == 3 && atoi(argv[2]) >= 1024)) {
         fprintf(stderr, "This program must be run as root.\n");
         printf("%d", EPERM);
         return 1;
@@ -154,68 +190,70 @@ int main(int argc, const char * argv[]) {
     
     // Normal server mode needs bind address and port
     if (argc != 3) {
-        fprintf(stderr, "Usage: %s address port\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-u uid] [-s pattern:|command] [-s pattern:unix:path] address port\n", argv[0]);
         return 1;
     }
     
+    // Start the background log flusher; it drains whatever is queued on exit
+    log_init();
+    atexit(log_shutdown);
+    for (int i = 0; i < sink_rule_count; i++) {
+        if (!sink_add_rule(sink_rules[i])) {
+            fprintf(stderr, "Bad sink rule: %s\n", sink_rules[i]);
+            return 1;
+        }
+    }
+    
     // Set up signal handlers
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    // A sink consumer that goes away shows up as EPIPE on the write
+    signal(SIGPIPE, SIG_IGN);
     
-    // Create UDP socket for TFTP
-    int tftp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (tftp_sock < 0) {
-        LOG_ERROR("Failed to create TFTP socket: %s", strerror(errno));
-        return 1;
-    }
-    
-    // Set socket options
-    int optval = 1;
-    if (setsockopt(tftp_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
-        LOG_ERROR("Failed to set SO_REUSEADDR: %s", strerror(errno));
+    // Initialize transfers
+    memset(transfers, 0, sizeof(transfers));
+    for (int i = 0; i < max_transfers; i++) {
+        transfers[i].fd = -1;
+        transfers[i].client_socket = -1;
     }
+    pathcache_set_root(tftp_root);
     
-    // Bind to specified address and port
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    server_addr.sin_port = htons(atoi(argv[2]));
-    
-    LOG_INFO("Binding to %s:%s", argv[1], argv[2]);
-    if (bind(tftp_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        LOG_ERROR("Failed to bind TFTP socket: %s", strerror(errno));
-        close(tftp_sock);
+    // A biportal that is already running hands us its sockets, settings and
+    // transfers; otherwise we start afresh
+    handoff_state_t handoff;
+    int took_over = handoff_take(&handoff, apply_config);
+    if (took_over < 0) {
         return 1;
     }
-    
-    // Create Unix domain socket for IPC with PumpKIN
-    unlink(SOCKET_PATH); // Remove existing socket if present
-    
-    int unix_sock = socket(AF_UNIX, SOCK_DGRAM, 0);
-    if (unix_sock < 0) {
-        LOG_ERROR("Failed to create Unix socket: %s", strerror(errno));
-        close(tftp_sock);
-        return 1;
+    int tftp_sock, unix_sock;
+    if (took_over) {
+        tftp_sock = handoff.tftp_sock;
+        unix_sock = handoff.ipc_sock;
+        socklen_t addr_len = sizeof(listen_addr);
+        getsockname(tftp_sock, (struct sockaddr *)&listen_addr, &addr_len);
+        next_transfer_id = handoff.next_transfer_id;
+        client_connected = handoff.client_connected;
+        memcpy(&ipc_peer, &handoff.ipc_peer, handoff.ipc_peer_len);
+        ipc_peer_len = handoff.ipc_peer_len;
+    } else {
+        tftp_sock = open_listening_socket(argv[1], argv[2]);
+        if (tftp_sock < 0) {
+            return 1;
+        }
+        unix_sock = open_ipc_socket();
+        if (unix_sock < 0) {
+            close(tftp_sock);
+            return 1;
+        }
     }
+    ipc_sock = unix_sock;
     
-    struct sockaddr_un unix_addr;
-    memset(&unix_addr, 0, sizeof(unix_addr));
-    unix_addr.sun_family = AF_UNIX;
-    strncpy(unix_addr.sun_path, SOCKET_PATH, sizeof(unix_addr.sun_path) - 1);
-    
-    if (bind(unix_sock, (struct sockaddr*)&unix_addr, sizeof(unix_addr)) < 0) {
-        LOG_ERROR("Failed to bind Unix socket: %s", strerror(errno));
-        close(tftp_sock);
-        close(unix_sock);
-        return 1;
+    // Be ready to hand over in turn
+    int handoff_sock = handoff_listen();
+    if (handoff_sock < 0) {
+        LOG_ERROR("Failed to listen for a successor: %s", strerror(errno));
     }
-    
-    // Set permissions for Unix socket
-    chmod(SOCKET_PATH, 0666);
-    
-    // Initialize transfers
-    memset(transfers, 0, sizeof(transfers));
+    bool handed_off = false;
     
     // Report successful startup
     printf("0\n");
@@ -223,17 +261,54 @@ int main(int argc, const char * argv[]) {
     LOG_INFO("TFTP server started successfully");
     
     // Main loop
-    struct pollfd fds[2];
+    struct pollfd fds[4 + 2 * MAX_TRANSFERS + RELAY_MAX_FETCHES];
+    transfer_t *fd_transfer[4 + 2 * MAX_TRANSFERS];
     fds[0].fd = tftp_sock;
     fds[0].events = POLLIN;
     fds[1].fd = unix_sock;
     fds[1].events = POLLIN;
+    fds[2].events = POLLIN;
+    fds[3].fd = handoff_sock;
+    fds[3].events = POLLIN;
     
-    char buffer[BUFFER_SIZE];
+    // Every packet is handled before the next is read, so one buffer for
+    // the largest there can be serves all sockets
+    static char buffer[TFTP_PACKET_MAX];
     
     while (!shutdown_requested) {
-        // Poll for activity on both sockets
-        int poll_result = poll(fds, 2, 1000); // 1-second timeout
+        // Handed over and done with what stayed here
+        if (handed_off && !transfer_active_count()) break;
+        
+        // Poll the listening and IPC sockets, changes under the TFTP root, a
+        // successor, every running transfer, sink consumers we're waiting for
+        // and upstream fetches, waking up for the nearest retransmission
+        fds[2].fd = pathcache_watch_fd();
+        int nfds = 4;
+        uint64_t now = monotonic_ms();
+        int timeout = 1000;
+        for (int i = 0; i < max_transfers; i++) {
+            transfer_t *t = &transfers[i];
+            if (!t->active || t->waiting_approval || t->client_socket < 0) continue;
+            fds[nfds].fd = t->client_socket;
+            fds[nfds].events = POLLIN;
+            fd_transfer[nfds++] = t;
+        }
+        timeout = transfer_next_timeout(now, timeout);
+        timeout = shaper_timeout(now, timeout);
+        int transfer_fds = nfds;
+        for (int i = 0; i < max_transfers; i++) {
+            transfer_t *t = &transfers[i];
+            if (!t->active || !t->sink || !sink_pending(t->sink)) continue;
+            fds[nfds].fd = sink_fd(t->sink);
+            fds[nfds].events = POLLOUT;
+            fd_transfer[nfds++] = t;
+        }
+        int sink_fds = nfds;
+        int relay_fds = relay_poll_fds(fds + nfds, RELAY_MAX_FETCHES);
+        nfds += relay_fds;
+        timeout = relay_timeout(now, timeout);
+        
+        int poll_result = poll(fds, nfds, timeout);
         
         if (poll_result < 0) {
             if (errno == EINTR) continue;
@@ -246,29 +321,125 @@ int main(int argc, const char * argv[]) {
             struct sockaddr_in client_addr;
             socklen_t addr_len = sizeof(client_addr);
             
-            int bytes_received = recvfrom(tftp_sock, buffer, BUFFER_SIZE, 0,
+            int bytes_received = recvfrom(tftp_sock, buffer, sizeof(buffer), 0,
                                          (struct sockaddr*)&client_addr, &addr_len);
             
+            // Storms are cut short before any file or IPC work
             if (bytes_received > 0) {
-                handle_tftp_request(tftp_sock, &client_addr, buffer, bytes_received);
+                CAPTURE(&client_addr, &listen_addr, buffer, bytes_received);
+                if (ratelimit_admit(tftp_sock, &client_addr, buffer, bytes_received, monotonic_ms())) {
+                    handle_tftp_request(tftp_sock, &client_addr, buffer, bytes_received);
+                }
             }
         }
         
         // Check for IPC message from PumpKIN
-        if (fds[1].revents & POLLIN) {
+        if (!handed_off && (fds[1].revents & POLLIN)) {
             ipc_message_t msg;
             struct sockaddr_un from_addr;
-            socklen_t from_len = sizeof(from_addr);
+            union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int)) + IPC_CRED_SPACE];
+            } control;
+            struct iovec iov = { &msg, sizeof(msg) };
+            struct msghdr mh;
+            memset(&mh, 0, sizeof(mh));
+            mh.msg_name = &from_addr;
+            mh.msg_namelen = sizeof(from_addr);
+            mh.msg_iov = &iov;
+            mh.msg_iovlen = 1;
+            mh.msg_control = control.buf;
+            mh.msg_controllen = sizeof(control.buf);
+            
+            int bytes_received = recvmsg(unix_sock, &mh, 0);
             
-            int bytes_received = recvfrom(unix_sock, &msg, sizeof(msg), 0,
-                                         (struct sockaddr*)&from_addr, &from_len);
+            // A descriptor may come along, e.g. the file to write a capture
+            // to. The socket's mode keeps out everyone but PumpKIN's user
+            // and root; where the kernel also says who sent a
+            // datagram, we check that too.
+            int passed_fd = -1;
+#ifdef SCM_CREDENTIALS
+            bool trusted = false;
+#else
+            bool trusted = true;
+#endif
+            struct cmsghdr *cm = bytes_received >= 0 ? CMSG_FIRSTHDR(&mh) : NULL;
+            for (; cm; cm = CMSG_NXTHDR(&mh, cm)) {
+                if (cm->cmsg_level != SOL_SOCKET) continue;
+                if (cm->cmsg_type == SCM_RIGHTS && cm->cmsg_len == CMSG_LEN(sizeof(int))) {
+                    memcpy(&passed_fd, CMSG_DATA(cm), sizeof(int));
+                }
+#ifdef SCM_CREDENTIALS
+                if (cm->cmsg_type == SCM_CREDENTIALS && cm->cmsg_len == CMSG_LEN(sizeof(struct ucred))) {
+                    struct ucred cred;
+                    memcpy(&cred, CMSG_DATA(cm), sizeof(cred));
+                    trusted = cred.uid == 0 || cred.uid == ipc_owner;
+                }
+#endif
+            }
+            
+            if (bytes_received > 0 && !trusted) {
+                LOG_ERROR("Ignoring IPC message from another user");
+            } else if (bytes_received > 0) {
+                // Replies and requests go to whoever said HELLO last, if
+                // they have an address to send them to
+                socklen_t from_len = mh.msg_namelen;
+                if (msg.cmd == CMD_HELLO && from_len > offsetof(struct sockaddr_un, sun_path)
+                    && from_addr.sun_path[0]) {
+                    memcpy(&ipc_peer, &from_addr, from_len);
+                    ipc_peer_len = from_len;
+                }
+                handle_ipc_message(unix_sock, &msg, bytes_received, passed_fd, &from_addr, from_len);
+            }
+            if (passed_fd >= 0) {
+                close(passed_fd);
+            }
+        }
+        
+        if (fds[2].fd >= 0 && (fds[2].revents & POLLIN)) {
+            pathcache_handle_events();
+        }
+        
+        // Packets for running transfers
+        for (int i = 4; i < transfer_fds; i++) {
+            transfer_t *t = fd_transfer[i];
+            if (!(fds[i].revents & POLLIN) || !t->active) continue;
             
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int bytes_received = recvfrom(t->client_socket, buffer, sizeof(buffer), 0,
+                                         (struct sockaddr*)&from, &from_len);
             if (bytes_received > 0) {
-                handle_ipc_message(unix_sock, &msg, bytes_received);
+                CAPTURE(&from, &t->local_addr, buffer, bytes_received);
+                handle_transfer_packet(t, &from, buffer, bytes_received);
+            }
+        }
+        
+        // Consumers ready for more; the blocks they took can be acknowledged
+        for (int i = transfer_fds; i < sink_fds; i++) {
+            transfer_t *t = fd_transfer[i];
+            if (!fds[i].revents || !t->active || !t->sink) continue;
+            if (!sink_flush(t->sink)) {
+                sink_failed(t);
+            } else if (!sink_pending(t->sink)) {
+                acknowledge_data(t);
             }
         }
         
-        // Process active transfers and clean up expired ones
+        // Blocks from upstream, and the transfers that were waiting for them
+        if (relay_handle(fds + sink_fds, relay_fds, monotonic_ms())) {
+            for (int i = 0; i < max_transfers; i++) {
+                transfer_t *t = &transfers[i];
+                if (t->active && t->stalled && !t->waiting_approval) {
+                    send_next_block(t);
+                }
+            }
+        }
+        
+        // Blocks whose turn has come
+        shaper_run(monotonic_ms(), transmit);
+        
+        // Retransmit where due and clean up expired transfers
         for (int i = 0; i < max_transfers; i++) {
             if (transfers[i].active && !transfers[i].waiting_approval) {
                 process_transfer(tftp_sock, &transfers[i]);
@@ -276,16 +447,116 @@ int main(int argc, const char * argv[]) {
         }
         
         cleanup_transfers();
+        sink_reap();
+        
+        // Hand freed slots to parked requests
+        now = monotonic_ms();
+        if (!handed_off) {
+            admission_tick(now, transfer_active_count());
+            admission_expire(tftp_sock, now);
+            admit_queued_requests(tftp_sock);
+        }
+        warm_tick(now);
+        
+        // A successor wants to take over. The manifest is saved for it
+        // first; parked requests are left for the clients to repeat to it.
+        if (handoff_sock >= 0 && (fds[3].revents & POLLIN)) {
+            handoff_state_t state = {
+                .tftp_sock = tftp_sock,
+                .ipc_sock = unix_sock,
+                .next_transfer_id = next_transfer_id,
+                .client_connected = client_connected,
+                .ipc_peer = ipc_peer,
+                .ipc_peer_len = ipc_peer_len,
+            };
+            warm_shutdown();
+            if (handoff_serve(handoff_sock, &state)) {
+                handed_off = true;
+                warm_configure("manifest=");
+                for (int i = 0; i < max_transfers; i++) {
+                    transfer_t *t = &transfers[i];
+                    if (handoff_movable(t)) {
+                        release_transfer(t);
+                    } else if (t->active && t->waiting_approval) {
+                        // Its verdict would reach the successor
+                        send_error(t->client_socket, &t->client_addr, TFTP_ERR_UNDEFINED, "Server restarted");
+                        finish_transfer(t, "Server restarted");
+                    }
+                }
+                // Still tell PumpKIN how the rest ends, but leave the sockets to the
+                // successor; what PumpKIN sends from now on is for it alone
+                close(handoff_sock);
+                close(tftp_sock);
+                handoff_sock = tftp_sock = -1;
+                fds[0].fd = fds[1].fd = fds[3].fd = -1;
+                LOG_INFO("Handed over, finishing %d transfers here", transfer_active_count());
+            }
+        }
+    }
+    
+    if (shutdown_signal) {
+        LOG_INFO("Received signal %d, shutting down", (int)shutdown_signal);
     }
     
     // Cleanup
-    close(tftp_sock);
+    for (int i = 0; i < max_transfers; i++) {
+        if (transfers[i].active) {
+            release_transfer(&transfers[i]);
+        }
+    }
+    warm_shutdown();
     close(unix_sock);
-    unlink(SOCKET_PATH);
+    if (!handed_off) {
+        close(tftp_sock);
+        unlink(SOCKET_PATH);
+        if (handoff_sock >= 0) {
+            close(handoff_sock);
+            unlink(HANDOFF_PATH);
+        }
+    }
     
     return 0;
 }
 
+static bool admitting_queued = false;
+
+// Decide whether a request may start right away. Retransmissions of a request
+// we're already serving are dropped; when we're at the concurrency limit the
+// request is parked in the admission queue instead of being refused.
+static bool admit_request(int sock, struct sockaddr_in *client_addr, char *buffer, int len, char *filename) {
+    if (transfer_find_peer(client_addr)) {
+        LOG_DEBUG("Repeated request from %s:%d ignored",
+                  inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
+        return false;
+    }
+    
+    if (transfer_free_slot() && transfer_active_count() < admission_limit()
+        && (admitting_queued || !admission_queued())) {
+        return true;
+    }
+    
+    if (!admission_enqueue(sock, client_addr, buffer, len, filename)) {
+        send_error(sock, client_addr, TFTP_ERR_UNDEFINED, "Too many concurrent transfers");
+    }
+    return false;
+}
+
+void admit_queued_requests(int sock) {
+    char packet[ADMISSION_PACKET_MAX];
+    struct sockaddr_in addr;
+    int len;
+    
+    while (admission_queued()) {
+        int active = transfer_active_count();
+        if (active >= admission_limit() || active >= max_transfers) break;
+        if (!admission_next(transfer_client_count, &addr, packet, &len)) break;
+        
+        admitting_queued = true;
+        handle_tftp_request(sock, &addr, packet, len);
+        admitting_queued = false;
+    }
+}
+
 void handle_tftp_request(int sock, struct sockaddr_in *client_addr, char *buffer, int len) {
     if (len < 4) {
         LOG_ERROR("Packet too short");
@@ -295,56 +566,34 @@ void handle_tftp_request(int sock, struct sockaddr_in *client_addr, char *buffer
     // Extract opcode (first 2 bytes)
     uint16_t opcode = ntohs(*(uint16_t*)buffer);
     
-    LOG_INFO("Received TFTP packet, opcode = %d", opcode);
+    LOG_DEBUG("Received TFTP packet, opcode = %d", opcode);
     
     switch (opcode) {
         case TFTP_RRQ: {
-            // Parse filename and mode
-            char *filename = buffer + 2;
-            int filename_len = strlen(filename);
-            if (2 + filename_len + 1 >= len) {
-                send_error(sock, client_addr, TFTP_ERR_ILLEGAL_OP, "Invalid RRQ format");
-                return;
-            }
-            
-            char *mode = filename + filename_len + 1;
-            int mode_len = strlen(mode);
-            if (2 + filename_len + 1 + mode_len + 1 > len) {
+            // Filename, mode and the options that follow them
+            tftp_request_t req;
+            if (!packet_parse_request(buffer, len, &req)) {
                 send_error(sock, client_addr, TFTP_ERR_ILLEGAL_OP, "Invalid RRQ format");
                 return;
             }
             
-            // Extract options
-            char *options = mode + mode_len + 1;
-            int options_len = len - (2 + filename_len + 1 + mode_len + 1);
-            
-            LOG_INFO("RRQ: filename='%s', mode='%s'", filename, mode);
-            handle_read_request(sock, client_addr, filename, mode, options, options_len);
+            LOG_DEBUG("RRQ: filename='%s', mode='%s'", req.filename, req.mode);
+            if (!admit_request(sock, client_addr, buffer, len, req.filename)) break;
+            handle_read_request(sock, client_addr, req.filename, req.mode, req.options, req.options_len);
             break;
         }
         
         case TFTP_WRQ: {
-            // Parse filename and mode
-            char *filename = buffer + 2;
-            int filename_len = strlen(filename);
-            if (2 + filename_len + 1 >= len) {
-                send_error(sock, client_addr, TFTP_ERR_ILLEGAL_OP, "Invalid WRQ format");
-                return;
-            }
-            
-            char *mode = filename + filename_len + 1;
-            int mode_len = strlen(mode);
-            if (2 + filename_len + 1 + mode_len + 1 > len) {
+            // Filename, mode and the options that follow them
+            tftp_request_t req;
+            if (!packet_parse_request(buffer, len, &req)) {
                 send_error(sock, client_addr, TFTP_ERR_ILLEGAL_OP, "Invalid WRQ format");
                 return;
             }
             
-            // Extract options
-            char *options = mode + mode_len + 1;
-            int options_len = len - (2 + filename_len + 1 + mode_len + 1);
-            
-            LOG_INFO("WRQ: filename='%s', mode='%s'", filename, mode);
-            handle_write_request(sock, client_addr, filename, mode, options, options_len);
+            LOG_DEBUG("WRQ: filename='%s', mode='%s'", req.filename, req.mode);
+            if (!admit_request(sock, client_addr, buffer, len, req.filename)) break;
+            handle_write_request(sock, client_addr, req.filename, req.mode, req.options, req.options_len);
             break;
         }
         
@@ -352,8 +601,8 @@ void handle_tftp_request(int sock, struct sockaddr_in *client_addr, char *buffer
         case TFTP_ACK:
         case TFTP_ERROR:
         case TFTP_OACK:
-            // These should be handled by the transfer handlers
-            LOG_INFO("Received non-request TFTP packet, ignoring at this level");
+            // These arrive on the transfer's own socket
+            LOG_DEBUG("Received non-request TFTP packet, ignoring at this level");
             break;
             
         default:
@@ -363,7 +612,8 @@ void handle_tftp_request(int sock, struct sockaddr_in *client_addr, char *buffer
     }
 }
 
-void handle_ipc_message(int unix_sock, ipc_message_t *msg, size_t msg_len) {
+void handle_ipc_message(int unix_sock, ipc_message_t *msg, size_t msg_len, int passed_fd,
+                        const struct sockaddr_un *from, socklen_t from_len) {
     if (msg_len < 4) {
         LOG_ERROR("IPC message too short");
         return;
@@ -372,7 +622,7 @@ void handle_ipc_message(int unix_sock, ipc_message_t *msg, size_t msg_len) {
     uint16_t cmd = msg->cmd;
     uint16_t transfer_id = msg->transfer_id;
     
-    LOG_INFO("Received IPC command: %d, transfer_id: %d", cmd, transfer_id);
+    LOG_DEBUG("Received IPC command: %d, transfer_id: %d", cmd, transfer_id);
     
     switch (cmd) {
         case CMD_HELLO: {
@@ -390,51 +640,79 @@ void handle_ipc_message(int unix_sock, ipc_message_t *msg, size_t msg_len) {
                 char *config = msg->data;
                 LOG_INFO("Received config: %s", config);
                 
-                // Example: parse tftp_root configuration
-                if (strncmp(config, "tftp_root=", 10) == 0) {
-                    strncpy(tftp_root, config + 10, sizeof(tftp_root) - 1);
-                    LOG_INFO("Set TFTP root to: %s", tftp_root);
-                }
+                handoff_remember(config);
+                apply_config(config);
             }
             break;
         }
         
         case CMD_TRANSFER_APPROVE: {
             // Find the transfer and approve it
-            for (int i = 0; i < max_transfers; i++) {
-                if (transfers[i].active && transfers[i].transfer_id == transfer_id) {
-                    transfers[i].waiting_approval = false;
-                    LOG_INFO("Transfer %d approved", transfer_id);
+            transfer_t *t = transfer_find_pending(transfer_id);
+            if (!t) break;
+            // Uploads only touch the filesystem, or start their consumer, once approved
+            if (t->is_write && sink_match(t->filename)) {
+                t->sink = sink_open(t->filename, &t->client_addr);
+                if (!t->sink) {
+                    send_error(t->client_socket, &t->client_addr, TFTP_ERR_UNDEFINED, strerror(errno));
+                    release_transfer(t);
+                    break;
+                }
+            } else if (t->is_write && t->fd < 0) {
+                t->fd = pathcache_open_write(t->filename);
+                if (t->fd < 0) {
+                    send_error(t->client_socket, &t->client_addr, errno_to_tftp(errno), strerror(errno));
+                    release_transfer(t);
                     break;
                 }
             }
+            t->waiting_approval = false;
+            if (!t->hashed) {
+                hash_init(&t->hash);
+                t->hashing = true;
+            }
+            LOG_INFO("Transfer %d approved", transfer_id);
+            start_transfer(t);
             break;
         }
         
         case CMD_TRANSFER_DENY: {
             // Find the transfer and deny it
-            for (int i = 0; i < max_transfers; i++) {
-                if (transfers[i].active && transfers[i].transfer_id == transfer_id) {
-                    // Send error to client
-                    send_error(transfers[i].client_socket, &transfers[i].client_addr, 
-                              TFTP_ERR_ACCESS_VIOLATION, "Transfer denied by user");
-                    
-                    // Clean up transfer
-                    if (transfers[i].file) {
-                        fclose(transfers[i].file);
-                    }
-                    transfers[i].active = false;
-                    LOG_INFO("Transfer %d denied", transfer_id);
-                    break;
+            transfer_t *t = transfer_find_pending(transfer_id);
+            if (!t) break;
+            // Don't ask again while the client keeps repeating the request
+            ratelimit_rejected(&t->client_addr, t->is_write ? TFTP_WRQ : TFTP_RRQ, t->filename,
+                               TFTP_ERR_ACCESS_VIOLATION, "Transfer denied by user");
+            send_error(t->client_socket, &t->client_addr,
+                      TFTP_ERR_ACCESS_VIOLATION, "Transfer denied by user");
+            release_transfer(t);
+            LOG_INFO("Transfer %d denied", transfer_id);
+            break;
+        }
+        
+        case CMD_CAPTURE_DUMP: {
+            // The requester opens the file and hands us the descriptor, so
+            // we never create files on anybody's behalf
+            char reply[128];
+            if (passed_fd < 0) {
+                snprintf(reply, sizeof(reply), "ERROR: no file descriptor passed");
+            } else {
+                int n = capture_dump(passed_fd);
+                if (n < 0) {
+                    snprintf(reply, sizeof(reply), "ERROR: %s", strerror(errno));
+                } else {
+                    snprintf(reply, sizeof(reply), "OK: %d packets%s", n, capture_enabled ? "" : ", capture is off");
                 }
             }
+            // The answer goes to the requester, which needn't be PumpKIN
+            send_ipc_reply(unix_sock, from, from_len, CMD_CAPTURE_DUMP, transfer_id, reply);
             break;
         }
         
         case CMD_SHUTDOWN: {
             // Shutdown the server
             LOG_INFO("Shutdown requested by PumpKIN");
-            shutdown_requested = true;
+            shutdown_requested = 1;
             break;
         }
         
@@ -444,6 +722,45 @@ void handle_ipc_message(int unix_sock, ipc_message_t *msg, size_t msg_len) {
     }
 }
 
+// Options are "name=value"; they are remembered for a successor, which
+// replays them through here before taking our transfers
+void apply_config(const char *config) {
+    if (admission_configure(config)) {
+        // Admission queue and priority settings
+    } else if (ratelimit_configure(config)) {
+        // Per-source request limits
+    } else if (shaper_configure(config)) {
+        // Bandwidth caps and fair sharing
+    } else if (zimage_configure(config)) {
+        // Compressed images
+    } else if (capture_configure(config)) {
+        // Packet capture ring
+    } else if (bufpool_configure(config)) {
+        // Transfer buffer pool
+    } else if (relay_configure(config)) {
+        // Upstream server for files we don't have
+    } else if (sink_configure(config)) {
+        // Uploads streamed to a consumer instead of the disk
+    } else if (pack_configure(config)) {
+        // Files served from a mapped pack
+    } else if (warm_configure(config)) {
+        // Warm-start manifest
+    } else if (strncmp(config, "tftp_root=", 10) == 0) {
+        strncpy(tftp_root, config + 10, sizeof(tftp_root) - 1);
+        pathcache_set_root(tftp_root);
+        LOG_INFO("Set TFTP root to: %s", tftp_root);
+    } else if (strncmp(config, "pmtu=", 5) == 0) {
+        pmtu_clamp = strcmp(config + 5, "off") != 0;
+        LOG_INFO("Block sizes %s the path MTU", pmtu_clamp ? "kept within" : "not limited by");
+    } else if (strncmp(config, "log_level=", 10) == 0) {
+        int level = log_level_from_name(config + 10);
+        if (level >= 0) {
+            log_level = level;
+            LOG_INFO("Set log level to: %d", level);
+        }
+    }
+}
+
 void cleanup_transfers(void) {
     time_t now = time(NULL);
     
@@ -452,221 +769,707 @@ void cleanup_transfers(void) {
             // If transfer has been inactive for more than 60 seconds, time it out
             if (now - transfers[i].last_activity > 60) {
                 LOG_INFO("Transfer %d timed out", transfers[i].transfer_id);
-                
-                // Close file if open
-                if (transfers[i].file) {
-                    fclose(transfers[i].file);
-                }
-                
-                // Send timeout notification to PumpKIN
-                char msg[256];
-                snprintf(msg, sizeof(msg), "Transfer timed out: %s", transfers[i].filename);
-                send_ipc_message(transfers[i].client_socket, CMD_TRANSFER_DONE, 
-                                transfers[i].transfer_id, msg);
-                
-                // Mark transfer as inactive
-                transfers[i].active = false;
+                finish_transfer(&transfers[i], "Transfer timed out");
             }
         }
     }
 }
 
+void release_transfer(transfer_t *transfer) {
+    zimage_close(transfer->zimage);
+    transfer->zimage = NULL;
+    if (transfer->fd >= 0) {
+        if (transfer->is_write) {
+            close(transfer->fd);
+        } else {
+            pathcache_release(transfer->cached, transfer->fd);
+        }
+    }
+    if (transfer->fetch) {
+        relay_leave(transfer->fetch);
+        transfer->fetch = NULL;
+    }
+    shaper_cancel(transfer);
+    pack_release(transfer->pack);
+    transfer->pack = NULL;
+    transfer->pack_data = NULL;
+    if (transfer->sink) {
+        sink_close(transfer->sink, false);
+        transfer->sink = NULL;
+    }
+    if (transfer->client_socket >= 0) {
+        close(transfer->client_socket);
+    }
+    bufpool_free(transfer->packet);
+    bufpool_free(transfer->filename);
+    transfer->packet = NULL;
+    transfer->filename = NULL;
+    transfer->packet_len = 0;
+    transfer->client_socket = -1;
+    transfer->fd = -1;
+    transfer->cached = NULL;
+    transfer->active = false;
+    
+    size_t in_use, kept;
+    bufpool_usage(&in_use, &kept);
+    LOG_DEBUG("Transfer buffers: %zu bytes in use, %zu kept", in_use, kept);
+}
+
+// Report the outcome to PumpKIN and free the slot
+void finish_transfer(transfer_t *transfer, const char *status) {
+    char msg[512];
+    if (transfer->hashed) {
+        snprintf(msg, sizeof(msg), "%s: %s sha256=%s xxh64=%s", status, transfer->filename,
+                 transfer->sha256, transfer->xxh64);
+    } else {
+        snprintf(msg, sizeof(msg), "%s: %s", status, transfer->filename);
+    }
+    send_ipc_message(ipc_sock, CMD_TRANSFER_DONE, transfer->transfer_id, msg);
+    release_transfer(transfer);
+}
+
+int errno_to_tftp(int err) {
+    switch (err) {
+        case ENOENT:
+        case ENOTDIR:
+            return TFTP_ERR_NOT_FOUND;
+        case EACCES:
+        case EPERM:
+        case ELOOP:
+        case EISDIR:
+        case EXDEV:
+            return TFTP_ERR_ACCESS_VIOLATION;
+        case ENOSPC:
+        case EDQUOT:
+            return TFTP_ERR_DISK_FULL;
+        case EEXIST:
+            return TFTP_ERR_FILE_EXISTS;
+        default:
+            return TFTP_ERR_UNDEFINED;
+    }
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void send_error(int sock, struct sockaddr_in *addr, int error_code, char *error_msg) {
-    char buffer[BUFFER_SIZE];
-    uint16_t *opcode = (uint16_t *)buffer;
-    uint16_t *code = (uint16_t *)(buffer + 2);
-    char *msg = buffer + 4;
+    char buffer[4 + 512];
+    int packet_len = packet_error(buffer, sizeof(buffer), error_code, error_msg);
     
-    *opcode = htons(TFTP_ERROR);
-    *code = htons(error_code);
+    sendto(sock, buffer, packet_len, 0, (struct sockaddr *)addr, sizeof(*addr));
+    if (capture_enabled) {
+        struct sockaddr_in local;
+        socklen_t local_len = sizeof(local);
+        if (getsockname(sock, (struct sockaddr *)&local, &local_len) == 0) {
+            capture_record(&local, addr, buffer, packet_len);
+        }
+    }
+    LOG_DEBUG("Sent error to %s:%d - Code: %d, Msg: %s", 
+             inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), error_code, error_msg);
+}
+
+// Bind the socket requests arrive on
+static int open_listening_socket(const char *address, const char *port) {
+    int tftp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (tftp_sock < 0) {
+        LOG_ERROR("Failed to create TFTP socket: %s", strerror(errno));
+        return -1;
+    }
     
-    strncpy(msg, error_msg, BUFFER_SIZE - 5);
-    buffer[BUFFER_SIZE - 1] = '\0';
+    // Set socket options
+    int optval = 1;
+    if (setsockopt(tftp_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+        LOG_ERROR("Failed to set SO_REUSEADDR: %s", strerror(errno));
+    }
     
-    int msg_len = strlen(msg) + 1;
-    int packet_len = 4 + msg_len;
+    // Bind to specified address and port
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = inet_addr(address);
+    listen_addr.sin_port = htons(atoi(port));
     
-    sendto(sock, buffer, packet_len, 0, (struct sockaddr *)addr, sizeof(*addr));
-    LOG_INFO("Sent error to %s:%d - Code: %d, Msg: %s", 
-             inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), error_code, error_msg);
+    LOG_INFO("Binding to %s:%s", address, port);
+    if (bind(tftp_sock, (struct sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) {
+        LOG_ERROR("Failed to bind TFTP socket: %s", strerror(errno));
+        close(tftp_sock);
+        return -1;
+    }
+    return tftp_sock;
 }
 
-void handle_read_request(int sock, struct sockaddr_in *client_addr, char *filename, char *mode, char *options, int options_len) {
-    // Check for directory traversal
-    if (strstr(filename, "..") != NULL) {
-        send_error(sock, client_addr, TFTP_ERR_ACCESS_VIOLATION, "Directory traversal not allowed");
-        return;
+// Create the Unix domain socket for IPC with PumpKIN
+static int open_ipc_socket(void) {
+    unlink(SOCKET_PATH); // Remove existing socket if present
+    
+    int unix_sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (unix_sock < 0) {
+        LOG_ERROR("Failed to create Unix socket: %s", strerror(errno));
+        return -1;
     }
     
-    // Get a free transfer slot
-    int slot = -1;
-    for (int i = 0; i < max_transfers; i++) {
-        if (!transfers[i].active) {
-            slot = i;
-            break;
-        }
+    struct sockaddr_un unix_addr;
+    memset(&unix_addr, 0, sizeof(unix_addr));
+    unix_addr.sun_family = AF_UNIX;
+    strncpy(unix_addr.sun_path, SOCKET_PATH, sizeof(unix_addr.sun_path) - 1);
+    
+    // Only PumpKIN's user and root may talk to us
+    mode_t mask = umask(0177);
+    int bound = bind(unix_sock, (struct sockaddr*)&unix_addr, sizeof(unix_addr));
+    umask(mask);
+    if (bound < 0) {
+        LOG_ERROR("Failed to bind Unix socket: %s", strerror(errno));
+        close(unix_sock);
+        return -1;
+    }
+    if (lchown(SOCKET_PATH, ipc_owner, (gid_t)-1) < 0) {
+        LOG_ERROR("Failed to hand the Unix socket to uid %d: %s", (int)ipc_owner, strerror(errno));
+        close(unix_sock);
+        unlink(SOCKET_PATH);
+        return -1;
+    }
+#ifdef SCM_CREDENTIALS
+    int on = 1;
+    setsockopt(unix_sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on));
+#endif
+    return unix_sock;
+}
+
+// Each transfer talks to its client from its own ephemeral port (RFC 1350 TID)
+static int open_transfer_socket(void) {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) {
+        return -1;
     }
     
-    if (slot == -1) {
+    struct sockaddr_in addr = listen_addr;
+    addr.sin_port = 0;
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    return sock;
+}
+
+// Find a free slot and give it a socket; replies go through the listening
+// socket if that fails
+static transfer_t *setup_transfer(int sock, struct sockaddr_in *client_addr, char *filename, char *mode, bool is_write) {
+    transfer_t *transfer = transfer_free_slot();
+    if (!transfer) {
         send_error(sock, client_addr, TFTP_ERR_UNDEFINED, "Too many concurrent transfers");
-        return;
+        return NULL;
     }
     
-    // Allocate a new transfer ID
-    int transfer_id = next_transfer_id++;
-    
-    // Construct full path
-    char full_path[PATH_MAX];
-    snprintf(full_path, PATH_MAX, "%s/%s", tftp_root, filename);
+    int transfer_sock = open_transfer_socket();
+    if (transfer_sock < 0) {
+        LOG_ERROR("Failed to create transfer socket: %s", strerror(errno));
+        send_error(sock, client_addr, TFTP_ERR_UNDEFINED, "Server error");
+        return NULL;
+    }
     
-    // Check if file exists and is readable
-    FILE *fp = fopen(full_path, "rb");
-    if (!fp) {
-        send_error(sock, client_addr, TFTP_ERR_NOT_FOUND, strerror(errno));
-        return;
+    // Both names in one pooled buffer, as long as they need to be
+    size_t filename_len = strlen(filename), mode_len = strlen(mode);
+    char *names = bufpool_alloc(filename_len + 1 + mode_len + 1);
+    if (!names) {
+        close(transfer_sock);
+        send_error(sock, client_addr, TFTP_ERR_UNDEFINED, "Out of memory");
+        return NULL;
     }
+    memcpy(names, filename, filename_len + 1);
+    memcpy(names + filename_len + 1, mode, mode_len + 1);
     
-    // Set up transfer
-    transfer_t *transfer = &transfers[slot];
     memset(transfer, 0, sizeof(transfer_t));
     
-    transfer->client_socket = sock;
+    transfer->filename = names;
+    transfer->mode = names + filename_len + 1;
+    transfer->client_socket = transfer_sock;
+    socklen_t local_len = sizeof(transfer->local_addr);
+    getsockname(transfer_sock, (struct sockaddr *)&transfer->local_addr, &local_len);
     memcpy(&transfer->client_addr, client_addr, sizeof(struct sockaddr_in));
-    strncpy(transfer->filename, filename, sizeof(transfer->filename) - 1);
-    strncpy(transfer->mode, mode, sizeof(transfer->mode) - 1);
-    transfer->is_write = false;
-    transfer->file = fp;
+    transfer->is_write = is_write;
+    transfer->fd = -1;
     transfer->block = 0;
-    transfer->transfer_id = transfer_id;
+    transfer->transfer_id = next_transfer_id++;
     transfer->last_activity = time(NULL);
     transfer->block_size = 512; // Default block size
+    transfer->timeout = TFTP_DEFAULT_TIMEOUT;
     transfer->active = true;
+    return transfer;
+}
+
+static void parse_options(transfer_t *transfer, char *options, int options_len) {
+    tftp_options_t opts;
+    packet_parse_options(options, options_len, &opts);
     
-    // Parse options
-    char *option = options;
-    while (option < options + options_len && *option) {
-        char *value = option + strlen(option) + 1;
-        if (value >= options + options_len) break;
-        
-        LOG_INFO("Option: %s = %s", option, value);
-        
-        // Handle blksize option
-        if (strcasecmp(option, "blksize") == 0) {
-            int blksize = atoi(value);
-            if (blksize >= 8 && blksize <= 65464) {
-                transfer->block_size = blksize;
+    if (opts.blksize) {
+        int blksize = opts.blksize;
+        // Answer with less rather than have every block fragmented
+        if (pmtu_clamp && blksize > PMTU_BLKSIZE_MIN) {
+            int fits = pmtu_block_size(&transfer->client_addr);
+            if (blksize > fits) {
+                LOG_DEBUG("Clamping blksize %d to %d for the path MTU", blksize, fits);
+                blksize = fits;
             }
         }
+        transfer->block_size = blksize;
+        transfer->opt_blksize = true;
+    }
+    if (opts.tsize) {
+        // For uploads the client tells us the size, for downloads we do
+        if (transfer->is_write) {
+            transfer->file_size = opts.tsize_value;
+        }
+        transfer->opt_tsize = true;
+    }
+    if (opts.timeout) {
+        transfer->timeout = opts.timeout;
+        transfer->opt_timeout = true;
+    }
+}
+
+void handle_read_request(int sock, struct sockaddr_in *client_addr, char *filename, char *mode, char *options, int options_len) {
+    // Packed files are served straight from the mapping
+    pack_file_t packed;
+    pack_t *pack = pack_lookup(filename, &packed);
+    
+    // Otherwise resolve beneath the TFTP root, reusing a cached descriptor if
+    // we have one. Directory traversal is refused by the resolver.
+    pathcache_entry_t *cached = NULL;
+    int fd = -1;
+    struct stat st;
+    int err = pack ? 0 : pathcache_open_read(filename, &cached, &fd, &st);
+    
+    // Or stored compressed, to be inflated on the way out
+    zimage_t *zimage = NULL;
+    char compressed[PATH_MAX];
+    if (err == ENOENT && zimage_name(filename, compressed, sizeof(compressed))) {
+        int zerr = pathcache_open_read(compressed, &cached, &fd, &st);
+        if (!zerr && !(zimage = zimage_open(fd, &st))) {
+            zerr = errno;
+            pathcache_release(cached, fd);
+            cached = NULL;
+            fd = -1;
+        }
+        if (zerr != ENOENT) err = zerr;
+    }
+    
+    // Not here, but maybe upstream has it: stream it from the fetch as it arrives
+    relay_fetch_t *fetch = NULL;
+    if (err == ENOENT && relay_enabled()) {
+        fetch = relay_join(filename);
+        cached = NULL;
+        fd = fetch ? dup(relay_fd(fetch)) : -1;
+        err = fd < 0 || fstat(fd, &st) < 0 ? errno : 0;
+        if (err && fetch) {
+            if (fd >= 0) close(fd);
+            relay_leave(fetch);
+        }
+    }
+    if (err) {
+        // Refused for good reason, not for lack of resources: say so again
+        // straight away if it is asked for again
+        int code = errno_to_tftp(err);
+        if (code != TFTP_ERR_UNDEFINED) {
+            ratelimit_rejected(client_addr, TFTP_RRQ, filename, code, strerror(err));
+        }
+        send_error(sock, client_addr, code, strerror(err));
+        return;
+    }
+    
+    // Set up transfer
+    transfer_t *transfer = setup_transfer(sock, client_addr, filename, mode, false);
+    if (!transfer) {
+        zimage_close(zimage);
+        if (pack) pack_release(pack);
+        else pathcache_release(cached, fd);
+        if (fetch) relay_leave(fetch);
+        return;
+    }
+    
+    if (pack) {
+        // The pack has the digests too
+        transfer->pack = pack;
+        transfer->pack_data = packed.data;
+        transfer->file_size = packed.size;
+        transfer->hashed = true;
+        memcpy(transfer->sha256, packed.sha256, HASH_SHA256_HEX);
+        memcpy(transfer->xxh64, packed.xxh64, HASH_XXH64_HEX);
+    } else {
+        transfer->fd = fd;
+        transfer->cached = cached;
+        transfer->fetch = fetch;
+        transfer->zimage = zimage;
+        transfer->st = st;
+        transfer->file_size = fetch ? relay_size(fetch) : zimage ? zimage_size(zimage) : st.st_size;
         
-        option = value + strlen(value) + 1;
+        // Already streamed this exact file before, no need to hash it again.
+        // The cache knows a compressed file by its own digest.
+        transfer->hashed = !fetch && !zimage && hashcache_lookup(&st, transfer->sha256, transfer->xxh64);
     }
     
+    parse_options(transfer, options, options_len);
+    
     // Notify PumpKIN of new transfer request
     char msg[512];
     snprintf(msg, sizeof(msg), "RRQ\n%s\n%s\n%s", 
              inet_ntoa(client_addr->sin_addr), filename, mode);
-    send_ipc_message(sock, CMD_TRANSFER_REQUEST, transfer_id, msg);
+    send_ipc_message(ipc_sock, CMD_TRANSFER_REQUEST, transfer->transfer_id, msg);
     
     // Mark as waiting for approval
     transfer->waiting_approval = true;
     
     LOG_INFO("Read request for '%s' from %s:%d, transfer_id=%d", 
-             filename, inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), transfer_id);
+             filename, inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), transfer->transfer_id);
 }
 
 void handle_write_request(int sock, struct sockaddr_in *client_addr, char *filename, char *mode, char *options, int options_len) {
-    // Check for directory traversal
+    // Check for directory traversal; the resolver enforces this again on open
     if (strstr(filename, "..") != NULL) {
+        ratelimit_rejected(client_addr, TFTP_WRQ, filename, TFTP_ERR_ACCESS_VIOLATION, "Directory traversal not allowed");
         send_error(sock, client_addr, TFTP_ERR_ACCESS_VIOLATION, "Directory traversal not allowed");
         return;
     }
     
-    // Get a free transfer slot
-    int slot = -1;
-    for (int i = 0; i < max_transfers; i++) {
-        if (!transfers[i].active) {
-            slot = i;
-            break;
+    // Let PumpKIN check if we should allow this write
+    transfer_t *transfer = setup_transfer(sock, client_addr, filename, mode, true);
+    if (!transfer) {
+        return;
+    }
+    
+    parse_options(transfer, options, options_len);
+    
+    // Notify PumpKIN of new transfer request
+    char msg[512];
+    snprintf(msg, sizeof(msg), "WRQ\n%s\n%s\n%s", 
+             inet_ntoa(client_addr->sin_addr), filename, mode);
+    send_ipc_message(ipc_sock, CMD_TRANSFER_REQUEST, transfer->transfer_id, msg);
+    
+    // Mark as waiting for approval
+    transfer->waiting_approval = true;
+    
+    LOG_INFO("Write request for '%s' from %s:%d, transfer_id=%d", 
+             filename, inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), transfer->transfer_id);
+}
+
+// Put the packet in the transfer's buffer on the wire and start its
+// retransmission timer
+static void transmit(transfer_t *transfer) {
+    transfer_arm(transfer, monotonic_ms());
+    sendto(transfer->client_socket, transfer->packet, transfer->packet_len, 0,
+           (struct sockaddr *)&transfer->client_addr, sizeof(transfer->client_addr));
+    CAPTURE(&transfer->local_addr, &transfer->client_addr, transfer->packet, transfer->packet_len);
+}
+
+// Send a packet that is retransmitted until the peer answers it
+static void send_packet(transfer_t *transfer, int len) {
+    transfer->packet_len = len;
+    transfer->retries = 0;
+    transmit(transfer);
+}
+
+// DATA waits for its share of the bandwidth when it is capped
+static void send_data(transfer_t *transfer, int len) {
+    if (!shaper_enabled()) {
+        send_packet(transfer, len);
+        return;
+    }
+    transfer->packet_len = len;
+    transfer->retries = 0;
+    shaper_enqueue(transfer);
+    shaper_run(monotonic_ms(), transmit);
+}
+
+static void send_ack(transfer_t *transfer, uint16_t block) {
+    send_packet(transfer, packet_ack(transfer->packet, block));
+}
+
+static void send_oack(transfer_t *transfer) {
+    // Upstream may not have told us the size of a relayed file yet
+    if (transfer->fetch) {
+        transfer->file_size = relay_size(transfer->fetch);
+    }
+    tftp_options_t opts = {
+        .blksize = transfer->opt_blksize ? transfer->block_size : 0,
+        .timeout = transfer->opt_timeout ? transfer->timeout : 0,
+        .tsize = transfer->opt_tsize,
+        .tsize_value = transfer->file_size,
+    };
+    int len = packet_oack(transfer->packet, transfer_packet_size(transfer), &opts);
+    if (len == 2) {
+        // Nothing left to acknowledge, start as if no options were asked for
+        send_next_block(transfer);
+        return;
+    }
+    transfer->oack_pending = true;
+    send_packet(transfer, len);
+}
+
+// Read and send the block following the acknowledged one
+static void send_next_block(transfer_t *transfer) {
+    // A relayed file may still be arriving: wait for the whole block, or
+    // the end of the file, before sending it
+    if (transfer->fetch) {
+        const char *message;
+        int code = relay_error(transfer->fetch, &message);
+        if (code >= 0) {
+            send_error(transfer->client_socket, &transfer->client_addr, code, (char *)message);
+            finish_transfer(transfer, "Upstream failed");
+            return;
+        }
+        transfer->stalled = !relay_complete(transfer->fetch)
+            && relay_available(transfer->fetch) < transfer->offset + transfer->block_size;
+        if (transfer->stalled) {
+            transfer->packet_len = 0;   // the previous block was acknowledged, nothing to repeat
+            return;
         }
     }
     
-    if (slot == -1) {
-        send_error(sock, client_addr, TFTP_ERR_UNDEFINED, "Too many concurrent transfers");
+    ssize_t n;
+    if (transfer->pack_data) {
+        off_t left = transfer->file_size - transfer->offset;
+        n = left < transfer->block_size ? left : transfer->block_size;
+        memcpy(transfer->packet + 4, transfer->pack_data + transfer->offset, n);
+    } else if (transfer->zimage) {
+        n = zimage_read(transfer->zimage, transfer->packet + 4, transfer->block_size, transfer->offset);
+    } else {
+        n = pread(transfer->fd, transfer->packet + 4, transfer->block_size, transfer->offset);
+    }
+    if (n < 0) {
+        send_error(transfer->client_socket, &transfer->client_addr, TFTP_ERR_UNDEFINED, strerror(errno));
+        finish_transfer(transfer, "Read error");
         return;
     }
     
-    // Allocate a new transfer ID
-    int transfer_id = next_transfer_id++;
+    if (transfer->hashing) {
+        hash_update(&transfer->hash, transfer->packet + 4, n);
+    }
     
-    // Construct full path
-    char full_path[PATH_MAX];
-    snprintf(full_path, PATH_MAX, "%s/%s", tftp_root, filename);
+    transfer->block++;
+    transfer->last_data_len = n;
+    transfer->last_block_sent = n < transfer->block_size;
+    send_data(transfer, packet_data(transfer->packet, transfer->block, n));
+}
+
+// Kick off an approved transfer with an OACK, the first block or ACK 0
+void start_transfer(transfer_t *transfer) {
+    transfer->packet = bufpool_alloc(transfer_packet_size(transfer));
+    if (!transfer->packet) {
+        send_error(transfer->client_socket, &transfer->client_addr, TFTP_ERR_UNDEFINED, "Out of memory");
+        finish_transfer(transfer, "Out of memory");
+        return;
+    }
     
-    // Let PumpKIN check if we should allow this write
-    transfer_t *transfer = &transfers[slot];
-    memset(transfer, 0, sizeof(transfer_t));
+    transfer->started = monotonic_ms();
+    transfer->last_activity = time(NULL);
     
-    transfer->client_socket = sock;
-    memcpy(&transfer->client_addr, client_addr, sizeof(struct sockaddr_in));
-    strncpy(transfer->filename, filename, sizeof(transfer->filename) - 1);
-    strncpy(transfer->mode, mode, sizeof(transfer->mode) - 1);
-    transfer->is_write = true;
-    transfer->file = NULL; // Will open on approval
-    transfer->block = 0;
-    transfer->transfer_id = transfer_id;
+    if (transfer->opt_blksize || transfer->opt_tsize || transfer->opt_timeout) {
+        send_oack(transfer);
+    } else if (transfer->is_write) {
+        send_ack(transfer, 0);
+    } else {
+        send_next_block(transfer);
+    }
+}
+
+// Finish the running digest once every byte went through it and remember it
+// for the file as it is now. A served file that changed underneath us isn't
+// cached, its digest describes neither version.
+static void finish_hash(transfer_t *transfer) {
+    if (!transfer->hashing) return;
+    hash_final(&transfer->hash, transfer->sha256, transfer->xxh64);
+    transfer->hashing = false;
+    transfer->hashed = true;
+    
+    struct stat st;
+    if (transfer->zimage || fstat(transfer->fd, &st) < 0) return;
+    if (!transfer->is_write && (st.st_size != transfer->st.st_size || st.st_mtime != transfer->st.st_mtime)) return;
+    hashcache_store(&st, transfer->sha256, transfer->xxh64);
+}
+
+static void log_complete(transfer_t *transfer) {
+    finish_hash(transfer);
+    if (!transfer->is_write && !transfer->pack && !transfer->fetch && !transfer->zimage) {
+        warm_record(transfer->filename, &transfer->st,
+                    transfer->hashed ? transfer->sha256 : NULL, transfer->hashed ? transfer->xxh64 : NULL);
+    }
+    LOG_INFO("Transfer %d of '%s' complete, %llu bytes in %llu ms, sha256=%s xxh64=%s",
+             transfer->transfer_id, transfer->filename, (unsigned long long)transfer->bytes,
+             (unsigned long long)(monotonic_ms() - transfer->started),
+             transfer->hashed ? transfer->sha256 : "-", transfer->hashed ? transfer->xxh64 : "-");
+}
+
+static void complete_transfer(transfer_t *transfer) {
+    log_complete(transfer);
+    finish_transfer(transfer, "Transfer complete");
+}
+
+// Acknowledge the DATA block just stored or passed on
+static void acknowledge_data(transfer_t *transfer) {
+    send_ack(transfer, transfer->block);
+    
+    if (transfer->last_data_len < transfer->block_size) {
+        // Hang around for one timeout in case the final ACK is lost
+        transfer->dallying = true;
+        log_complete(transfer);
+        if (transfer->sink) {
+            sink_close(transfer->sink, true);
+            transfer->sink = NULL;
+        }
+    }
+}
+
+static void sink_failed(transfer_t *transfer) {
+    int err = errno;
+    LOG_INFO("Transfer %d of '%s': consumer failed: %s", transfer->transfer_id, transfer->filename, strerror(err));
+    send_error(transfer->client_socket, &transfer->client_addr, TFTP_ERR_UNDEFINED, strerror(err));
+    finish_transfer(transfer, "Consumer failed");
+}
+
+void handle_transfer_packet(transfer_t *transfer, struct sockaddr_in *from, char *buffer, int len) {
+    if (from->sin_addr.s_addr != transfer->client_addr.sin_addr.s_addr
+        || from->sin_port != transfer->client_addr.sin_port) {
+        // Somebody else's packet, tell them without disturbing the transfer
+        send_error(transfer->client_socket, from, TFTP_ERR_UNKNOWN_TID, "Unknown transfer ID");
+        return;
+    }
+    if (len < 4) {
+        return;
+    }
+    
+    uint16_t opcode = ntohs(*(uint16_t *)buffer);
+    uint16_t block = ntohs(*(uint16_t *)(buffer + 2));
     transfer->last_activity = time(NULL);
-    transfer->block_size = 512; // Default block size
-    transfer->active = true;
     
-    // Parse options
-    char *option = options;
-    while (option < options + options_len && *option) {
-        char *value = option + strlen(option) + 1;
-        if (value >= options + options_len) break;
-        
-        LOG_INFO("Option: %s = %s", option, value);
+    switch (opcode) {
+        case TFTP_ACK: {
+            if (transfer->is_write) break;
+            
+            if (transfer->oack_pending) {
+                if (block != 0) break;
+                transfer->oack_pending = false;
+                send_next_block(transfer);
+                break;
+            }
+            
+            // Only the ACK for the block in flight moves us on; acting on
+            // duplicates would double every packet from here on. While we
+            // wait for upstream, the last block is acknowledged and counted
+            // already, and no other is in flight.
+            if (block != transfer->block || transfer->stalled) break;
+            
+            transfer->offset += transfer->last_data_len;
+            transfer->bytes += transfer->last_data_len;
+            admission_account(transfer->last_data_len);
+            
+            if (transfer->last_block_sent) {
+                complete_transfer(transfer);
+            } else {
+                send_next_block(transfer);
+            }
+            break;
+        }
         
-        // Handle blksize option
-        if (strcasecmp(option, "blksize") == 0) {
-            int blksize = atoi(value);
-            if (blksize >= 8 && blksize <= 65464) {
-                transfer->block_size = blksize;
+        case TFTP_DATA: {
+            if (!transfer->is_write) break;
+            // The consumer hasn't taken the last block yet, neither has the
+            // client had its ACK
+            if (transfer->sink && sink_pending(transfer->sink)) break;
+            
+            int data_len = len - 4;
+            uint16_t expected = transfer->block + 1;
+            
+            if (block == transfer->block && !transfer->oack_pending) {
+                // Our ACK got lost, repeat it
+                send_ack(transfer, block);
+                break;
+            }
+            if (block != expected || transfer->dallying) break;
+            
+            if (transfer->sink) {
+                if (!sink_write(transfer->sink, buffer + 4, data_len)) {
+                    sink_failed(transfer);
+                    break;
+                }
+            } else if (pwrite(transfer->fd, buffer + 4, data_len, transfer->offset) != data_len) {
+                send_error(transfer->client_socket, &transfer->client_addr,
+                          errno_to_tftp(errno), strerror(errno));
+                finish_transfer(transfer, "Write error");
+                break;
+            }
+            
+            if (transfer->hashing) {
+                hash_update(&transfer->hash, buffer + 4, data_len);
             }
+            
+            transfer->oack_pending = false;
+            transfer->offset += data_len;
+            transfer->bytes += data_len;
+            transfer->block = block;
+            transfer->last_data_len = data_len;
+            admission_account(data_len);
+            
+            if (transfer->sink && sink_pending(transfer->sink)) {
+                // ACK once the consumer caught up; nothing to repeat meanwhile
+                transfer->packet_len = 0;
+                break;
+            }
+            acknowledge_data(transfer);
+            break;
         }
         
-        option = value + strlen(value) + 1;
+        case TFTP_ERROR:
+            LOG_INFO("Transfer %d aborted by client: %.*s", transfer->transfer_id,
+                     len - 4 > 0 ? len - 4 : 0, buffer + 4);
+            finish_transfer(transfer, "Transfer aborted by client");
+            break;
+            
+        default:
+            send_error(transfer->client_socket, &transfer->client_addr, TFTP_ERR_ILLEGAL_OP, "Unexpected packet");
+            finish_transfer(transfer, "Protocol error");
+            break;
     }
-    
-    // Notify PumpKIN of new transfer request
-    char msg[512];
-    snprintf(msg, sizeof(msg), "WRQ\n%s\n%s\n%s", 
-             inet_ntoa(client_addr->sin_addr), filename, mode);
-    send_ipc_message(sock, CMD_TRANSFER_REQUEST, transfer_id, msg);
-    
-    // Mark as waiting for approval
-    transfer->waiting_approval = true;
-    
-    LOG_INFO("Write request for '%s' from %s:%d, transfer_id=%d", 
-             filename, inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port), transfer_id);
 }
 
 void process_transfer(int sock, transfer_t *transfer) {
-    // This function processes an active transfer
-    // For simplicity, we're not implementing the actual TFTP protocol here
-    // A full implementation would need to handle DATA, ACK, ERROR packets
-    // as well as timeouts, retransmissions, etc.
+    (void)sock;
     
-    // Update last activity time
-    transfer->last_activity = time(NULL);
+    if (!transfer->packet_len || transfer->queued || monotonic_ms() < transfer->deadline) {
+        return;
+    }
     
-    // For a real implementation, you would:
-    // 1. For read transfers: send next block of data if ACK received
-    // 2. For write transfers: acknowledge received data blocks
-    // 3. Handle timeouts and retransmissions
-    // 4. Close the transfer when complete
+    if (transfer->dallying) {
+        finish_transfer(transfer, "Transfer complete");
+        return;
+    }
+    
+    if (transfer->retries >= TFTP_MAX_RETRIES) {
+        LOG_INFO("Transfer %d of '%s' gave up after %d retries",
+                 transfer->transfer_id, transfer->filename, transfer->retries);
+        send_error(transfer->client_socket, &transfer->client_addr, TFTP_ERR_UNDEFINED, "Timeout");
+        finish_transfer(transfer, "Transfer timed out");
+        return;
+    }
+    
+    // Retransmit the last packet
+    transfer->retries++;
+    shaper_charge(transfer, transfer->packet_len);
+    transfer_arm(transfer, monotonic_ms());
+    sendto(transfer->client_socket, transfer->packet, transfer->packet_len, 0,
+           (struct sockaddr *)&transfer->client_addr, sizeof(transfer->client_addr));
+    CAPTURE(&transfer->local_addr, &transfer->client_addr, transfer->packet, transfer->packet_len);
+    LOG_DEBUG("Transfer %d retransmit %d", transfer->transfer_id, transfer->retries);
 }
 
 void send_ipc_message(int unix_sock, int cmd, int transfer_id, char *data) {
+    // Nobody to tell until PumpKIN has introduced itself from a bound socket
+    send_ipc_reply(unix_sock, &ipc_peer, ipc_peer_len, cmd, transfer_id, data);
+}
+
+static void send_ipc_reply(int unix_sock, const struct sockaddr_un *to, socklen_t to_len,
+                           int cmd, int transfer_id, const char *data) {
     ipc_message_t msg;
     msg.cmd = cmd;
     msg.transfer_id = transfer_id;
@@ -678,14 +1481,12 @@ void send_ipc_message(int unix_sock, int cmd, int transfer_id, char *data) {
         msg.data[0] = '\0';
     }
     
-    // Send to any connected client
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
+    if (unix_sock < 0 || to_len <= offsetof(struct sockaddr_un, sun_path) || !to->sun_path[0]) {
+        return;
+    }
     
     ssize_t sent = sendto(unix_sock, &msg, 4 + strlen(msg.data) + 1, 0,
-                         (struct sockaddr*)&addr, sizeof(addr));
+                         (const struct sockaddr*)to, to_len);
                          
     if (sent < 0) {
         LOG_ERROR("Failed to send IPC message: %s", strerror(errno));
@@ -693,6 +1494,7 @@ void send_ipc_message(int unix_sock, int cmd, int transfer_id, char *data) {
 }
 
 void signal_handler(int signum) {
-    LOG_INFO("Received signal %d, shutting down", signum);
-    shutdown_requested = true;
-}
\ No newline at end of file
+    // Only async-signal-safe work here, the main loop logs the reason
+    shutdown_signal = signum;
+    shutdown_requested = 1;
+}
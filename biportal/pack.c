@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "biportal.h"
+#include "pathcache.h"
+#include "pack.h"
+
+// Layout: header, the displacement seed of every bucket, the index slots,
+// the names and then the file contents, each 8-byte aligned. A name hashed
+// with seed 0 picks its bucket; hashed with the bucket's seed it picks its
+// slot, and the builder chose the seeds so that no two names share one
+// (CHD, "compress, hash and displace"). Host byte order; the pack is built
+// where it is served.
+
+#define PACK_MAGIC "BIPPACK1"
+#define PACK_BYTE_ORDER 0x01020304
+#define PACK_MAX_SEED (1u << 24)
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;
+    uint32_t count;             // files
+    uint32_t slots;             // index entries, some of them empty
+    uint32_t buckets;
+    uint64_t seeds;             // offset of uint32_t[buckets]
+    uint64_t index;             // offset of pack_entry_t[slots]
+    uint64_t size;              // of the whole pack, catches truncation
+} pack_header_t;
+
+typedef struct {
+    uint64_t name;              // offset of the NUL-terminated name, 0 in an empty slot
+    uint64_t data;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t name_len;
+    char sha256[HASH_SHA256_HEX];
+    char xxh64[HASH_XXH64_HEX];
+} pack_entry_t;
+
+struct pack {
+    int refs;
+    char *map;
+    size_t size;
+    const pack_header_t *header;
+    const uint32_t *seeds;
+    const pack_entry_t *index;
+};
+
+static pack_t *current = NULL;
+
+static uint64_t key_hash(const char *name, size_t len, uint32_t seed) {
+    xxh64_ctx_t ctx;
+    xxh64_init(&ctx, seed);
+    xxh64_update(&ctx, name, len);
+    return xxh64_digest(&ctx);
+}
+
+static uint64_t align8(uint64_t off) {
+    return (off + 7) & ~(uint64_t)7;
+}
+
+// Everything a lookup touches is checked once here, so lookups needn't
+// check anything
+static bool pack_valid(const char *map, size_t size) {
+    const pack_header_t *h = (const pack_header_t *)map;
+    if (size < sizeof(*h) || memcmp(h->magic, PACK_MAGIC, 8) || h->byte_order != PACK_BYTE_ORDER) return false;
+    if (h->size != size || h->slots < h->count || !h->buckets) return false;
+    if (h->seeds % 4 || h->seeds > size || (uint64_t)h->buckets * 4 > size - h->seeds) return false;
+    if (h->index % 8 || h->index > size || (uint64_t)h->slots * sizeof(pack_entry_t) > size - h->index) return false;
+
+    const pack_entry_t *index = (const pack_entry_t *)(map + h->index);
+    uint32_t files = 0;
+    for (uint32_t i = 0; i < h->slots; i++) {
+        const pack_entry_t *e = &index[i];
+        if (!e->name) continue;
+        if (e->name >= size || e->name_len >= size - e->name || map[e->name + e->name_len]) return false;
+        if (e->data > size || e->size > size - e->data) return false;
+        if (e->sha256[HASH_SHA256_HEX - 1] || e->xxh64[HASH_XXH64_HEX - 1]) return false;
+        files++;
+    }
+    return files == h->count;
+}
+
+static pack_t *pack_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(pack_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    pack_t *pack = malloc(sizeof(pack_t));
+    if (!pack || !pack_valid(map, st.st_size)) {
+        munmap(map, st.st_size);
+        free(pack);
+        errno = pack ? EINVAL : ENOMEM;
+        return NULL;
+    }
+    // Fault it in ahead of the requests
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    pack->refs = 1;
+    pack->map = map;
+    pack->size = st.st_size;
+    pack->header = (const pack_header_t *)map;
+    pack->seeds = (const uint32_t *)(map + pack->header->seeds);
+    pack->index = (const pack_entry_t *)(map + pack->header->index);
+    return pack;
+}
+
+bool pack_configure(const char *config) {
+    if (strncmp(config, "pack=", 5) != 0) return false;
+
+    const char *path = config + 5;
+    pack_t *pack = NULL;
+    if (*path) {
+        pack = pack_open(path);
+        if (!pack) {
+            LOG_ERROR("Can't use pack %s: %s", path, errno == EINVAL ? "not a valid pack" : strerror(errno));
+            return true;
+        }
+        LOG_INFO("Serving %u files from pack %s", pack->header->count, path);
+    } else if (current) {
+        LOG_INFO("Stopped serving from the pack");
+    }
+    pack_release(current);
+    current = pack;
+    return true;
+}
+
+pack_t *pack_lookup(const char *name, pack_file_t *file) {
+    pack_t *pack = current;
+    if (!pack || !pack->header->count) return NULL;
+
+    char norm[PATH_MAX];
+    if (pathcache_normalise(name, norm, sizeof(norm))) return NULL;
+    size_t len = strlen(norm);
+
+    uint32_t seed = pack->seeds[key_hash(norm, len, 0) % pack->header->buckets];
+    const pack_entry_t *e = &pack->index[key_hash(norm, len, seed) % pack->header->slots];
+    if (!e->name || e->name_len != len || memcmp(pack->map + e->name, norm, len)) return NULL;
+
+    file->data = pack->map + e->data;
+    file->size = e->size;
+    file->mtime = e->mtime;
+    file->sha256 = e->sha256;
+    file->xxh64 = e->xxh64;
+    pack->refs++;
+    return pack;
+}
+
+void pack_release(pack_t *pack) {
+    if (!pack || --pack->refs) return;
+    munmap(pack->map, pack->size);
+    free(pack);
+}
+
+// Building
+
+typedef struct {
+    char *name;
+    size_t len;
+    off_t size;
+    time_t mtime;
+    uint32_t bucket;
+    uint32_t slot;
+} build_file_t;
+
+typedef struct {
+    build_file_t *files;
+    size_t count;
+    size_t cap;
+} build_list_t;
+
+static int collect(int dir, const char *prefix, build_list_t *list) {
+    DIR *d = fdopendir(dir);
+    if (!d) {
+        close(dir);
+        return errno;
+    }
+
+    int err = 0;
+    struct dirent *ent;
+    while (!err && (ent = readdir(d))) {
+        // Hidden files are left out, the relay's temporaries among them
+        if (ent->d_name[0] == '.') continue;
+
+        struct stat st;
+        if (fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            err = errno;
+            break;
+        }
+        char name[PATH_MAX];
+        if (snprintf(name, sizeof(name), "%s%s%s", prefix, *prefix ? "/" : "", ent->d_name) >= (int)sizeof(name)) {
+            err = ENAMETOOLONG;
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            int sub = openat(dirfd(d), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            err = sub < 0 ? errno : collect(sub, name, list);
+        } else if (S_ISREG(st.st_mode)) {
+            if (list->count == list->cap) {
+                size_t cap = list->cap ? list->cap * 2 : 256;
+                build_file_t *files = realloc(list->files, cap * sizeof(build_file_t));
+                if (!files) {
+                    err = ENOMEM;
+                    break;
+                }
+                list->files = files;
+                list->cap = cap;
+            }
+            build_file_t *f = &list->files[list->count];
+            f->name = strdup(name);
+            if (!f->name) {
+                err = ENOMEM;
+                break;
+            }
+            f->len = strlen(name);
+            f->size = st.st_size;
+            f->mtime = st.st_mtime;
+            list->count++;
+        }
+    }
+    closedir(d);
+    return err;
+}
+
+static uint32_t *bucket_sizes;
+
+// Biggest buckets first, they are the hardest to place
+static int by_bucket_size(const void *a, const void *b) {
+    const build_file_t *fa = *(build_file_t *const *)a, *fb = *(build_file_t *const *)b;
+    if (bucket_sizes[fa->bucket] != bucket_sizes[fb->bucket]) {
+        return bucket_sizes[fa->bucket] > bucket_sizes[fb->bucket] ? -1 : 1;
+    }
+    return fa->bucket < fb->bucket ? -1 : fa->bucket > fb->bucket;
+}
+
+// Find each bucket the seed that sends its names to free slots
+static int place(build_list_t *list, uint32_t buckets, uint32_t slots, uint32_t *seeds) {
+    if (!list->count) return 0;
+    
+    int err = 0;
+    bool *taken = calloc(slots, sizeof(bool));
+    build_file_t **order = malloc(list->count * sizeof(build_file_t *));
+    bucket_sizes = calloc(buckets, sizeof(uint32_t));
+    if (!taken || !order || !bucket_sizes) {
+        err = ENOMEM;
+        goto done;
+    }
+
+    for (size_t i = 0; i < list->count; i++) {
+        build_file_t *f = &list->files[i];
+        f->bucket = key_hash(f->name, f->len, 0) % buckets;
+        bucket_sizes[f->bucket]++;
+        order[i] = f;
+    }
+    qsort(order, list->count, sizeof(build_file_t *), by_bucket_size);
+
+    for (size_t start = 0; start < list->count; ) {
+        size_t end = start;
+        while (end < list->count && order[end]->bucket == order[start]->bucket) end++;
+
+        uint32_t seed;
+        for (seed = 1; seed < PACK_MAX_SEED; seed++) {
+            size_t i;
+            for (i = start; i < end; i++) {
+                uint32_t slot = key_hash(order[i]->name, order[i]->len, seed) % slots;
+                if (taken[slot]) break;
+                taken[slot] = true;
+                order[i]->slot = slot;
+            }
+            if (i == end) break;
+            while (i-- > start) taken[order[i]->slot] = false;
+        }
+        if (seed == PACK_MAX_SEED) {
+            err = EAGAIN;
+            goto done;
+        }
+        seeds[order[start]->bucket] = seed;
+        start = end;
+    }
+
+done:
+    free(taken);
+    free(order);
+    free(bucket_sizes);
+    bucket_sizes = NULL;
+    return err;
+}
+
+// Copy one file into the pack, digesting it on the way
+static int copy_file(int root, const build_file_t *f, int out, uint64_t offset, pack_entry_t *e) {
+    int fd = openat(root, f->name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return errno;
+
+    static char buf[65536];
+    hash_ctx_t hash;
+    hash_init(&hash);
+    off_t done = 0;
+    int err = 0;
+    while (done < f->size) {
+        size_t want = f->size - done < (off_t)sizeof(buf) ? (size_t)(f->size - done) : sizeof(buf);
+        ssize_t n = read(fd, buf, want);
+        if (n <= 0) {
+            // Shrunk since we looked at it
+            err = n < 0 ? errno : EAGAIN;
+            break;
+        }
+        if (pwrite(out, buf, n, offset + done) != n) {
+            err = errno;
+            break;
+        }
+        hash_update(&hash, buf, n);
+        done += n;
+    }
+    close(fd);
+    if (!err) hash_final(&hash, e->sha256, e->xxh64);
+    return err;
+}
+
+int pack_build(const char *root, const char *path) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return errno;
+
+    build_list_t list = { NULL, 0, 0 };
+    int dir = dup(root_fd);
+    int err = dir < 0 ? errno : collect(dir, "", &list);
+
+    uint32_t buckets = list.count / 4 + 1;
+    uint32_t slots = list.count + list.count / 4 + 1;
+    uint32_t *seeds = calloc(buckets, sizeof(uint32_t));
+    pack_entry_t *index = calloc(slots, sizeof(pack_entry_t));
+    if (!err && (!seeds || !index)) err = ENOMEM;
+    if (!err && list.count > UINT32_MAX / 2) err = EFBIG;
+    if (!err) err = place(&list, buckets, slots, seeds);
+
+    // Lay the names and contents out behind the header, seeds and index
+    pack_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, 8);
+    header.byte_order = PACK_BYTE_ORDER;
+    header.count = list.count;
+    header.slots = slots;
+    header.buckets = buckets;
+    header.seeds = align8(sizeof(header));
+    header.index = align8(header.seeds + (uint64_t)buckets * 4);
+    uint64_t off = header.index + (uint64_t)slots * sizeof(pack_entry_t);
+    for (size_t i = 0; !err && i < list.count; i++) {
+        build_file_t *f = &list.files[i];
+        pack_entry_t *e = &index[f->slot];
+        e->name = off;
+        e->name_len = f->len;
+        e->size = f->size;
+        e->mtime = f->mtime;
+        off += f->len + 1;
+    }
+    off = align8(off);
+    for (size_t i = 0; !err && i < list.count; i++) {
+        pack_entry_t *e = &index[list.files[i].slot];
+        e->data = off;
+        off = align8(off + e->size);
+    }
+    header.size = off;
+
+    // Written beside the old pack and renamed over it, so a pack in use
+    // never changes underneath its mapping
+    char tmp[PATH_MAX];
+    int out = -1;
+    if (!err && snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(tmp)) err = ENAMETOOLONG;
+    if (!err) {
+        out = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (out < 0 || ftruncate(out, header.size) < 0) err = errno;
+    }
+    for (size_t i = 0; !err && i < list.count; i++) {
+        build_file_t *f = &list.files[i];
+        pack_entry_t *e = &index[f->slot];
+        if (pwrite(out, f->name, f->len + 1, e->name) != (ssize_t)(f->len + 1)) err = errno;
+        if (!err) err = copy_file(root_fd, f, out, e->data, e);
+        if (err) fprintf(stderr, "%s: %s\n", f->name, strerror(err));
+    }
+    if (!err && (pwrite(out, &header, sizeof(header), 0) != sizeof(header)
+                 || pwrite(out, seeds, (size_t)buckets * 4, header.seeds) != (ssize_t)buckets * 4
+                 || pwrite(out, index, (size_t)slots * sizeof(pack_entry_t), header.index)
+                    != (ssize_t)(slots * sizeof(pack_entry_t))
+                 || fsync(out) < 0
+                 || rename(tmp, path) < 0)) {
+        err = errno;
+    }
+    if (out >= 0) {
+        close(out);
+        if (err) unlink(tmp);
+    }
+    for (size_t i = 0; i < list.count; i++) free(list.files[i].name);
+    free(list.files);
+    free(seeds);
+    free(index);
+    close(root_fd);
+    return err;
+}
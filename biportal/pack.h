@@ -0,0 +1,43 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "hash.h"
+
+// A TFTP root compiled into one file: the contents of every regular file,
+// their digests and a perfect-hash index over their names. Mapped into
+// memory, it answers lookups and reads without a single system call.
+// Names not in the pack still resolve in the directory tree, so a pack
+// can cover just the bulk of small files that rarely change. It is a
+// snapshot; rebuild it (it is replaced atomically) when the tree changes.
+//
+//   biportal -P ROOT PACKFILE
+
+typedef struct pack pack_t;
+
+typedef struct {
+    const char *data;
+    off_t size;
+    time_t mtime;
+    const char *sha256;         // lowercase hex, as hash_final() gives
+    const char *xxh64;
+} pack_file_t;
+
+// Handles "pack=PATH", mapping the pack (empty turns it off). Transfers
+// still reading the previous one keep it until they are done. Returns
+// false if the option isn't ours.
+bool pack_configure(const char *config);
+
+// Look a request filename up in the current pack. On a hit *file points
+// into the returned pack, which stays mapped until pack_release().
+pack_t *pack_lookup(const char *name, pack_file_t *file);
+void pack_release(pack_t *pack);
+
+// Compile the regular files beneath root, symlinks and hidden files left
+// out, into a pack at path. Returns 0 or an errno value.
+int pack_build(const char *root, const char *path);
+
+#endif
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+
+#include "biportal.h"
+#include "packet.h"
+
+bool packet_parse_request(char *buffer, int len, tftp_request_t *req) {
+    char *end = buffer + len;
+    char *filename = buffer + 2;
+    char *nul = memchr(filename, '\0', end - filename);
+    if (!nul || nul + 1 >= end) return false;
+
+    char *mode = nul + 1;
+    nul = memchr(mode, '\0', end - mode);
+    if (!nul) return false;
+
+    req->filename = filename;
+    req->mode = mode;
+    req->options = nul + 1;
+    req->options_len = end - req->options;
+    return true;
+}
+
+void packet_parse_options(const char *options, int len, tftp_options_t *opts) {
+    const char *end = options + len;
+    const char *option = options;
+    memset(opts, 0, sizeof(*opts));
+
+    while (option < end && *option) {
+        const char *value = memchr(option, '\0', end - option);
+        if (!value || ++value >= end) break;
+        const char *next = memchr(value, '\0', end - value);
+        if (!next) break;
+
+        LOG_DEBUG("Option: %s = %s", option, value);
+
+        if (strcasecmp(option, "blksize") == 0) {
+            int blksize = atoi(value);
+            if (blksize >= 8 && blksize <= TFTP_PACKET_MAX - 4) opts->blksize = blksize;
+        } else if (strcasecmp(option, "tsize") == 0) {
+            opts->tsize = true;
+            opts->tsize_value = strtoll(value, NULL, 10);
+        } else if (strcasecmp(option, "timeout") == 0) {
+            int timeout = atoi(value);
+            if (timeout >= 1 && timeout <= 255) opts->timeout = timeout;
+        }
+        option = next + 1;
+    }
+}
+
+int packet_ack(char *buffer, uint16_t block) {
+    *(uint16_t *)buffer = htons(TFTP_ACK);
+    *(uint16_t *)(buffer + 2) = htons(block);
+    return 4;
+}
+
+int packet_data(char *buffer, uint16_t block, int data_len) {
+    *(uint16_t *)buffer = htons(TFTP_DATA);
+    *(uint16_t *)(buffer + 2) = htons(block);
+    return 4 + data_len;
+}
+
+int packet_error(char *buffer, size_t size, int code, const char *message) {
+    *(uint16_t *)buffer = htons(TFTP_ERROR);
+    *(uint16_t *)(buffer + 2) = htons(code);
+    size_t len = strlen(message);
+    if (len > size - 5) len = size - 5;
+    memcpy(buffer + 4, message, len);
+    buffer[4 + len] = '\0';
+    return 4 + len + 1;
+}
+
+// snprintf's count is what it wanted to write; stop at the end of the buffer
+static char *put_option(char *p, char *end, const char *name, long long value) {
+    int n = snprintf(p, end - p, "%s", name) + 1;
+    if (n > end - p) return end;
+    p += n;
+    n = snprintf(p, end - p, "%lld", value) + 1;
+    return n > end - p ? end : p + n;
+}
+
+int packet_oack(char *buffer, size_t size, const tftp_options_t *opts) {
+    char *p = buffer + 2;
+    char *end = buffer + size;
+
+    *(uint16_t *)buffer = htons(TFTP_OACK);
+    if (opts->blksize) p = put_option(p, end, "blksize", opts->blksize);
+    if (opts->tsize && opts->tsize_value >= 0) p = put_option(p, end, "tsize", opts->tsize_value);
+    if (opts->timeout) p = put_option(p, end, "timeout", opts->timeout);
+    return p - buffer;
+}
@@ -0,0 +1,41 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// TFTP on the wire: RFC 1350 packets and the RFC 2347-2349 options, the
+// parts we read and the parts we build. Everything works in place on the
+// caller's buffer.
+
+typedef struct {
+    char *filename;
+    char *mode;
+    char *options;              // name/value string pairs
+    int options_len;
+} tftp_request_t;
+
+typedef struct {
+    int blksize;                // 0 when not asked for or out of range
+    int timeout;                // 0 when not asked for or out of range
+    bool tsize;
+    long long tsize_value;      // the size the peer told us, for uploads
+} tftp_options_t;
+
+// Split an RRQ or WRQ (opcode included) into its strings. Returns false
+// when they aren't all terminated within len.
+bool packet_parse_request(char *buffer, int len, tftp_request_t *req);
+
+// Pick out the options we know from a request's option pairs
+void packet_parse_options(const char *options, int len, tftp_options_t *opts);
+
+// Builders, each returning the packet's length. DATA only gets its header,
+// the data goes at buffer + 4. The OACK carries the options that are set
+// (tsize when tsize_value is known) and is empty, length 2, if none are.
+int packet_ack(char *buffer, uint16_t block);
+int packet_data(char *buffer, uint16_t block, int data_len);
+int packet_error(char *buffer, size_t size, int code, const char *message);
+int packet_oack(char *buffer, size_t size, const tftp_options_t *opts);
+
+#endif
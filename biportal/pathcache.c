@@ -0,0 +1,568 @@
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "biportal.h"
+#include "pathcache.h"
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#define PATHCACHE_INOTIFY 1
+#if defined(SYS_openat2) && defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#define PATHCACHE_OPENAT2 1
+#endif
+#endif
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#define PATHCACHE_KQUEUE 1
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#define PATHCACHE_ENTRIES 128
+#define PATHCACHE_DIRS 32
+
+struct pathcache_entry {
+    char *name;         // normalised path relative to the root
+    uint32_t hash;
+    int fd;
+    struct stat st;
+    int refs;
+    bool stale;         // no longer handed out, closed on last release
+    unsigned long used;
+    int dir;            // index into dirs[], -1 once the directory is gone
+    int wd;             // inotify watch on the file itself
+};
+
+typedef struct {
+    char *name;         // directory relative to the root, "" for the root
+    int fd;             // kqueue watches need an open descriptor
+    int wd;             // inotify watch
+} pathcache_dir_t;
+
+static int root_fd = -1;
+static char root_path[PATH_MAX];
+static int watch_fd = -1;
+static pathcache_entry_t entries[PATHCACHE_ENTRIES];
+static pathcache_dir_t dirs[PATHCACHE_DIRS];
+static unsigned long use_clock = 0;
+
+static uint32_t name_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int pathcache_normalise(const char *name, char *out, size_t out_size) {
+    size_t o = 0;
+    const char *p = name;
+
+    while (*p) {
+        while (*p == '/' || *p == '\\') p++;
+        if (!*p) break;
+
+        const char *c = p;
+        while (*p && *p != '/' && *p != '\\') p++;
+        size_t len = p - c;
+
+        if (len == 1 && c[0] == '.') continue;
+        if (len == 2 && c[0] == '.' && c[1] == '.') return EACCES;
+
+        if (o + len + 2 > out_size) return ENAMETOOLONG;
+        if (o) out[o++] = '/';
+        memcpy(out + o, c, len);
+        o += len;
+    }
+
+    if (!o) return EACCES;
+    out[o] = '\0';
+    return 0;
+}
+
+// Walk the normalised path one component at a time without following
+// symlinks, so nothing can escape the root even on kernels without openat2.
+static int open_walk(const char *norm, int flags, mode_t mode) {
+    char comp[NAME_MAX + 1];
+    int dir = root_fd;
+    const char *p = norm;
+
+    for (;;) {
+        const char *slash = strchr(p, '/');
+        if (!slash) break;
+
+        size_t len = slash - p;
+        if (len > NAME_MAX) {
+            if (dir != root_fd) close(dir);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(comp, p, len);
+        comp[len] = '\0';
+
+        int next = openat(dir, comp, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir != root_fd) close(dir);
+        if (next < 0) return -1;
+        dir = next;
+        p = slash + 1;
+    }
+
+    int fd = openat(dir, p, flags | O_NOFOLLOW | O_CLOEXEC, mode);
+    if (dir != root_fd) {
+        int saved = errno;
+        close(dir);
+        errno = saved;
+    }
+    return fd;
+}
+
+static int open_beneath(const char *norm, int flags, mode_t mode) {
+    if (root_fd < 0) {
+        errno = ENOENT;
+        return -1;
+    }
+#ifdef PATHCACHE_OPENAT2
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.mode = (flags & O_CREAT) ? mode : 0;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd = (int)syscall(SYS_openat2, root_fd, norm, &how, sizeof(how));
+    if (fd >= 0 || (errno != ENOSYS && errno != EPERM)) return fd;
+#endif
+    return open_walk(norm, flags, mode);
+}
+
+static void drop_entry(pathcache_entry_t *e) {
+#ifdef PATHCACHE_INOTIFY
+    if (e->wd >= 0) {
+        bool shared = false;
+        for (int i = 0; i < PATHCACHE_ENTRIES; i++) {
+            if (&entries[i] != e && entries[i].name && entries[i].wd == e->wd) {
+                shared = true;
+                break;
+            }
+        }
+        if (!shared) inotify_rm_watch(watch_fd, e->wd);
+    }
+#endif
+    // Closing the descriptor also removes its kqueue registration
+    close(e->fd);
+    free(e->name);
+    memset(e, 0, sizeof(*e));
+    e->fd = -1;
+    e->wd = -1;
+    e->dir = -1;
+}
+
+static void invalidate_entry(pathcache_entry_t *e) {
+    if (!e->name) return;
+    e->stale = true;
+    if (e->refs == 0) drop_entry(e);
+}
+
+// Invalidate the entry called name and everything below it, for renamed or
+// removed directories.
+static void invalidate_tree(const char *name) {
+    size_t len = strlen(name);
+    for (int i = 0; i < PATHCACHE_ENTRIES; i++) {
+        char *n = entries[i].name;
+        if (!n) continue;
+        if (!len || (!strncmp(n, name, len) && (n[len] == '\0' || n[len] == '/'))) {
+            invalidate_entry(&entries[i]);
+        }
+    }
+}
+
+static void drop_dir(int d) {
+    pathcache_dir_t *dir = &dirs[d];
+    if (!dir->name) return;
+#ifdef PATHCACHE_INOTIFY
+    if (dir->wd >= 0) inotify_rm_watch(watch_fd, dir->wd);
+#endif
+    if (dir->fd >= 0) close(dir->fd);
+    for (int i = 0; i < PATHCACHE_ENTRIES; i++) {
+        if (entries[i].name && entries[i].dir == d) {
+            entries[i].dir = -1;
+            invalidate_entry(&entries[i]);
+        }
+    }
+    free(dir->name);
+    dir->name = NULL;
+    dir->fd = -1;
+    dir->wd = -1;
+}
+
+static void flush_all(void) {
+    for (int i = 0; i < PATHCACHE_ENTRIES; i++) invalidate_entry(&entries[i]);
+    for (int d = 0; d < PATHCACHE_DIRS; d++) drop_dir(d);
+}
+
+// Find or start watching the directory that holds norm. Returns the dirs[]
+// index or -1 if the directory can't be watched, in which case the file must
+// not be cached.
+static int watch_dir(const char *norm) {
+    const char *slash = strrchr(norm, '/');
+    size_t len = slash ? (size_t)(slash - norm) : 0;
+    int free_slot = -1;
+
+    for (int d = 0; d < PATHCACHE_DIRS; d++) {
+        if (!dirs[d].name) {
+            if (free_slot < 0) free_slot = d;
+            continue;
+        }
+        if (strlen(dirs[d].name) == len && !strncmp(dirs[d].name, norm, len)) return d;
+    }
+
+    if (free_slot < 0) {
+        // Reclaim a directory none of the live entries live in
+        for (int d = 0; d < PATHCACHE_DIRS && free_slot < 0; d++) {
+            bool busy = false;
+            for (int i = 0; i < PATHCACHE_ENTRIES; i++) {
+                if (entries[i].name && entries[i].dir == d) {
+                    busy = true;
+                    break;
+                }
+            }
+            if (!busy) {
+                drop_dir(d);
+                free_slot = d;
+            }
+        }
+        if (free_slot < 0) return -1;
+    }
+
+    pathcache_dir_t *dir = &dirs[free_slot];
+    dir->name = strndup(norm, len);
+    dir->fd = -1;
+    dir->wd = -1;
+    if (!dir->name) return -1;
+
+#if defined(PATHCACHE_INOTIFY)
+    char full[PATH_MAX];
+    if (snprintf(full, sizeof(full), "%s%s%s", root_path, len ? "/" : "", dir->name) >= (int)sizeof(full)) {
+        drop_dir(free_slot);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    dir->wd = inotify_add_watch(watch_fd, full,
+                                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (dir->wd < 0) {
+        drop_dir(free_slot);
+        return -1;
+    }
+#elif defined(PATHCACHE_KQUEUE)
+    dir->fd = len ? open_beneath(dir->name, O_RDONLY | O_DIRECTORY, 0)
+                  : openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct kevent kev;
+    EV_SET(&kev, dir->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_WRITE | NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE, 0, dir);
+    if (dir->fd < 0 || kevent(watch_fd, &kev, 1, NULL, 0, NULL) < 0) {
+        drop_dir(free_slot);
+        return -1;
+    }
+#endif
+    return free_slot;
+}
+
+static bool watch_file(pathcache_entry_t *e) {
+#if defined(PATHCACHE_INOTIFY)
+    char full[PATH_MAX];
+    if (snprintf(full, sizeof(full), "%s/%s", root_path, e->name) >= (int)sizeof(full)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    e->wd = inotify_add_watch(watch_fd, full,
+                              IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                              IN_DELETE_SELF | IN_MOVE_SELF);
+    return e->wd >= 0;
+#elif defined(PATHCACHE_KQUEUE)
+    struct kevent kev;
+    EV_SET(&kev, e->fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+           NOTE_DELETE | NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_RENAME | NOTE_REVOKE, 0, e);
+    return kevent(watch_fd, &kev, 1, NULL, 0, NULL) == 0;
+#else
+    (void)e;
+    return false;
+#endif
+}
+
+int pathcache_set_root(const char *root) {
+    flush_all();
+    if (root_fd >= 0) {
+        close(root_fd);
+        root_fd = -1;
+    }
+
+    if (watch_fd < 0) {
+#if defined(PATHCACHE_INOTIFY)
+        watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#elif defined(PATHCACHE_KQUEUE)
+        watch_fd = kqueue();
+#endif
+        if (watch_fd < 0) {
+            LOG_INFO("No change notifications available, path cache disabled");
+        }
+        for (int i = 0; i < PATHCACHE_ENTRIES; i++) {
+            entries[i].fd = -1;
+            entries[i].wd = -1;
+            entries[i].dir = -1;
+        }
+        for (int d = 0; d < PATHCACHE_DIRS; d++) {
+            dirs[d].fd = -1;
+            dirs[d].wd = -1;
+        }
+    }
+
+    strncpy(root_path, root, sizeof(root_path) - 1);
+    root_path[sizeof(root_path) - 1] = '\0';
+    root_fd = open(root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        int err = errno;
+        LOG_ERROR("Failed to open TFTP root '%s': %s", root_path, strerror(err));
+        return err;
+    }
+    return 0;
+}
+
+int pathcache_open_read(const char *name, pathcache_entry_t **entry, int *fd, struct stat *st_out) {
+    char norm[PATH_MAX];
+    int err = pathcache_normalise(name, norm, sizeof(norm));
+    if (err) return err;
+
+    *entry = NULL;
+    uint32_t hash = name_hash(norm);
+    for (int i = 0; i < PATHCACHE_ENTRIES; i++) {
+        pathcache_entry_t *e = &entries[i];
+        if (e->name && !e->stale && e->hash == hash && !strcmp(e->name, norm)) {
+            e->refs++;
+            e->used = ++use_clock;
+            *entry = e;
+            *fd = e->fd;
+            *st_out = e->st;
+            return 0;
+        }
+    }
+
+    // Start watching the directory before opening, so a replacement racing
+    // with the open still produces an event.
+    int dir = watch_fd >= 0 ? watch_dir(norm) : -1;
+
+    int nfd = open_beneath(norm, O_RDONLY, 0);
+    if (nfd < 0) return errno;
+
+    struct stat st;
+    if (fstat(nfd, &st) < 0) {
+        err = errno;
+        close(nfd);
+        return err;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(nfd);
+        return S_ISDIR(st.st_mode) ? EISDIR : EACCES;
+    }
+
+    *fd = nfd;
+    *st_out = st;
+    if (dir < 0) return 0;
+
+    // Pick a free slot or evict the least recently used idle entry
+    pathcache_entry_t *slot = NULL;
+    for (int i = 0; i < PATHCACHE_ENTRIES; i++) {
+        pathcache_entry_t *e = &entries[i];
+        if (!e->name) {
+            slot = e;
+            break;
+        }
+        if (e->refs == 0 && (!slot || e->used < slot->used)) slot = e;
+    }
+    if (!slot) return 0;
+    if (slot->name) drop_entry(slot);
+
+    slot->name = strdup(norm);
+    if (!slot->name) return 0;
+    slot->hash = hash;
+    slot->fd = nfd;
+    slot->st = st;
+    slot->refs = 1;
+    slot->stale = false;
+    slot->used = ++use_clock;
+    slot->dir = dir;
+    slot->wd = -1;
+    if (!watch_file(slot)) {
+        // Hand the descriptor over to the caller uncached
+        slot->fd = -1;
+        drop_entry(slot);
+        return 0;
+    }
+    *entry = slot;
+    return 0;
+}
+
+int pathcache_open_write(const char *name) {
+    char norm[PATH_MAX];
+    int err = pathcache_normalise(name, norm, sizeof(norm));
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    invalidate_tree(norm);
+    return open_beneath(norm, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+int pathcache_open_temp(const char *name, int *dir, char *tmp_name, size_t tmp_size) {
+    static unsigned temp_seq = 0;
+    char norm[PATH_MAX];
+    int err = pathcache_normalise(name, norm, sizeof(norm));
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    // The directory is resolved as safely as any other path, the temporary
+    // is then created right in it
+    char *slash = strrchr(norm, '/');
+    const char *base = norm;
+    int d;
+    if (slash) {
+        *slash = '\0';
+        base = slash + 1;
+        d = open_beneath(norm, O_RDONLY | O_DIRECTORY, 0);
+    } else if (root_fd >= 0) {
+        d = dup(root_fd);
+    } else {
+        errno = ENOENT;
+        d = -1;
+    }
+    if (d < 0) return -1;
+
+    for (int attempt = 0; attempt < 16; attempt++) {
+        snprintf(tmp_name, tmp_size, ".%s.%d.%u", base, (int)getpid(), temp_seq++);
+        int fd = openat(d, tmp_name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            *dir = d;
+            return fd;
+        }
+        if (errno != EEXIST) break;
+    }
+    err = errno;
+    close(d);
+    errno = err;
+    return -1;
+}
+
+int pathcache_publish(int dir, const char *tmp_name, const char *name) {
+    char norm[PATH_MAX];
+    int err = pathcache_normalise(name, norm, sizeof(norm));
+    if (!err) {
+        const char *slash = strrchr(norm, '/');
+        if (renameat(dir, tmp_name, dir, slash ? slash + 1 : norm) < 0) err = errno;
+        invalidate_tree(norm);
+    }
+    if (err) unlinkat(dir, tmp_name, 0);
+    close(dir);
+    return err;
+}
+
+void pathcache_discard(int dir, const char *tmp_name) {
+    unlinkat(dir, tmp_name, 0);
+    close(dir);
+}
+
+void pathcache_release(pathcache_entry_t *entry, int fd) {
+    if (!entry) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    if (--entry->refs == 0 && entry->stale) drop_entry(entry);
+}
+
+void pathcache_invalidate(const char *name) {
+    char norm[PATH_MAX];
+    if (pathcache_normalise(name, norm, sizeof(norm)) == 0) invalidate_tree(norm);
+}
+
+int pathcache_watch_fd(void) {
+    return watch_fd;
+}
+
+void pathcache_handle_events(void) {
+    if (watch_fd < 0) return;
+#if defined(PATHCACHE_INOTIFY)
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t len = read(watch_fd, buf, sizeof(buf));
+        if (len <= 0) break;
+
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                flush_all();
+                continue;
+            }
+
+            int d;
+            for (d = 0; d < PATHCACHE_DIRS; d++) {
+                if (dirs[d].name && dirs[d].wd == ev->wd) break;
+            }
+            if (d < PATHCACHE_DIRS) {
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    invalidate_tree(dirs[d].name);
+                    if (ev->mask & IN_IGNORED) dirs[d].wd = -1;
+                    drop_dir(d);
+                } else if (ev->len) {
+                    char rel[PATH_MAX];
+                    snprintf(rel, sizeof(rel), "%s%s%s", dirs[d].name,
+                             dirs[d].name[0] ? "/" : "", ev->name);
+                    invalidate_tree(rel);
+                }
+                continue;
+            }
+
+            if (ev->mask & IN_IGNORED) continue;
+            for (int i = 0; i < PATHCACHE_ENTRIES; i++) {
+                if (entries[i].name && entries[i].wd == ev->wd) invalidate_entry(&entries[i]);
+            }
+        }
+    }
+#elif defined(PATHCACHE_KQUEUE)
+    struct kevent evs[32];
+    struct timespec zero = { 0, 0 };
+    int n;
+    while ((n = kevent(watch_fd, NULL, 0, evs, 32, &zero)) > 0) {
+        for (int i = 0; i < n; i++) {
+            void *udata = (void *)evs[i].udata;
+            if (udata >= (void *)dirs && udata < (void *)(dirs + PATHCACHE_DIRS)) {
+                int d = (int)((pathcache_dir_t *)udata - dirs);
+                if (!dirs[d].name) continue;
+                // kqueue doesn't say which entry changed, drop the whole directory
+                for (int j = 0; j < PATHCACHE_ENTRIES; j++) {
+                    if (entries[j].name && entries[j].dir == d) invalidate_entry(&entries[j]);
+                }
+                if (evs[i].fflags & (NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE)) {
+                    invalidate_tree(dirs[d].name);
+                    drop_dir(d);
+                }
+            } else if (udata) {
+                invalidate_entry((pathcache_entry_t *)udata);
+            }
+        }
+        if (n < 32) break;
+    }
+#endif
+}
@@ -0,0 +1,54 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Resolves request filenames beneath the TFTP root directory descriptor and
+// keeps recently used read descriptors open together with their stat data,
+// so that repeated RRQs skip the path walk, permission checks and open().
+// Entries are dropped when the file or its directory changes (inotify on
+// Linux, kqueue vnode events on macOS).
+
+typedef struct pathcache_entry pathcache_entry_t;
+
+// Turn a request filename into the root-relative path it resolves to:
+// backslashes become slashes, leading slashes, empty and "." components are
+// dropped. Returns 0 or an errno value (EACCES for "..").
+int pathcache_normalise(const char *name, char *out, size_t out_size);
+
+// (Re)anchor the resolver at a new root, flushing every cached entry.
+// Returns 0 or an errno value.
+int pathcache_set_root(const char *root);
+
+// Open a file for reading. On success *fd and *st are filled in and the
+// returned handle must be given back with pathcache_release(); the handle is
+// NULL when the descriptor could not be cached, in which case the caller owns
+// *fd. Returns 0 or an errno value.
+int pathcache_open_read(const char *name, pathcache_entry_t **entry, int *fd, struct stat *st);
+
+// Create or truncate a file for writing beneath the root. Returns the
+// descriptor or -1 with errno set.
+int pathcache_open_write(const char *name);
+
+// Create a hidden temporary next to where name would go, for a file that
+// should only appear under its name once complete. Returns a read/write
+// descriptor or -1 with errno set; *dir and tmp_name then identify the
+// temporary for pathcache_publish() or pathcache_discard(), one of which
+// must follow.
+int pathcache_open_temp(const char *name, int *dir, char *tmp_name, size_t tmp_size);
+
+// Rename the temporary to name. Returns 0 or an errno value; either way
+// the temporary's directory is closed and the temporary itself is gone.
+int pathcache_publish(int dir, const char *tmp_name, const char *name);
+void pathcache_discard(int dir, const char *tmp_name);
+
+void pathcache_release(pathcache_entry_t *entry, int fd);
+void pathcache_invalidate(const char *name);
+
+// Descriptor to poll for change notifications (-1 if unsupported) and the
+// handler to call when it becomes readable.
+int pathcache_watch_fd(void);
+void pathcache_handle_events(void);
+
+#endif
@@ -0,0 +1,59 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+
+#include "pmtu.h"
+
+// The interface holding the local address the route to the peer picked
+static int interface_mtu(const struct sockaddr_in *local) {
+    struct ifaddrs *ifs, *i;
+    if (getifaddrs(&ifs) < 0) return -1;
+
+    int mtu = -1;
+    for (i = ifs; i && mtu < 0; i = i->ifa_next) {
+        if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET) continue;
+        if (((struct sockaddr_in *)i->ifa_addr)->sin_addr.s_addr != local->sin_addr.s_addr) continue;
+
+        int s = socket(AF_INET, SOCK_DGRAM, 0);
+        if (s < 0) break;
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, i->ifa_name, sizeof(ifr.ifr_name) - 1);
+        if (ioctl(s, SIOCGIFMTU, &ifr) == 0) mtu = ifr.ifr_mtu;
+        close(s);
+    }
+    freeifaddrs(ifs);
+    return mtu;
+}
+
+int pmtu_block_size(const struct sockaddr_in *peer) {
+    // Connecting a datagram socket only looks up the route, nothing is sent
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) return PMTU_BLKSIZE_MIN;
+    struct sockaddr_in to = *peer;
+    if (!to.sin_port) to.sin_port = htons(69);
+    if (connect(s, (struct sockaddr *)&to, sizeof(to)) < 0) {
+        close(s);
+        return PMTU_BLKSIZE_MIN;
+    }
+
+    int mtu = -1;
+#ifdef IP_MTU
+    // Includes what ICMP "fragmentation needed" taught the kernel
+    socklen_t len = sizeof(mtu);
+    if (getsockopt(s, IPPROTO_IP, IP_MTU, &mtu, &len) < 0) mtu = -1;
+#endif
+    if (mtu < 0) {
+        struct sockaddr_in local;
+        socklen_t local_len = sizeof(local);
+        if (getsockname(s, (struct sockaddr *)&local, &local_len) == 0) mtu = interface_mtu(&local);
+    }
+    close(s);
+
+    int block = mtu - PMTU_OVERHEAD;
+    if (block < PMTU_BLKSIZE_MIN) return PMTU_BLKSIZE_MIN;
+    return block > PMTU_BLKSIZE_MAX ? PMTU_BLKSIZE_MAX : block;
+}
@@ -0,0 +1,20 @@
+#ifndef PMTU_H
+#define PMTU_H
+
+#include <netinet/in.h>
+
+// Picking a block size that never needs IP fragmentation. A lost fragment
+// costs the whole block, so under loss one oversized block does worse than
+// several that fit. Shared by biportal and PumpKIN.
+
+#define PMTU_OVERHEAD 32            // IPv4, UDP and TFTP DATA headers
+#define PMTU_BLKSIZE_MIN 512
+#define PMTU_BLKSIZE_MAX 65464      // RFC 2348
+
+// Largest block that reaches peer in a single datagram: the kernel's path
+// MTU for it (IP_MTU) where there is one, otherwise the MTU of the interface
+// the route to it leaves by. Jumbo frame links get jumbo blocks. Returns
+// PMTU_BLKSIZE_MIN if neither can be found.
+int pmtu_block_size(const struct sockaddr_in *peer);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "biportal.h"
+#include "ratelimit.h"
+
+#define RATELIMIT_SOURCES 1024      // buckets, the least recently seen one is reused
+#define RATELIMIT_PROBE 8
+#define RATELIMIT_REJECTS 256
+#define RATELIMIT_MAX 1000000       // rate and burst, so a full bucket of thousandths fits 32 bits
+
+typedef struct {
+    in_addr_t addr;
+    bool used;
+    uint32_t tokens;            // thousandths of a request
+    uint32_t dropped;           // since the bucket last ran dry
+    uint64_t refilled;
+} ratelimit_source_t;
+
+typedef struct {
+    in_addr_t addr;
+    uint32_t key;
+    uint64_t expires;
+    int code;
+    char message[64];
+} ratelimit_reject_t;
+
+static ratelimit_source_t sources[RATELIMIT_SOURCES];
+static ratelimit_reject_t rejects[RATELIMIT_REJECTS];
+
+static int rate = 20;
+static int burst = 60;
+static int reject_ttl = 5;
+
+bool ratelimit_configure(const char *config) {
+    if (strncmp(config, "rate_limit=", 11) == 0) {
+        int n = atoi(config + 11);
+        rate = n > 0 ? (n < RATELIMIT_MAX ? n : RATELIMIT_MAX) : 0;
+        memset(sources, 0, sizeof(sources));
+        return true;
+    }
+    if (strncmp(config, "rate_burst=", 11) == 0) {
+        int n = atoi(config + 11);
+        burst = n > 1 ? (n < RATELIMIT_MAX ? n : RATELIMIT_MAX) : 1;
+        return true;
+    }
+    if (strncmp(config, "reject_ttl=", 11) == 0) {
+        int n = atoi(config + 11);
+        reject_ttl = n > 0 ? n : 0;
+        memset(rejects, 0, sizeof(rejects));
+        return true;
+    }
+    return false;
+}
+
+static uint32_t address_hash(in_addr_t addr) {
+    return (uint32_t)addr * 2654435761u;
+}
+
+// The opcode and filename identify a request, the port doesn't: a looping
+// client asks from a new one every time
+static uint32_t request_key(int opcode, const char *filename, size_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t)opcode;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)filename[i]) * 16777619u;
+    return h;
+}
+
+static ratelimit_reject_t *reject_slot(in_addr_t addr, uint32_t key) {
+    return &rejects[(address_hash(addr) ^ key) % RATELIMIT_REJECTS];
+}
+
+static ratelimit_source_t *source_for(in_addr_t addr, uint64_t now) {
+    uint32_t h = address_hash(addr);
+    ratelimit_source_t *oldest = NULL;
+    for (int i = 0; i < RATELIMIT_PROBE; i++) {
+        ratelimit_source_t *s = &sources[(h + i) % RATELIMIT_SOURCES];
+        if (!s->used) {
+            // Buckets are only ever cleared all at once, so it isn't further on
+            oldest = s;
+            break;
+        }
+        if (s->addr == addr) return s;
+        if (!oldest || s->refilled < oldest->refilled) oldest = s;
+    }
+    // A newcomer starts with a full bucket
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->used = true;
+    oldest->addr = addr;
+    oldest->tokens = burst * 1000;
+    oldest->refilled = now;
+    return oldest;
+}
+
+static bool take_token(const struct sockaddr_in *addr, uint64_t now) {
+    ratelimit_source_t *s = source_for(addr->sin_addr.s_addr, now);
+    uint64_t tokens = s->tokens + (now - s->refilled) * rate;
+    s->tokens = tokens > (uint64_t)burst * 1000 ? (uint32_t)burst * 1000 : (uint32_t)tokens;
+    s->refilled = now;
+
+    if (s->tokens < 1000) {
+        if (!s->dropped++) {
+            LOG_INFO("Too many requests from %s, dropping", inet_ntoa(addr->sin_addr));
+        }
+        return false;
+    }
+    s->tokens -= 1000;
+    if (s->dropped) {
+        LOG_INFO("Dropped %u requests from %s", s->dropped, inet_ntoa(addr->sin_addr));
+        s->dropped = 0;
+    }
+    return true;
+}
+
+bool ratelimit_admit(int sock, const struct sockaddr_in *addr, const char *packet, int len, uint64_t now) {
+    if (len < 4) return true;
+    int opcode = ((unsigned char)packet[0] << 8) | (unsigned char)packet[1];
+    if (opcode != TFTP_RRQ && opcode != TFTP_WRQ) return true;
+
+    if (rate && !take_token(addr, now)) return false;
+
+    if (reject_ttl) {
+        const char *name = packet + 2;
+        const char *end = memchr(name, '\0', len - 2);
+        if (!end) return true;
+        uint32_t key = request_key(opcode, name, end - name);
+        ratelimit_reject_t *r = reject_slot(addr->sin_addr.s_addr, key);
+        if (r->expires > now && r->addr == addr->sin_addr.s_addr && r->key == key) {
+            LOG_DEBUG("Refusing repeated request from %s again", inet_ntoa(addr->sin_addr));
+            send_error(sock, (struct sockaddr_in *)addr, r->code, r->message);
+            return false;
+        }
+    }
+    return true;
+}
+
+void ratelimit_rejected(const struct sockaddr_in *addr, int opcode, const char *filename, int code, const char *message) {
+    if (!reject_ttl) return;
+    uint32_t key = request_key(opcode, filename, strlen(filename));
+    ratelimit_reject_t *r = reject_slot(addr->sin_addr.s_addr, key);
+    r->addr = addr->sin_addr.s_addr;
+    r->key = key;
+    r->expires = monotonic_ms() + reject_ttl * 1000;
+    r->code = code;
+    snprintf(r->message, sizeof(r->message), "%s", message);
+}
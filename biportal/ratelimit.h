@@ -0,0 +1,30 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Request storms are dealt with before they cost anything: every packet on
+// the listening socket is checked right after it is read. Each source
+// address has a token bucket of requests; beyond it requests are dropped
+// unanswered, which makes the client back off. A request that was refused
+// a moment ago (no such file, access denied, turned down in PumpKIN) is
+// refused again from a small cache, without touching the filesystem or
+// bothering PumpKIN.
+
+// Handles "rate_limit=REQUESTS_PER_SECOND" (0 turns the buckets off),
+// "rate_burst=REQUESTS" (both up to 1000000) and "reject_ttl=SECONDS" (0
+// turns the cache off).
+// Returns false if the option isn't ours.
+bool ratelimit_configure(const char *config);
+
+// Whether the request just read should be handled; false when it was
+// dropped or refused again here.
+bool ratelimit_admit(int sock, const struct sockaddr_in *addr, const char *packet, int len, uint64_t now);
+
+// Remember that a request for filename (opcode RRQ or WRQ) from this
+// address was refused with this error
+void ratelimit_rejected(const struct sockaddr_in *addr, int opcode, const char *filename, int code, const char *message);
+
+#endif
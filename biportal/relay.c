@@ -0,0 +1,401 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "biportal.h"
+#include "pathcache.h"
+#include "pmtu.h"
+#include "capture.h"
+#include "relay.h"
+
+#define RELAY_DEFAULT_TIMEOUT 2     // seconds, upstream is across a WAN
+#define RELAY_RETRIES 5
+#define RELAY_REQUEST_MAX 512
+
+struct relay_fetch {
+    bool active;
+    char *name;
+    int refs;                   // transfers streaming from it
+    int sock;
+    struct sockaddr_in local;
+    struct sockaddr_in peer;    // upstream's transfer port once it answered
+    bool answered;
+    int fd;                     // the temporary being filled
+    int dir;                    // its directory until published, -1 if never cached
+    char tmp_name[NAME_MAX + 1];
+    int block_size;
+    uint16_t block;             // last block received
+    off_t have;
+    off_t size;
+    bool complete;
+    int error;
+    char message[128];
+    char packet[RELAY_REQUEST_MAX];     // RRQ or ACK, for retransmission
+    int packet_len;
+    int retries;
+    uint64_t deadline;
+    uint64_t started;
+};
+
+static struct sockaddr_in upstream;
+static bool upstream_set = false;
+static int upstream_timeout = RELAY_DEFAULT_TIMEOUT;
+static relay_fetch_t fetches[RELAY_MAX_FETCHES];
+static relay_fetch_t *polled[RELAY_MAX_FETCHES];
+
+bool relay_configure(const char *config) {
+    if (strncmp(config, "upstream=", 9) == 0) {
+        const char *value = config + 9;
+        if (!*value || !strcmp(value, "off")) {
+            upstream_set = false;
+            LOG_INFO("Relaying turned off");
+            return true;
+        }
+
+        char host[256];
+        const char *port = "69";
+        snprintf(host, sizeof(host), "%s", value);
+        char *colon = strrchr(host, ':');
+        if (colon) {
+            *colon = '\0';
+            port = colon + 1;
+        }
+
+        struct addrinfo hints, *ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        int err = getaddrinfo(host, port, &hints, &ai);
+        if (err) {
+            LOG_ERROR("Can't resolve upstream '%s': %s", value, gai_strerror(err));
+            return true;
+        }
+        memcpy(&upstream, ai->ai_addr, sizeof(upstream));
+        freeaddrinfo(ai);
+        upstream_set = true;
+        LOG_INFO("Relaying missing files from %s:%d", inet_ntoa(upstream.sin_addr), ntohs(upstream.sin_port));
+        return true;
+    }
+    if (strncmp(config, "upstream_timeout=", 17) == 0) {
+        int timeout = atoi(config + 17);
+        if (timeout >= 1 && timeout <= 255) upstream_timeout = timeout;
+        return true;
+    }
+    return false;
+}
+
+bool relay_enabled(void) {
+    return upstream_set;
+}
+
+static void send_upstream(relay_fetch_t *f, int len, uint64_t now) {
+    f->packet_len = len;
+    f->retries = 0;
+    f->deadline = now + upstream_timeout * 1000;
+    const struct sockaddr_in *to = f->answered ? &f->peer : &upstream;
+    sendto(f->sock, f->packet, len, 0, (const struct sockaddr *)to, sizeof(*to));
+    CAPTURE(&f->local, to, f->packet, len);
+}
+
+static void send_upstream_ack(relay_fetch_t *f, uint16_t block, uint64_t now) {
+    *(uint16_t *)f->packet = htons(TFTP_ACK);
+    *(uint16_t *)(f->packet + 2) = htons(block);
+    send_upstream(f, 4, now);
+}
+
+static void free_fetch(relay_fetch_t *f) {
+    if (f->sock >= 0) close(f->sock);
+    if (f->fd >= 0) close(f->fd);
+    if (f->dir >= 0) pathcache_discard(f->dir, f->tmp_name);
+    free(f->name);
+    memset(f, 0, sizeof(*f));
+}
+
+// Done talking to upstream, one way or the other
+static void end_fetch(relay_fetch_t *f, int error, const char *message) {
+    close(f->sock);
+    f->sock = -1;
+    f->packet_len = 0;
+
+    if (error >= 0) {
+        f->error = error;
+        snprintf(f->message, sizeof(f->message), "%s", message);
+        LOG_INFO("Relaying '%s' failed: %s", f->name, message);
+    } else {
+        f->complete = true;
+        f->size = f->have;
+        int err = f->dir >= 0 ? pathcache_publish(f->dir, f->tmp_name, f->name) : ENOENT;
+        f->dir = -1;
+        LOG_INFO("Fetched '%s' from upstream, %lld bytes in %llu ms, %s%s", f->name, (long long)f->have,
+                 (unsigned long long)(monotonic_ms() - f->started),
+                 err ? "not cached: " : "cached", err ? strerror(err) : "");
+    }
+    if (f->refs == 0) free_fetch(f);
+}
+
+static relay_fetch_t *start_fetch(const char *name) {
+    relay_fetch_t *f = NULL;
+    for (int i = 0; i < RELAY_MAX_FETCHES && !f; i++) {
+        if (!fetches[i].active) f = &fetches[i];
+    }
+    size_t name_len = strlen(name);
+    if (!f || name_len > RELAY_REQUEST_MAX - 64) {
+        errno = f ? ENAMETOOLONG : EBUSY;
+        return NULL;
+    }
+
+    memset(f, 0, sizeof(*f));
+    f->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    f->fd = -1;
+    f->dir = -1;
+    f->name = strdup(name);
+    if (f->sock < 0 || !f->name) {
+        int err = f->sock < 0 ? errno : ENOMEM;
+        if (f->sock >= 0) close(f->sock);
+        free(f->name);
+        errno = err;
+        return NULL;
+    }
+    fcntl(f->sock, F_SETFL, fcntl(f->sock, F_GETFL) | O_NONBLOCK);
+    f->active = true;
+
+    // The temporary goes where the file belongs. If that directory doesn't
+    // exist we still relay, from an unlinked temporary, but can't cache.
+    f->fd = pathcache_open_temp(name, &f->dir, f->tmp_name, sizeof(f->tmp_name));
+    if (f->fd < 0) {
+        int dir;
+        f->fd = pathcache_open_temp("relay", &dir, f->tmp_name, sizeof(f->tmp_name));
+        if (f->fd >= 0) pathcache_discard(dir, f->tmp_name);
+    }
+    if (f->fd < 0) {
+        int err = errno;
+        free_fetch(f);
+        errno = err;
+        return NULL;
+    }
+
+    // Connecting would pin upstream's listening port, which only answers
+    // the request; the transfer port is learnt from the first reply
+    struct sockaddr_in any;
+    memset(&any, 0, sizeof(any));
+    any.sin_family = AF_INET;
+    bind(f->sock, (struct sockaddr *)&any, sizeof(any));
+    socklen_t local_len = sizeof(f->local);
+    getsockname(f->sock, (struct sockaddr *)&f->local, &local_len);
+
+    f->block_size = 512;
+    f->size = -1;
+    f->error = -1;
+    f->started = monotonic_ms();
+
+    char *p = f->packet;
+    *(uint16_t *)p = htons(TFTP_RRQ);
+    p += 2;
+    p += sprintf(p, "%s", name) + 1;
+    p += sprintf(p, "octet") + 1;
+    p += sprintf(p, "blksize") + 1;
+    p += sprintf(p, "%d", pmtu_block_size(&upstream)) + 1;
+    p += sprintf(p, "tsize") + 1;
+    p += sprintf(p, "0") + 1;
+    p += sprintf(p, "timeout") + 1;
+    p += sprintf(p, "%d", upstream_timeout) + 1;
+    send_upstream(f, p - f->packet, f->started);
+
+    LOG_INFO("Relaying '%s' from %s:%d", name, inet_ntoa(upstream.sin_addr), ntohs(upstream.sin_port));
+    return f;
+}
+
+relay_fetch_t *relay_join(const char *request) {
+    if (!upstream_set) {
+        errno = ENOENT;
+        return NULL;
+    }
+    // "a//b", "./a/b" and "a\b" are one file, so they are one fetch of it
+    char name[PATH_MAX];
+    int err = pathcache_normalise(request, name, sizeof(name));
+    if (err) {
+        errno = err;
+        return NULL;
+    }
+    relay_fetch_t *f = NULL;
+    for (int i = 0; i < RELAY_MAX_FETCHES && !f; i++) {
+        relay_fetch_t *c = &fetches[i];
+        if (c->active && c->error < 0 && !strcmp(c->name, name)) f = c;
+    }
+    if (f) {
+        LOG_DEBUG("Joining the running fetch of '%s'", name);
+    } else if (!(f = start_fetch(name))) {
+        return NULL;
+    }
+    f->refs++;
+    return f;
+}
+
+void relay_leave(relay_fetch_t *f) {
+    // An unwatched fetch carries on, the file is still worth caching
+    if (--f->refs == 0 && (f->complete || f->error >= 0)) free_fetch(f);
+}
+
+int relay_fd(relay_fetch_t *f) {
+    return f->fd;
+}
+
+off_t relay_available(relay_fetch_t *f) {
+    return f->have;
+}
+
+off_t relay_size(relay_fetch_t *f) {
+    return f->size;
+}
+
+bool relay_complete(relay_fetch_t *f) {
+    return f->complete;
+}
+
+int relay_error(relay_fetch_t *f, const char **message) {
+    *message = f->message;
+    return f->error;
+}
+
+int relay_poll_fds(struct pollfd *fds, int max) {
+    int n = 0;
+    for (int i = 0; i < RELAY_MAX_FETCHES && n < max; i++) {
+        relay_fetch_t *f = &fetches[i];
+        if (!f->active || f->sock < 0) continue;
+        fds[n].fd = f->sock;
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        polled[n++] = f;
+    }
+    return n;
+}
+
+int relay_timeout(uint64_t now, int timeout) {
+    for (int i = 0; i < RELAY_MAX_FETCHES; i++) {
+        relay_fetch_t *f = &fetches[i];
+        if (!f->active || !f->packet_len) continue;
+        int wait = f->deadline > now ? (int)(f->deadline - now) : 0;
+        if (wait < timeout) timeout = wait;
+    }
+    return timeout;
+}
+
+static void parse_oack(relay_fetch_t *f, const char *p, const char *end) {
+    while (p < end) {
+        const char *value = p + strnlen(p, end - p) + 1;
+        if (value >= end) break;
+        const char *next = value + strnlen(value, end - value) + 1;
+        if (!strcasecmp(p, "blksize")) {
+            int blksize = atoi(value);
+            if (blksize >= 8 && blksize <= TFTP_PACKET_MAX - 4) f->block_size = blksize;
+        } else if (!strcasecmp(p, "tsize")) {
+            f->size = strtoll(value, NULL, 10);
+        }
+        p = next;
+    }
+}
+
+// Returns true when there is news for the transfers streaming from it
+static bool handle_packet(relay_fetch_t *f, const struct sockaddr_in *from, char *buffer, int len, uint64_t now) {
+    if (f->answered && (from->sin_addr.s_addr != f->peer.sin_addr.s_addr || from->sin_port != f->peer.sin_port)) {
+        return false;
+    }
+    if (from->sin_addr.s_addr != upstream.sin_addr.s_addr || len < 4) return false;
+
+    uint16_t opcode = ntohs(*(uint16_t *)buffer);
+    uint16_t block = ntohs(*(uint16_t *)(buffer + 2));
+    if (!f->answered) {
+        f->peer = *from;
+        f->answered = true;
+    }
+
+    switch (opcode) {
+        case TFTP_OACK:
+            if (f->block) break;
+            parse_oack(f, buffer + 2, buffer + len);
+            send_upstream_ack(f, 0, now);
+            return f->size >= 0;
+
+        case TFTP_DATA: {
+            int data_len = len - 4;
+            if (block == f->block && f->block) {
+                // Our ACK got lost
+                send_upstream_ack(f, block, now);
+                break;
+            }
+            if (block != (uint16_t)(f->block + 1)) break;
+
+            if (pwrite(f->fd, buffer + 4, data_len, f->have) != data_len) {
+                int err = errno;
+                *(uint16_t *)f->packet = htons(TFTP_ERROR);
+                *(uint16_t *)(f->packet + 2) = htons(TFTP_ERR_DISK_FULL);
+                int msg_len = snprintf(f->packet + 4, RELAY_REQUEST_MAX - 4, "%s", strerror(err)) + 1;
+                sendto(f->sock, f->packet, 4 + msg_len, 0, (struct sockaddr *)&f->peer, sizeof(f->peer));
+                end_fetch(f, TFTP_ERR_UNDEFINED, strerror(err));
+                return true;
+            }
+            f->have += data_len;
+            f->block = block;
+            send_upstream_ack(f, block, now);
+            if (data_len < f->block_size) {
+                // Upstream dallies for a lost final ACK; we don't need to
+                f->packet_len = 0;
+                end_fetch(f, -1, NULL);
+            }
+            return true;
+        }
+
+        case TFTP_ERROR: {
+            char message[128];
+            snprintf(message, sizeof(message), "Upstream: %.*s", len - 4 > 100 ? 100 : len - 4, buffer + 4);
+            // A refused option would get the same answer again
+            end_fetch(f, block <= TFTP_ERR_OPTION ? block : TFTP_ERR_UNDEFINED, message);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool relay_handle(struct pollfd *fds, int count, uint64_t now) {
+    static char buffer[TFTP_PACKET_MAX];
+    bool news = false;
+
+    for (int i = 0; i < count; i++) {
+        relay_fetch_t *f = polled[i];
+        if (!(fds[i].revents & POLLIN) || !f->active || f->sock < 0) continue;
+
+        // Drain what queued up, a fast upstream may be blocks ahead of us
+        for (;;) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int len = recvfrom(f->sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+            if (len <= 0) break;
+            CAPTURE(&from, &f->local, buffer, len);
+            if (handle_packet(f, &from, buffer, len, now)) news = true;
+            if (!f->active || f->sock < 0) break;
+        }
+    }
+
+    for (int i = 0; i < RELAY_MAX_FETCHES; i++) {
+        relay_fetch_t *f = &fetches[i];
+        if (!f->active || !f->packet_len || now < f->deadline) continue;
+        if (f->retries >= RELAY_RETRIES) {
+            end_fetch(f, TFTP_ERR_UNDEFINED, "Upstream not responding");
+            news = true;
+            continue;
+        }
+        f->retries++;
+        f->deadline = now + upstream_timeout * 1000;
+        const struct sockaddr_in *to = f->answered ? &f->peer : &upstream;
+        sendto(f->sock, f->packet, f->packet_len, 0, (const struct sockaddr *)to, sizeof(*to));
+        CAPTURE(&f->local, to, f->packet, f->packet_len);
+    }
+    return news;
+}
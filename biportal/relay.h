@@ -0,0 +1,49 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+
+// Site-local relay: an RRQ for a file we don't have is fetched from an
+// upstream TFTP server into a temporary beside where the file belongs,
+// streamed to the requester as the blocks arrive, and renamed into place
+// once complete, so the next request is served locally. Requests for a
+// file that is already being fetched join the running fetch instead of
+// starting another one.
+
+#define RELAY_MAX_FETCHES 16
+
+typedef struct relay_fetch relay_fetch_t;
+
+// Handles "upstream=HOST[:PORT]" (empty or "off" turns relaying off) and
+// "upstream_timeout=SECONDS". Returns false if the option isn't ours.
+bool relay_configure(const char *config);
+
+bool relay_enabled(void);
+
+// Join the fetch of the file request names, however it is spelled,
+// starting one if none is running. Returns NULL with errno set when it
+// can't be fetched.
+relay_fetch_t *relay_join(const char *request);
+void relay_leave(relay_fetch_t *fetch);
+
+// The file as far as it has arrived; read it with pread() on relay_fd()
+int relay_fd(relay_fetch_t *fetch);
+off_t relay_available(relay_fetch_t *fetch);
+off_t relay_size(relay_fetch_t *fetch);         // -1 until upstream tells
+bool relay_complete(relay_fetch_t *fetch);
+
+// The TFTP error code the fetch failed with, -1 while it hasn't
+int relay_error(relay_fetch_t *fetch, const char **message);
+
+// Main loop plumbing: the upstream sockets to poll, the milliseconds until
+// the next retransmission is due (or timeout if sooner) and the handler
+// for the poll results, which returns true when new data arrived or a
+// fetch ended, so stalled transfers should look again.
+int relay_poll_fds(struct pollfd *fds, int max);
+int relay_timeout(uint64_t now, int timeout);
+bool relay_handle(struct pollfd *fds, int count, uint64_t now);
+
+#endif
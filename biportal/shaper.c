@@ -0,0 +1,217 @@
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "biportal.h"
+#include "shaper.h"
+
+#define SHAPER_QUANTUM 512           // bytes added to a transfer's deficit per round, the default block
+#define SHAPER_DEPTH_MS 5            // bucket depth, in time at the capped rate
+#define SHAPER_DEPTH_MIN 1500
+#define SHAPER_SUBNETS MAX_TRANSFERS
+
+// Tokens are thousandths of a byte, so that milliseconds times bytes per
+// second fill it exactly. A packet may take it below zero; the next one
+// waits until it is paid off.
+typedef struct {
+    int64_t rate;               // bytes per second, 0 without a cap
+    int64_t tokens;
+    uint64_t refilled;
+} bucket_t;
+
+typedef struct {
+    bool used;
+    in_addr_t net;
+    bucket_t bucket;
+} subnet_t;
+
+static bucket_t total;
+static int64_t subnet_rate = 0;
+static int subnet_prefix = 24;
+static subnet_t subnets[SHAPER_SUBNETS];
+
+// The transfers with a block waiting, in round robin order
+static transfer_t *ring[MAX_TRANSFERS];
+static int head = 0;
+static int count = 0;
+static uint32_t round_no = 0;       // rounds completed
+static int round_left = 0;          // visits left in the current one
+
+static int64_t depth(int64_t rate) {
+    int64_t d = rate * SHAPER_DEPTH_MS / 1000;
+    return (d < SHAPER_DEPTH_MIN ? SHAPER_DEPTH_MIN : d) * 1000;
+}
+
+static void refill(bucket_t *b, uint64_t now) {
+    if (!b->rate) return;
+    b->tokens += (int64_t)(now - b->refilled) * b->rate;
+    if (b->tokens > depth(b->rate)) b->tokens = depth(b->rate);
+    b->refilled = now;
+}
+
+static void reset(bucket_t *b, int64_t rate, uint64_t now) {
+    b->rate = rate;
+    b->tokens = depth(rate);
+    b->refilled = now;
+}
+
+static bool may_send(const bucket_t *b) {
+    return !b->rate || b->tokens > 0;
+}
+
+static void spend(bucket_t *b, int bytes) {
+    if (b->rate) b->tokens -= (int64_t)bytes * 1000;
+}
+
+// Milliseconds until the bucket lets the next packet go
+static int wait_for(const bucket_t *b, uint64_t now) {
+    if (!b->rate) return 0;
+    int64_t tokens = b->tokens + (int64_t)(now - b->refilled) * b->rate;
+    return tokens > 0 ? 0 : (int)(-tokens / b->rate) + 1;
+}
+
+bool shaper_configure(const char *config) {
+    if (strncmp(config, "bandwidth=", 10) == 0) {
+        long long rate = atoll(config + 10);
+        reset(&total, rate > 0 ? rate : 0, monotonic_ms());
+        if (total.rate) {
+            LOG_INFO("Capped bandwidth at %lld bytes/s", (long long)total.rate);
+        } else {
+            LOG_INFO("Bandwidth not capped");
+        }
+        return true;
+    }
+    if (strncmp(config, "subnet_bandwidth=", 17) == 0) {
+        long long rate = atoll(config + 17);
+        subnet_rate = rate > 0 ? rate : 0;
+        memset(subnets, 0, sizeof(subnets));
+        return true;
+    }
+    if (strncmp(config, "subnet_prefix=", 14) == 0) {
+        int bits = atoi(config + 14);
+        subnet_prefix = bits < 0 ? 0 : bits > 32 ? 32 : bits;
+        memset(subnets, 0, sizeof(subnets));
+        return true;
+    }
+    return false;
+}
+
+bool shaper_enabled(void) {
+    return total.rate || subnet_rate;
+}
+
+// The bucket of the transfer's subnet, taking over the stalest one for a
+// subnet we haven't seen lately
+static bucket_t *subnet_bucket(const transfer_t *transfer, uint64_t now) {
+    uint32_t mask = subnet_prefix ? htonl(0xffffffffu << (32 - subnet_prefix)) : 0;
+    in_addr_t net = transfer->client_addr.sin_addr.s_addr & mask;
+    subnet_t *slot = NULL;
+    for (int i = 0; i < SHAPER_SUBNETS; i++) {
+        subnet_t *s = &subnets[i];
+        if (s->used && s->net == net) {
+            refill(&s->bucket, now);
+            return &s->bucket;
+        }
+        if (!slot || (slot->used && (!s->used || s->bucket.refilled < slot->bucket.refilled))) slot = s;
+    }
+    slot->used = true;
+    slot->net = net;
+    reset(&slot->bucket, subnet_rate, now);
+    return &slot->bucket;
+}
+
+void shaper_enqueue(transfer_t *transfer) {
+    if (transfer->queued) return;
+    transfer->queued = true;
+    ring[(head + count++) % MAX_TRANSFERS] = transfer;
+}
+
+void shaper_cancel(transfer_t *transfer) {
+    if (!transfer->queued) return;
+    int i;
+    for (i = 0; i < count && ring[(head + i) % MAX_TRANSFERS] != transfer; i++);
+    for (; i < count - 1; i++) {
+        ring[(head + i) % MAX_TRANSFERS] = ring[(head + i + 1) % MAX_TRANSFERS];
+    }
+    count--;
+    transfer->queued = false;
+}
+
+void shaper_charge(const transfer_t *transfer, int bytes) {
+    if (!shaper_enabled()) return;
+    uint64_t now = monotonic_ms();
+    refill(&total, now);
+    spend(&total, bytes);
+    if (subnet_rate) spend(subnet_bucket(transfer, now), bytes);
+}
+
+static void rotate(void) {
+    ring[(head + count) % MAX_TRANSFERS] = ring[head];
+    head = (head + 1) % MAX_TRANSFERS;
+}
+
+void shaper_run(uint64_t now, void (*transmit)(transfer_t *transfer)) {
+    if (!count) return;
+    refill(&total, now);
+
+    // Deficit round robin; one whose subnet is out of tokens lets the
+    // others go first. Stop once all that are left are held up that way.
+    int blocked = 0;
+    while (count && blocked < count && may_send(&total)) {
+        if (!round_left) {
+            round_no++;
+            round_left = count;
+        }
+        round_left--;
+
+        // A transfer gets a quantum for every round, including those that
+        // went by while it waited for its ACK, but can't save up for more
+        // than its next block
+        transfer_t *t = ring[head];
+        uint32_t missed = round_no - t->round;
+        t->round = round_no;
+        if (missed) {
+            int64_t deficit = t->deficit + (int64_t)missed * SHAPER_QUANTUM;
+            t->deficit = deficit > t->packet_len ? t->packet_len : (int)deficit;
+        }
+        if (t->deficit < t->packet_len) {
+            rotate();
+            blocked = 0;
+            continue;
+        }
+        bucket_t *net = subnet_rate ? subnet_bucket(t, now) : NULL;
+        if (net && !may_send(net)) {
+            rotate();
+            blocked++;
+            continue;
+        }
+        spend(&total, t->packet_len);
+        if (net) spend(net, t->packet_len);
+
+        // Its only block is out. It isn't idle, just waiting for the ACK, so
+        // what is left of its deficit stays for the next block.
+        head = (head + 1) % MAX_TRANSFERS;
+        count--;
+        t->queued = false;
+        t->deficit -= t->packet_len;
+        transmit(t);
+        blocked = 0;
+    }
+}
+
+int shaper_timeout(uint64_t now, int timeout) {
+    if (!count) return timeout;
+    int global_wait = wait_for(&total, now);
+    int wait = timeout;
+    for (int i = 0; i < count; i++) {
+        transfer_t *t = ring[(head + i) % MAX_TRANSFERS];
+        int w = global_wait;
+        if (subnet_rate) {
+            int net_wait = wait_for(subnet_bucket(t, now), now);
+            if (net_wait > w) w = net_wait;
+        }
+        if (w < wait) wait = w;
+    }
+    // Whatever could go has gone, don't spin
+    return wait < 1 ? 1 : wait;
+}
@@ -0,0 +1,36 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "transfer.h"
+
+// Bandwidth sharing for DATA blocks. With a cap on our total send rate,
+// per source subnet or both, blocks wait in a deficit round robin over
+// the transfers, so each gets an equal share in bytes whatever its block
+// size, and leave as the token buckets allow. The buckets hold only a few
+// milliseconds' worth, which spaces the blocks out instead of sending
+// them in bursts. Without a cap blocks go out as soon as they are ready.
+
+// Handles "bandwidth=BYTES_PER_SECOND", "subnet_bandwidth=BYTES_PER_SECOND"
+// (0 lifts either cap) and "subnet_prefix=BITS". Returns false if the
+// option isn't ours.
+bool shaper_configure(const char *config);
+
+bool shaper_enabled(void);
+
+// Queue the DATA packet in the transfer's buffer; transmit() is called
+// for it from shaper_run() when its turn comes
+void shaper_enqueue(transfer_t *transfer);
+void shaper_cancel(transfer_t *transfer);
+
+// Account for a packet sent outside the queue, e.g. a retransmission
+void shaper_charge(const transfer_t *transfer, int bytes);
+
+// Send whatever may go now, and how long the main loop may sleep before
+// more can, at most timeout ms
+void shaper_run(uint64_t now, void (*transmit)(transfer_t *transfer));
+int shaper_timeout(uint64_t now, int timeout);
+
+#endif
@@ -0,0 +1,282 @@
+#ifdef __linux__
+#define _GNU_SOURCE             // posix_spawn_file_actions_addclosefrom_np
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "biportal.h"
+#include "bufpool.h"
+#include "sink.h"
+
+#define SINK_MAX_CHILDREN (2 * MAX_TRANSFERS)  // some may outlive their upload a little
+
+extern char **environ;
+
+typedef struct {
+    char pattern[128];
+    char target[256];           // "|COMMAND" or "unix:PATH"
+} sink_rule_t;
+
+struct sink {
+    int fd;
+    pid_t pid;                  // the command, 0 for a socket
+    char *pending;              // pooled, what the consumer hasn't taken yet
+    int pending_off;
+    int pending_len;
+};
+
+// Commands that were started and haven't been waited for
+typedef struct {
+    pid_t pid;
+    char name[64];
+} sink_child_t;
+
+static sink_rule_t rules[SINK_MAX_RULES];
+static int rule_count = 0;
+
+static sink_child_t children[SINK_MAX_CHILDREN];
+
+bool sink_configure(const char *config) {
+    if (strncmp(config, "sink=", 5) != 0) return false;
+
+    LOG_ERROR("Sink rules are only taken from the command line, ignoring %s", config);
+    return true;
+}
+
+bool sink_add_rule(const char *rule) {
+    const char *colon = strchr(rule, ':');
+    const char *target = colon ? colon + 1 : NULL;
+    if (!colon || colon == rule || (size_t)(colon - rule) >= sizeof(rules[0].pattern)
+        || strlen(target) >= sizeof(rules[0].target)
+        || !((target[0] == '|' && target[1]) || (!strncmp(target, "unix:", 5) && target[5]))) {
+        return false;
+    }
+
+    size_t len = colon - rule;
+    int i;
+    for (i = 0; i < rule_count; i++) {
+        if (strlen(rules[i].pattern) == len && !strncmp(rules[i].pattern, rule, len)) break;
+    }
+    if (i == rule_count) {
+        if (rule_count == SINK_MAX_RULES) return false;
+        rule_count++;
+    }
+    memcpy(rules[i].pattern, rule, len);
+    rules[i].pattern[len] = '\0';
+    strcpy(rules[i].target, target);
+    LOG_INFO("Uploads of '%s' go to %s", rules[i].pattern, rules[i].target);
+    return true;
+}
+
+static const sink_rule_t *rule_for(const char *name) {
+    // First matching rule wins
+    for (int i = 0; i < rule_count; i++) {
+        if (fnmatch(rules[i].pattern, name, 0) == 0) return &rules[i];
+    }
+    return NULL;
+}
+
+bool sink_match(const char *name) {
+    return rule_for(name) != NULL;
+}
+
+static int connect_unix(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+// The command reads the upload from its standard input; its output goes
+// nowhere, the descriptors it could inherit from us aren't passed on
+static int spawn_command(const char *command, const char *name, const struct sockaddr_in *client, pid_t *pid) {
+    int pipefd[2];
+    if (pipe(pipefd) < 0) return -1;
+    fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+
+    size_t env_count = 0;
+    while (environ[env_count]) env_count++;
+    char **envp = malloc((env_count + 3) * sizeof(char *));
+    char filename_var[PATH_MAX + 16], client_var[32];
+    if (!envp) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf(filename_var, sizeof(filename_var), "TFTP_FILENAME=%s", name);
+    snprintf(client_var, sizeof(client_var), "TFTP_CLIENT=%s", inet_ntoa(client->sin_addr));
+    size_t n = 0;
+    for (size_t i = 0; i < env_count; i++) {
+        if (strncmp(environ[i], "TFTP_FILENAME=", 14) && strncmp(environ[i], "TFTP_CLIENT=", 12)) {
+            envp[n++] = environ[i];
+        }
+    }
+    envp[n++] = filename_var;
+    envp[n++] = client_var;
+    envp[n] = NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_CLOEXEC_DEFAULT
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_CLOEXEC_DEFAULT);
+    posix_spawn_file_actions_addinherit_np(&actions, STDERR_FILENO);
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+    posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+
+    char *argv[] = { "/bin/sh", "-c", (char *)command, NULL };
+    int status = posix_spawn(pid, "/bin/sh", &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+    close(pipefd[0]);
+    if (status != 0) {
+        close(pipefd[1]);
+        errno = status;
+        return -1;
+    }
+    return pipefd[1];
+}
+
+sink_t *sink_open(const char *name, const struct sockaddr_in *client) {
+    const sink_rule_t *rule = rule_for(name);
+    if (!rule) {
+        errno = ENOENT;
+        return NULL;
+    }
+    sink_t *sink = calloc(1, sizeof(sink_t));
+    if (!sink) return NULL;
+
+    if (rule->target[0] == '|') {
+        sink->fd = spawn_command(rule->target + 1, name, client, &sink->pid);
+    } else {
+        sink->fd = connect_unix(rule->target + 5);
+    }
+    if (sink->fd < 0) {
+        int err = errno;
+        LOG_ERROR("Can't start sink %s for '%s': %s", rule->target, name, strerror(err));
+        free(sink);
+        errno = err;
+        return NULL;
+    }
+    fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) | O_NONBLOCK);
+
+    if (sink->pid) {
+        for (int i = 0; i < SINK_MAX_CHILDREN; i++) {
+            if (children[i].pid) continue;
+            children[i].pid = sink->pid;
+            snprintf(children[i].name, sizeof(children[i].name), "%s", name);
+            break;
+        }
+    }
+    LOG_INFO("Streaming upload of '%s' to %s", name, rule->target);
+    return sink;
+}
+
+bool sink_write(sink_t *sink, const char *data, int len) {
+    int n = 0;
+    if (!sink->pending_len) {
+        n = write(sink->fd, data, len);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            n = 0;
+        }
+        if (n == len) return true;
+    }
+
+    // Keep the rest until the consumer is ready for it
+    int held = sink->pending_len - sink->pending_off;
+    char *pending = bufpool_alloc(held + len - n);
+    if (!pending) return false;
+    if (held) memcpy(pending, sink->pending + sink->pending_off, held);
+    memcpy(pending + held, data + n, len - n);
+    bufpool_free(sink->pending);
+    sink->pending = pending;
+    sink->pending_off = 0;
+    sink->pending_len = held + len - n;
+    return true;
+}
+
+bool sink_pending(sink_t *sink) {
+    return sink->pending_len > 0;
+}
+
+int sink_fd(sink_t *sink) {
+    return sink->fd;
+}
+
+bool sink_flush(sink_t *sink) {
+    while (sink->pending_off < sink->pending_len) {
+        ssize_t n = write(sink->fd, sink->pending + sink->pending_off, sink->pending_len - sink->pending_off);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        sink->pending_off += n;
+    }
+    bufpool_free(sink->pending);
+    sink->pending = NULL;
+    sink->pending_off = sink->pending_len = 0;
+    return true;
+}
+
+void sink_close(sink_t *sink, bool complete) {
+    if (!sink) return;
+    if (!complete) {
+        if (sink->pid) {
+            kill(sink->pid, SIGTERM);
+        } else {
+            struct linger reset = { 1, 0 };
+            setsockopt(sink->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        }
+    }
+    close(sink->fd);
+    bufpool_free(sink->pending);
+    free(sink);
+    sink_reap();
+}
+
+void sink_reap(void) {
+    for (int i = 0; i < SINK_MAX_CHILDREN; i++) {
+        int status;
+        if (!children[i].pid || waitpid(children[i].pid, &status, WNOHANG) != children[i].pid) continue;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            LOG_INFO("Sink for '%s' finished", children[i].name);
+        } else if (WIFEXITED(status)) {
+            LOG_ERROR("Sink for '%s' exited with status %d", children[i].name, WEXITSTATUS(status));
+        } else if (WIFSIGNALED(status)) {
+            LOG_INFO("Sink for '%s' terminated by signal %d", children[i].name, WTERMSIG(status));
+        }
+        children[i].pid = 0;
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include <stdbool.h>
+#include <netinet/in.h>
+
+// Uploads that match a sink rule never touch the TFTP root: their data is
+// handed to a consumer as it arrives, either on the standard input of a
+// command or over a Unix stream socket. The consumer sets the pace. A block
+// it hasn't taken yet is held back together with its ACK, so the client
+// waits and retransmits instead of us buffering the whole upload.
+
+#define SINK_MAX_RULES 16
+
+typedef struct sink sink_t;
+
+// Adds "PATTERN:|COMMAND" (run through /bin/sh with TFTP_FILENAME and
+// TFTP_CLIENT set) or "PATTERN:unix:PATH" from the command line. A rule for
+// the same pattern replaces the old one. Returns false if it is malformed
+// or there are too many.
+bool sink_add_rule(const char *rule);
+
+// Refuses "sink=" over IPC, where anyone who can reach the socket could
+// have us run their commands. Returns false if the option isn't ours.
+bool sink_configure(const char *config);
+
+bool sink_match(const char *name);
+
+// Start the consumer for name. Returns NULL with errno set when it can't.
+sink_t *sink_open(const char *name, const struct sockaddr_in *client);
+
+// Pass data on, keeping what the consumer won't take right now. Returns
+// false with errno set when the consumer is gone.
+bool sink_write(sink_t *sink, const char *data, int len);
+
+// Whether data is held back, the descriptor to wait on for POLLOUT until it
+// isn't, and another go at handing it over
+bool sink_pending(sink_t *sink);
+int sink_fd(sink_t *sink);
+bool sink_flush(sink_t *sink);
+
+// End of the data. An incomplete upload is cut off (the command is
+// terminated, the socket reset) so the consumer can tell.
+void sink_close(sink_t *sink, bool complete);
+
+// Collect consumers that exited and log how they did
+void sink_reap(void);
+
+#endif
@@ -0,0 +1,64 @@
+#include "transfer.h"
+
+transfer_t transfers[MAX_TRANSFERS];
+int max_transfers = MAX_TRANSFERS;
+
+transfer_t *transfer_find_peer(const struct sockaddr_in *addr) {
+    for (int i = 0; i < max_transfers; i++) {
+        transfer_t *t = &transfers[i];
+        if (t->active && t->client_addr.sin_addr.s_addr == addr->sin_addr.s_addr
+            && t->client_addr.sin_port == addr->sin_port) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+transfer_t *transfer_find_pending(uint16_t transfer_id) {
+    for (int i = 0; i < max_transfers; i++) {
+        transfer_t *t = &transfers[i];
+        if (t->active && t->transfer_id == transfer_id && t->waiting_approval) return t;
+    }
+    return NULL;
+}
+
+transfer_t *transfer_free_slot(void) {
+    for (int i = 0; i < max_transfers; i++) {
+        if (!transfers[i].active) return &transfers[i];
+    }
+    return NULL;
+}
+
+int transfer_active_count(void) {
+    int n = 0;
+    for (int i = 0; i < max_transfers; i++) {
+        if (transfers[i].active) n++;
+    }
+    return n;
+}
+
+int transfer_client_count(const struct in_addr *addr) {
+    int n = 0;
+    for (int i = 0; i < max_transfers; i++) {
+        if (transfers[i].active && transfers[i].client_addr.sin_addr.s_addr == addr->s_addr) n++;
+    }
+    return n;
+}
+
+int transfer_packet_size(const transfer_t *transfer) {
+    return 4 + (transfer->block_size > 512 ? transfer->block_size : 512);
+}
+
+void transfer_arm(transfer_t *transfer, uint64_t now) {
+    transfer->deadline = now + transfer->timeout * 1000;
+}
+
+int transfer_next_timeout(uint64_t now, int timeout) {
+    for (int i = 0; i < max_transfers; i++) {
+        transfer_t *t = &transfers[i];
+        if (!t->active || !t->packet_len || t->queued) continue;
+        int wait = t->deadline > now ? (int)(t->deadline - now) : 0;
+        if (wait < timeout) timeout = wait;
+    }
+    return timeout;
+}
@@ -0,0 +1,94 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "biportal.h"
+#include "hash.h"
+#include "pathcache.h"
+#include "relay.h"
+#include "sink.h"
+#include "pack.h"
+#include "zimage.h"
+
+#define TFTP_DEFAULT_TIMEOUT 3
+
+// The table of running transfers and the lookups the main loop does on it
+// for every packet and every pass.
+
+typedef struct {
+    int client_socket;          // our end of the transfer (its TID)
+    struct sockaddr_in local_addr;
+    struct sockaddr_in client_addr;
+    char *filename;             // pooled, the mode string follows it
+    const char *mode;
+    bool is_write;
+    int fd;
+    pathcache_entry_t *cached;
+    pack_t *pack;               // served from the pack instead of fd
+    const char *pack_data;
+    zimage_t *zimage;           // fd is compressed, this inflates it
+    relay_fetch_t *fetch;       // file still arriving from upstream, if relayed
+    sink_t *sink;               // consumer of an upload that bypasses the disk
+    bool stalled;               // next block hasn't arrived from upstream yet
+    struct stat st;             // served file as opened, keys the hash cache
+    off_t file_size;
+    off_t offset;               // start of the block in flight (RRQ) or bytes written (WRQ)
+    uint16_t block;             // last block sent (RRQ) or acknowledged (WRQ)
+    uint16_t transfer_id;
+    time_t last_activity;
+    bool waiting_approval;
+    int block_size;
+    int timeout;
+    bool opt_blksize;
+    bool opt_tsize;
+    bool opt_timeout;
+    bool oack_pending;          // OACK sent, waiting for ACK 0 or DATA 1
+    bool last_block_sent;
+    bool dallying;              // WRQ done, still acknowledging a repeated final DATA
+    char *packet;               // last packet sent, kept for retransmission (pooled, sized to the block)
+    int packet_len;
+    bool queued;                // DATA packet waiting for its turn to go (shaper.h)
+    int deficit;                // bytes it may send in this scheduling round
+    uint32_t round;             // the last round it was given its quantum in
+    int last_data_len;
+    int retries;
+    uint64_t deadline;
+    uint64_t bytes;
+    uint64_t started;
+    hash_ctx_t hash;            // running digest of the data in block order
+    bool hashing;
+    bool hashed;                // sha256/xxh64 below are final
+    char sha256[HASH_SHA256_HEX];
+    char xxh64[HASH_XXH64_HEX];
+    bool active;
+} transfer_t;
+
+extern transfer_t transfers[MAX_TRANSFERS];
+extern int max_transfers;
+
+// The active transfer serving this client address and port, if any
+transfer_t *transfer_find_peer(const struct sockaddr_in *addr);
+
+// The transfer with this ID that waits for PumpKIN's verdict, if any
+transfer_t *transfer_find_pending(uint16_t transfer_id);
+
+transfer_t *transfer_free_slot(void);
+int transfer_active_count(void);
+int transfer_client_count(const struct in_addr *addr);
+
+// Size of the transfer's packet buffer: a DATA packet of its block size, or
+// a full OACK when the block is tiny
+int transfer_packet_size(const transfer_t *transfer);
+
+// (Re)start the retransmission timer of the packet just sent, and how long
+// the main loop may sleep before some timer is due, at most timeout ms
+void transfer_arm(transfer_t *transfer, uint64_t now);
+int transfer_next_timeout(uint64_t now, int timeout);
+
+#endif
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "biportal.h"
+#include "hash.h"
+#include "hashcache.h"
+#include "pathcache.h"
+#include "warm.h"
+
+#define WARM_SAVE_MS 60000
+#define WARM_HEADER "# count\tsize\tmtime\tsha256\txxh64\tname\n"
+#define WARM_SUFFIX ".manifest"
+#define WARM_READ_CHUNK (1 << 20)
+
+typedef struct {
+    char *name;                 // normalised, NULL in a free slot
+    uint32_t hash;
+    uint32_t count;             // downloads, halved on every load so old favourites fade
+    off_t size;
+    time_t mtime;
+    char sha256[HASH_SHA256_HEX];   // empty when unknown
+    char xxh64[HASH_XXH64_HEX];
+} warm_entry_t;
+
+// A file handed to the preloader, and its mapping if it ended up locked
+typedef struct {
+    int fd;
+    off_t size;
+    void *map;
+} warm_job_t;
+
+static warm_entry_t entries[WARM_MAX_FILES];
+static char manifest[PATH_MAX];
+static bool dirty = false;
+static bool warmup_pending = false;
+static uint64_t last_save = 0;
+
+static int max_files = 64;
+static unsigned long long budget = 256ULL << 20;
+static bool lock_files = false;
+
+static warm_job_t jobs[WARM_MAX_FILES];
+static int job_count = 0;
+static pthread_t loader;
+static bool loader_running = false;
+static atomic_bool loader_stop;
+
+static uint32_t name_hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static warm_entry_t *find(const char *name) {
+    uint32_t hash = name_hash(name);
+    for (int i = 0; i < WARM_MAX_FILES; i++) {
+        if (entries[i].name && entries[i].hash == hash && !strcmp(entries[i].name, name)) return &entries[i];
+    }
+    return NULL;
+}
+
+// A free slot, or the least asked for one
+static warm_entry_t *claim(const char *name) {
+    warm_entry_t *slot = NULL;
+    for (int i = 0; i < WARM_MAX_FILES; i++) {
+        warm_entry_t *e = &entries[i];
+        if (!e->name) {
+            slot = e;
+            break;
+        }
+        if (!slot || e->count < slot->count) slot = e;
+    }
+    char *copy = strdup(name);
+    if (!copy) return NULL;
+    free(slot->name);
+    memset(slot, 0, sizeof(*slot));
+    slot->name = copy;
+    slot->hash = name_hash(name);
+    return slot;
+}
+
+static void clear(void) {
+    for (int i = 0; i < WARM_MAX_FILES; i++) {
+        free(entries[i].name);
+        memset(&entries[i], 0, sizeof(entries[i]));
+    }
+}
+
+void warm_record(const char *name, const struct stat *st, const char *sha256, const char *xxh64) {
+    if (!*manifest) return;
+
+    char norm[PATH_MAX];
+    if (pathcache_normalise(name, norm, sizeof(norm)) || strpbrk(norm, "\t\n")) return;
+
+    warm_entry_t *e = find(norm);
+    if (!e && !(e = claim(norm))) return;
+    if (e->size != st->st_size || e->mtime != st->st_mtime) {
+        e->sha256[0] = e->xxh64[0] = '\0';
+    }
+    e->count++;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    if (sha256 && xxh64) {
+        memcpy(e->sha256, sha256, HASH_SHA256_HEX);
+        memcpy(e->xxh64, xxh64, HASH_XXH64_HEX);
+    }
+    dirty = true;
+}
+
+// One line per file: count, size, mtime, sha256, xxh64 ("-" if unknown), name
+static void load(const char *path) {
+    clear();
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        if (errno != ENOENT) LOG_ERROR("Can't read manifest %s: %s", path, strerror(errno));
+        return;
+    }
+
+    char line[PATH_MAX + 160];
+    int loaded = 0;
+    while (loaded < WARM_MAX_FILES && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        line[strcspn(line, "\n")] = '\0';
+
+        char *fields[6], *p = line;
+        int n;
+        for (n = 0; n < 6 && p; n++) {
+            fields[n] = p;
+            p = n < 5 ? strchr(p, '\t') : NULL;
+            if (p) *p++ = '\0';
+        }
+        if (n < 6 || !*fields[5] || find(fields[5])) continue;
+
+        warm_entry_t *e = claim(fields[5]);
+        if (!e) break;
+        e->count = (strtoul(fields[0], NULL, 10) + 1) / 2;
+        e->size = strtoll(fields[1], NULL, 10);
+        e->mtime = strtoll(fields[2], NULL, 10);
+        if (strlen(fields[3]) == HASH_SHA256_HEX - 1 && strlen(fields[4]) == HASH_XXH64_HEX - 1) {
+            strcpy(e->sha256, fields[3]);
+            strcpy(e->xxh64, fields[4]);
+        }
+        loaded++;
+    }
+    fclose(f);
+    LOG_INFO("Loaded %d files from manifest %s", loaded, path);
+}
+
+// We write the manifest as root, and the path comes over IPC. Every
+// directory down to it has to belong to root (or to us, unprivileged) and
+// be writable by nobody else, so nobody can slip a link in on the way. The
+// name has to look like a manifest, and an existing file has to be one, so
+// it can't be made to replace anything else.
+static bool manifest_safe(const char *path) {
+    size_t len = strlen(path);
+    if (path[0] != '/' || len <= strlen(WARM_SUFFIX) || strcmp(path + len - strlen(WARM_SUFFIX), WARM_SUFFIX)) {
+        LOG_ERROR("Manifest %s must be an absolute path ending in %s", path, WARM_SUFFIX);
+        return false;
+    }
+
+    char dir[PATH_MAX], real[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    slash[slash == dir] = '\0';           // "/" stays itself
+    if (!realpath(dir, real)) {
+        LOG_ERROR("Can't use manifest %s: %s", path, strerror(errno));
+        return false;
+    }
+    for (;;) {
+        struct stat st;
+        if (lstat(real, &st) < 0 || !S_ISDIR(st.st_mode) || (st.st_uid != 0 && st.st_uid != geteuid())
+            || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+            LOG_ERROR("Won't keep manifest %s: %s isn't a directory only root can write to", path, real);
+            return false;
+        }
+        if (!strcmp(real, "/")) break;
+        slash = strrchr(real, '/');
+        slash[slash == real] = '\0';
+    }
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        if (errno == ENOENT) return true;
+        LOG_ERROR("Can't use manifest %s: %s", path, strerror(errno));
+        return false;
+    }
+    char head[sizeof(WARM_HEADER) - 1];
+    struct stat st;
+    bool ours = fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+        && (st.st_size == 0 || (read(fd, head, sizeof(head)) == sizeof(head) && !memcmp(head, WARM_HEADER, sizeof(head))));
+    close(fd);
+    if (!ours) LOG_ERROR("Won't replace %s, it isn't a manifest", path);
+    return ours;
+}
+
+// Written next to the manifest under a name nobody can guess, then renamed
+// over it
+static void save(void) {
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", manifest);
+    int fd = mkstemp(tmp);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!f) {
+        LOG_ERROR("Can't write manifest %s: %s", manifest, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return;
+    }
+    fchmod(fd, 0644);
+    fputs(WARM_HEADER, f);
+    for (int i = 0; i < WARM_MAX_FILES; i++) {
+        warm_entry_t *e = &entries[i];
+        if (!e->name) continue;
+        fprintf(f, "%u\t%lld\t%lld\t%s\t%s\t%s\n", e->count, (long long)e->size, (long long)e->mtime,
+                e->sha256[0] ? e->sha256 : "-", e->xxh64[0] ? e->xxh64 : "-", e->name);
+    }
+    if (fclose(f) != 0 || rename(tmp, manifest) < 0) {
+        LOG_ERROR("Can't write manifest %s: %s", manifest, strerror(errno));
+        unlink(tmp);
+        return;
+    }
+    dirty = false;
+}
+
+// Reads every file through, or maps and locks it, off the main loop
+static void *loader_main(void *arg) {
+    (void)arg;
+    uint64_t started = monotonic_ms();
+    unsigned long long bytes = 0;
+    char *buf = malloc(WARM_READ_CHUNK);
+    bool lock_failed = false;
+    int done;
+
+    for (done = 0; done < job_count && !atomic_load(&loader_stop); done++) {
+        warm_job_t *job = &jobs[done];
+        if (lock_files && !lock_failed && job->size > 0) {
+            void *map = mmap(NULL, job->size, PROT_READ, MAP_SHARED, job->fd, 0);
+            if (map != MAP_FAILED && mlock(map, job->size) == 0) {
+                job->map = map;
+                bytes += job->size;
+                continue;
+            }
+            // Most likely over RLIMIT_MEMLOCK; the rest only goes to the page cache
+            LOG_ERROR("Can't lock warm files in memory: %s", strerror(errno));
+            if (map != MAP_FAILED) munmap(map, job->size);
+            lock_failed = true;
+        }
+        for (off_t off = 0; buf && off < job->size; ) {
+            ssize_t n = pread(job->fd, buf, WARM_READ_CHUNK, off);
+            if (n <= 0) break;
+            off += n;
+            bytes += n;
+        }
+    }
+    free(buf);
+
+    LOG_INFO("Warmed %d files, %llu bytes%s, in %llu ms", done, bytes,
+             lock_files && !lock_failed ? " locked" : "", (unsigned long long)(monotonic_ms() - started));
+    return NULL;
+}
+
+static void stop_loader(void) {
+    if (loader_running) {
+        atomic_store(&loader_stop, true);
+        pthread_join(loader, NULL);
+        loader_running = false;
+    }
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].map) {
+            munlock(jobs[i].map, jobs[i].size);
+            munmap(jobs[i].map, jobs[i].size);
+        }
+        close(jobs[i].fd);
+    }
+    job_count = 0;
+}
+
+static int by_count(const void *a, const void *b) {
+    const warm_entry_t *ea = *(warm_entry_t *const *)a, *eb = *(warm_entry_t *const *)b;
+    return ea->count < eb->count ? 1 : ea->count > eb->count ? -1 : 0;
+}
+
+// Prime the path and digest caches with the favourites that fit the
+// budget, then leave their contents to the loader
+static void warm_up(void) {
+    stop_loader();
+
+    warm_entry_t *order[WARM_MAX_FILES];
+    int count = 0;
+    for (int i = 0; i < WARM_MAX_FILES; i++) {
+        if (entries[i].name && entries[i].count) order[count++] = &entries[i];
+    }
+    qsort(order, count, sizeof(order[0]), by_count);
+
+    unsigned long long total = 0;
+    for (int i = 0; i < count && job_count < max_files; i++) {
+        warm_entry_t *e = order[i];
+        if (total + e->size > budget) continue;
+
+        pathcache_entry_t *cached;
+        int fd;
+        struct stat st;
+        if (pathcache_open_read(e->name, &cached, &fd, &st) != 0) continue;
+        if (st.st_size == e->size && st.st_mtime == e->mtime && e->sha256[0]) {
+            hashcache_store(&st, e->sha256, e->xxh64);
+        } else if (st.st_size != e->size || st.st_mtime != e->mtime) {
+            e->size = st.st_size;
+            e->mtime = st.st_mtime;
+            e->sha256[0] = e->xxh64[0] = '\0';
+        }
+        int job_fd = dup(fd);
+        pathcache_release(cached, fd);
+        if (job_fd < 0 || total + st.st_size > budget) {
+            if (job_fd >= 0) close(job_fd);
+            continue;
+        }
+        jobs[job_count].fd = job_fd;
+        jobs[job_count].size = st.st_size;
+        jobs[job_count].map = NULL;
+        job_count++;
+        total += st.st_size;
+    }
+    if (!job_count) return;
+
+    atomic_store(&loader_stop, false);
+    loader_running = pthread_create(&loader, NULL, loader_main, NULL) == 0;
+    if (!loader_running) LOG_ERROR("Can't start the warm-up: %s", strerror(errno));
+}
+
+bool warm_configure(const char *config) {
+    if (strncmp(config, "manifest=", 9) == 0) {
+        if (*manifest && dirty) save();
+        stop_loader();
+        clear();
+        snprintf(manifest, sizeof(manifest), "%s", config + 9);
+        if (*manifest && !manifest_safe(manifest)) *manifest = '\0';
+        if (*manifest) {
+            load(manifest);
+            warmup_pending = true;
+        }
+        return true;
+    }
+    if (strncmp(config, "warm_files=", 11) == 0) {
+        int n = atoi(config + 11);
+        max_files = n < 0 ? 0 : n > WARM_MAX_FILES ? WARM_MAX_FILES : n;
+        return true;
+    }
+    if (strncmp(config, "warm_budget=", 12) == 0) {
+        budget = strtoull(config + 12, NULL, 10);
+        return true;
+    }
+    if (strncmp(config, "warm_lock=", 10) == 0) {
+        lock_files = strcmp(config + 10, "on") == 0;
+        return true;
+    }
+    return false;
+}
+
+void warm_tick(uint64_t now) {
+    if (warmup_pending) {
+        warmup_pending = false;
+        warm_up();
+    }
+    if (!last_save) last_save = now;
+    if (dirty && *manifest && now - last_save >= WARM_SAVE_MS) {
+        save();
+        last_save = now;
+    }
+}
+
+void warm_shutdown(void) {
+    if (*manifest && dirty) save();
+    stop_loader();
+}
@@ -0,0 +1,32 @@
+#ifndef WARM_H
+#define WARM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Warm start: the files downloaded most are remembered across restarts in
+// a manifest (how often, size, mtime, digests, name). Once it is loaded the
+// top ones, up to a memory budget, are opened and their digests primed on
+// the main loop, so the first requests find descriptor, size and digest
+// cached. A background thread then reads them into the page cache, or
+// locks them there, while requests are already being served.
+
+#define WARM_MAX_FILES 512
+
+// Handles "manifest=PATH" (loads it and schedules the warm-up, empty turns
+// it off; refused unless PATH ends in ".manifest" in a directory only root
+// can write to), "warm_files=N", "warm_budget=BYTES" and "warm_lock=on|off".
+// Returns false if the option isn't ours.
+bool warm_configure(const char *config);
+
+// Count a completed download of a file from the TFTP root. The digests
+// may be NULL when they aren't known.
+void warm_record(const char *name, const struct stat *st, const char *sha256, const char *xxh64);
+
+// Main loop plumbing: runs a scheduled warm-up and saves the manifest now
+// and then. The shutdown saves it a last time and lets go of locked files.
+void warm_tick(uint64_t now);
+void warm_shutdown(void);
+
+#endif
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "biportal.h"
+#include "zimage.h"
+
+#define ZIMAGE_SUFFIX ".gz"
+#define ZIMAGE_INPUT 16384
+#define ZIMAGE_INDEXES 16
+#define ZIMAGE_SPAN (4 << 20)
+#define ZIMAGE_FILE_POINTS 512      // a huge image spaces its checkpoints further apart
+#define ZIMAGE_POINTS 2048          // all indexes together, 64 MB of windows
+
+// Where inflating can start over: a deflate block boundary, down to the bit,
+// and the output just before it that the block may refer back to
+typedef struct {
+    off_t out;
+    off_t in;                   // first whole byte of the block
+    int bits;                   // bits of the byte before that belong to it
+    int have;                   // bytes in window, fewer near the start
+    unsigned char *window;      // oldest first
+} checkpoint_t;
+
+// What we know about one compressed file, shared by its transfers and kept
+// until the slot is needed for another. Keyed like the hash cache, so a
+// changed file simply gets a new one.
+typedef struct {
+    int refs;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    off_t length;               // -1 until read through once
+    off_t span;                 // doubles whenever the file runs out of points
+    checkpoint_t *points;       // by out
+    int count;
+    int capacity;
+    uint64_t used;
+} zindex_t;
+
+struct zimage {
+    int fd;
+    zindex_t *index;            // NULL when every slot is taken
+    off_t length;
+    z_stream strm;
+    bool raw;                   // resumed at a checkpoint, the gzip framing is ours to skip
+    int skip;                   // trailer bytes left to skip after a raw member
+    bool eof;
+    off_t in;                   // next byte to read from the file
+    off_t out;                  // offset of the next byte inflate produces
+    int wpos;                   // the last ZIMAGE_WINDOW bytes produced, circular
+    int whave;
+    unsigned char window[ZIMAGE_WINDOW];
+    unsigned char input[ZIMAGE_INPUT];
+};
+
+static bool enabled = true;
+static off_t span = ZIMAGE_SPAN;
+static zindex_t indexes[ZIMAGE_INDEXES];
+static int points_total = 0;
+static uint64_t uses = 0;
+
+bool zimage_configure(const char *config) {
+    if (strncmp(config, "compressed=", 11) == 0) {
+        enabled = strcmp(config + 11, "off") != 0;
+        return true;
+    }
+    if (strncmp(config, "checkpoint_span=", 16) == 0) {
+        long long n = atoll(config + 16);
+        span = n > 0 ? n : 0;
+        return true;
+    }
+    return false;
+}
+
+bool zimage_name(const char *name, char *out, size_t out_size) {
+    if (!enabled) return false;
+    return (size_t)snprintf(out, out_size, "%s" ZIMAGE_SUFFIX, name) < out_size;
+}
+
+static void drop_points(zindex_t *x) {
+    for (int i = 0; i < x->count; i++) free(x->points[i].window);
+    free(x->points);
+    points_total -= x->count;
+    x->points = NULL;
+    x->count = x->capacity = 0;
+}
+
+static zindex_t *index_for(const struct stat *st) {
+    zindex_t *slot = NULL;
+    for (int i = 0; i < ZIMAGE_INDEXES; i++) {
+        zindex_t *x = &indexes[i];
+        if (x->used && x->dev == st->st_dev && x->ino == st->st_ino
+            && x->size == st->st_size && x->mtime == st->st_mtime) {
+            slot = x;
+            break;
+        }
+        if (!x->refs && (!slot || x->used < slot->used)) slot = x;
+    }
+    if (!slot) return NULL;
+    if (!slot->used || slot->dev != st->st_dev || slot->ino != st->st_ino
+        || slot->size != st->st_size || slot->mtime != st->st_mtime) {
+        drop_points(slot);
+        slot->dev = st->st_dev;
+        slot->ino = st->st_ino;
+        slot->size = st->st_size;
+        slot->mtime = st->st_mtime;
+        slot->length = -1;
+        slot->span = span;
+    }
+    slot->refs++;
+    slot->used = ++uses;
+    return slot;
+}
+
+// The last checkpoint at or before offset, NULL for the start of the file
+static const checkpoint_t *nearest(const zindex_t *x, off_t offset) {
+    if (!x) return NULL;
+    int lo = 0, hi = x->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (x->points[mid].out <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo ? &x->points[lo - 1] : NULL;
+}
+
+// Room for one more checkpoint, at the expense of the indexes nobody
+// reads at the moment
+static bool make_room(void) {
+    while (points_total >= ZIMAGE_POINTS) {
+        zindex_t *idle = NULL;
+        for (int i = 0; i < ZIMAGE_INDEXES; i++) {
+            zindex_t *x = &indexes[i];
+            if (!x->refs && x->count && (!idle || x->used < idle->used)) idle = x;
+        }
+        if (!idle) return false;
+        drop_points(idle);
+    }
+    return true;
+}
+
+// A new checkpoint at position at, with room for have bytes of window
+static checkpoint_t *insert(zindex_t *x, int at, int have) {
+    if (!make_room()) return NULL;
+    if (x->count == x->capacity) {
+        int capacity = x->capacity ? x->capacity * 2 : 16;
+        checkpoint_t *points = realloc(x->points, capacity * sizeof(checkpoint_t));
+        if (!points) return NULL;
+        x->points = points;
+        x->capacity = capacity;
+    }
+    unsigned char *window = malloc(have ? have : 1);
+    if (!window) return NULL;
+    memmove(&x->points[at + 1], &x->points[at], (x->count - at) * sizeof(checkpoint_t));
+    x->count++;
+    points_total++;
+    checkpoint_t *p = &x->points[at];
+    p->have = have;
+    p->window = window;
+    return p;
+}
+
+// Keep every other checkpoint, twice as far apart, so a file of any size
+// ends up with at most ZIMAGE_FILE_POINTS of them
+static void thin(zindex_t *x) {
+    int kept = 0;
+    for (int i = 0; i < x->count; i++) {
+        if (i % 2) {
+            x->points[kept++] = x->points[i];
+        } else {
+            free(x->points[i].window);
+            points_total--;
+        }
+    }
+    x->count = kept;
+    x->span *= 2;
+}
+
+// Called at block boundaries: remember this one if we got far enough past
+// the last checkpoint
+static void checkpoint(zimage_t *image) {
+    zindex_t *x = image->index;
+    if (!x || !x->span) return;
+    if (x->count >= ZIMAGE_FILE_POINTS) thin(x);
+    off_t last = x->count ? x->points[x->count - 1].out : 0;
+    if (image->out < last + x->span) return;
+
+    checkpoint_t *p = insert(x, x->count, image->whave);
+    if (!p) return;
+    p->out = image->out;
+    p->in = image->in - image->strm.avail_in;
+    p->bits = image->strm.data_type & 7;
+    if (image->whave < ZIMAGE_WINDOW) {
+        memcpy(p->window, image->window, image->whave);
+    } else {
+        memcpy(p->window, image->window + image->wpos, ZIMAGE_WINDOW - image->wpos);
+        memcpy(p->window + ZIMAGE_WINDOW - image->wpos, image->window, image->wpos);
+    }
+}
+
+// Start inflating over at the checkpoint, or at the beginning of the file
+static bool restart(zimage_t *image, const checkpoint_t *p) {
+    image->strm.avail_in = 0;
+    image->skip = 0;
+    image->eof = false;
+    if (!p) {
+        image->raw = false;
+        image->in = image->out = 0;
+        image->wpos = image->whave = 0;
+        return inflateReset2(&image->strm, 15 + 16) == Z_OK;
+    }
+
+    image->raw = true;
+    image->in = p->in;
+    image->out = p->out;
+    memcpy(image->window, p->window, p->have);
+    image->whave = p->have;
+    image->wpos = p->have % ZIMAGE_WINDOW;
+    if (inflateReset2(&image->strm, -15) != Z_OK) return false;
+    if (p->bits) {
+        unsigned char c;
+        if (pread(image->fd, &c, 1, p->in - 1) != 1) return false;
+        if (inflatePrime(&image->strm, p->bits, c >> (8 - p->bits)) != Z_OK) return false;
+    }
+    return inflateSetDictionary(&image->strm, p->window, p->have) == Z_OK;
+}
+
+static ssize_t fill(zimage_t *image) {
+    ssize_t n = pread(image->fd, image->input, ZIMAGE_INPUT, image->in);
+    if (n > 0) {
+        image->in += n;
+        image->strm.next_in = image->input;
+        image->strm.avail_in = n;
+    }
+    return n;
+}
+
+// After a member's trailer, whether another member follows. Anything else
+// after the last one is ignored, as gzip does.
+static bool next_member(zimage_t *image) {
+    if (!image->strm.avail_in && fill(image) <= 0) return false;
+    if (image->strm.next_in[0] != 0x1f) return false;
+    image->raw = false;
+    return inflateReset2(&image->strm, 15 + 16) == Z_OK;
+}
+
+// Inflate len bytes into buf, or past them if buf is NULL. Returns fewer
+// at the end of the data, -1 with errno set if the file is damaged.
+static ssize_t inflate_to(zimage_t *image, char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len && !image->eof) {
+        if (!image->strm.avail_in) {
+            ssize_t n = fill(image);
+            if (n <= 0) {
+                if (!n) errno = EIO;    // cut short
+                return -1;
+            }
+        }
+        if (image->skip) {
+            // Raw inflate stops at the end of the deflate data, the CRC and
+            // size that follow are left to us
+            int n = image->skip < (int)image->strm.avail_in ? image->skip : (int)image->strm.avail_in;
+            image->strm.next_in += n;
+            image->strm.avail_in -= n;
+            image->skip -= n;
+            if (!image->skip && !next_member(image)) image->eof = true;
+            continue;
+        }
+
+        size_t want = len - done;
+        if (want > (size_t)(ZIMAGE_WINDOW - image->wpos)) want = ZIMAGE_WINDOW - image->wpos;
+        unsigned char *start = image->window + image->wpos;
+        image->strm.next_out = start;
+        image->strm.avail_out = want;
+        int ret = inflate(&image->strm, Z_BLOCK);
+        size_t got = want - image->strm.avail_out;
+        if (buf) memcpy(buf + done, start, got);
+        done += got;
+        image->out += got;
+        image->wpos = (image->wpos + got) % ZIMAGE_WINDOW;
+        image->whave = image->whave + got > ZIMAGE_WINDOW ? ZIMAGE_WINDOW : image->whave + (int)got;
+
+        if (ret == Z_STREAM_END) {
+            if (image->raw) {
+                image->skip = 8;
+            } else if (!next_member(image)) {
+                image->eof = true;
+            }
+            continue;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            errno = ret == Z_MEM_ERROR ? ENOMEM : EIO;
+            return -1;
+        }
+        if ((image->strm.data_type & 128) && !(image->strm.data_type & 64)) checkpoint(image);
+    }
+    if (image->eof) {
+        image->length = image->out;
+        if (image->index) image->index->length = image->out;
+    }
+    return done;
+}
+
+zimage_t *zimage_open(int fd, const struct stat *st) {
+    unsigned char magic[2];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) || magic[0] != 0x1f || magic[1] != 0x8b) {
+        errno = EIO;
+        return NULL;
+    }
+    zimage_t *image = calloc(1, sizeof(zimage_t));
+    if (!image) return NULL;
+    if (inflateInit2(&image->strm, 15 + 16) != Z_OK) {
+        free(image);
+        errno = ENOMEM;
+        return NULL;
+    }
+    image->fd = fd;
+    image->index = index_for(st);
+    // The trailer only has the size modulo 4 GB, and only the last member's,
+    // so the size is only known once a transfer got to the end. Inflating
+    // everything up front would hold up the main loop for seconds.
+    image->length = image->index ? image->index->length : -1;
+    return image;
+}
+
+void zimage_close(zimage_t *image) {
+    if (!image) return;
+    inflateEnd(&image->strm);
+    if (image->index) image->index->refs--;
+    free(image);
+}
+
+off_t zimage_size(const zimage_t *image) {
+    return image->index ? image->index->length : image->length;
+}
+
+ssize_t zimage_read(zimage_t *image, char *buf, size_t len, off_t offset) {
+    // Go back, or skip ahead, to the checkpoint if that beats inflating
+    // everything in between
+    const checkpoint_t *p = nearest(image->index, offset);
+    if (offset < image->out || (p && image->out < p->out)) {
+        LOG_DEBUG("Inflating from %lld for %lld", (long long)(p ? p->out : 0), (long long)offset);
+        if (!restart(image, p)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    while (image->out < offset) {
+        off_t gap = offset - image->out;
+        ssize_t n = inflate_to(image, NULL, gap < ZIMAGE_WINDOW ? (size_t)gap : ZIMAGE_WINDOW);
+        if (n < 0) return -1;
+        if (image->eof) return 0;
+    }
+    return inflate_to(image, buf, len);
+}
+
+bool zimage_point(const zimage_t *image, off_t offset, zimage_point_t *point) {
+    const checkpoint_t *p = nearest(image->index, offset);
+    if (!p) return false;
+    point->out = p->out;
+    point->in = p->in;
+    point->bits = p->bits;
+    point->have = p->have;
+    memcpy(point->window, p->window, p->have);
+    return true;
+}
+
+void zimage_adopt(zimage_t *image, const zimage_point_t *point) {
+    zindex_t *x = image->index;
+    if (!x || point->out <= 0 || point->in <= 0 || point->bits < 0 || point->bits > 7
+        || point->have < 0 || point->have > ZIMAGE_WINDOW) return;
+    const checkpoint_t *before = nearest(x, point->out);
+    if (before && before->out == point->out) return;
+
+    checkpoint_t *p = insert(x, before ? before - x->points + 1 : 0, point->have);
+    if (!p) return;
+    p->out = point->out;
+    p->in = point->in;
+    p->bits = point->bits;
+    memcpy(p->window, point->window, point->have);
+}
@@ -0,0 +1,56 @@
+#ifndef ZIMAGE_H
+#define ZIMAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Compressed images: a request for "file.bin" that isn't in the root as
+// such is served from "file.bin.gz", inflated block by block as the DATA
+// packets go out. The size for tsize is only known once a transfer of the
+// file got to the end; until then none is announced. Every compressed
+// file gets an index of checkpoints a few MB apart, built while it is read,
+// from which inflating can pick up again anywhere without starting over at
+// the beginning; it is shared by all transfers of the file and kept for a
+// while after the last one.
+
+#define ZIMAGE_WINDOW 32768         // deflate's history, what a checkpoint has to keep
+
+typedef struct zimage zimage_t;
+
+// A checkpoint as it goes to a successor with a transfer (handoff.h)
+typedef struct {
+    int64_t out;
+    int64_t in;
+    int32_t bits;
+    int32_t have;
+    unsigned char window[ZIMAGE_WINDOW];
+} zimage_point_t;
+
+// Handles "compressed=on|off" and "checkpoint_span=BYTES" (0 stops
+// indexing). Returns false if the option isn't ours.
+bool zimage_configure(const char *config);
+
+// The name to look for when name itself isn't there; false if compressed
+// images are off or it doesn't fit
+bool zimage_name(const char *name, char *out, size_t out_size);
+
+// Start reading the compressed file open on fd, which stays the caller's.
+// Returns NULL with errno set if it isn't gzip or there is no memory.
+zimage_t *zimage_open(int fd, const struct stat *st);
+void zimage_close(zimage_t *image);
+
+// Uncompressed size, -1 if it isn't known
+off_t zimage_size(const zimage_t *image);
+
+// Like pread() on the uncompressed data. Reading on from where the last
+// read ended is cheapest, anywhere else starts from the nearest checkpoint.
+ssize_t zimage_read(zimage_t *image, char *buf, size_t len, off_t offset);
+
+// The checkpoint a read at offset would start from, false if that is the
+// beginning of the file; and adding one from elsewhere to the file's index
+bool zimage_point(const zimage_t *image, off_t offset, zimage_point_t *point);
+void zimage_adopt(zimage_t *image, const zimage_point_t *point);
+
+#endif
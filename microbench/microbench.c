@@ -0,0 +1,495 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "biportal.h"
+#include "bufpool.h"
+#include "hash.h"
+#include "pack.h"
+#include "packet.h"
+#include "pathcache.h"
+#include "ratelimit.h"
+#include "shaper.h"
+#include "transfer.h"
+#include "zimage.h"
+
+// Per-operation cost of biportal's hot paths, built from its own sources.
+//
+//   microbench [-t MS] [-k REPEATS] [-f FILTER] [-w BASELINE]
+//              [-c BASELINE] [-r PERCENT]
+//
+// Every benchmark is calibrated to run for about -t milliseconds and
+// repeated -k times; the fastest repetition is reported, as it is the one
+// least disturbed by the rest of the machine. Results go to stdout as
+// tab-separated "name ns/op" lines, which is also the baseline format, so
+// -w just keeps them. With -c every result is set against the baseline and
+// the run fails if any is more than -r percent slower. Baselines only mean
+// something on the machine and build they were taken with.
+
+// What main.c provides to the modules linked in here
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void send_error(int sock, struct sockaddr_in *addr, int error_code, char *error_msg) {
+    (void)sock; (void)addr; (void)error_code; (void)error_msg;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Results are folded in here so the compiler can't drop the work
+static volatile uint64_t sink;
+
+#define REQUEST "\0\1images/pxelinux.0\0octet\0blksize\0" "1468\0tsize\0" "0\0timeout\0" "3\0"
+
+static char packet[TFTP_PACKET_MAX];
+static char request[sizeof(REQUEST)];
+
+static void bench_parse_request(uint64_t n) {
+    tftp_request_t req;
+    for (uint64_t i = 0; i < n; i++) {
+        packet_parse_request(request, sizeof(request) - 1, &req);
+        sink += req.options_len;
+    }
+}
+
+static void bench_parse_options(uint64_t n) {
+    tftp_request_t req;
+    tftp_options_t opts;
+    packet_parse_request(request, sizeof(request) - 1, &req);
+    for (uint64_t i = 0; i < n; i++) {
+        packet_parse_options(req.options, req.options_len, &opts);
+        sink += opts.blksize;
+    }
+}
+
+static void bench_encode_ack(uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) sink += packet_ack(packet, i);
+}
+
+static void bench_encode_data(uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) sink += packet_data(packet, i, 1468);
+}
+
+static void bench_encode_error(uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        sink += packet_error(packet, 4 + 512, TFTP_ERR_NOT_FOUND, "No such file or directory");
+    }
+}
+
+static void bench_encode_oack(uint64_t n) {
+    tftp_options_t opts = { 1468, 3, true, 0 };
+    for (uint64_t i = 0; i < n; i++) {
+        opts.tsize_value = i;
+        sink += packet_oack(packet, 4 + 512, &opts);
+    }
+}
+
+// A full table, every slot a different client with a packet in flight; the
+// lookups are for the last slot, the worst case of the linear scans
+static void fill_table(void) {
+    uint64_t now = monotonic_ms();
+    for (int i = 0; i < max_transfers; i++) {
+        transfer_t *t = &transfers[i];
+        memset(t, 0, sizeof(*t));
+        t->active = true;
+        t->client_addr.sin_family = AF_INET;
+        t->client_addr.sin_addr.s_addr = htonl(0x0a000001 + i);
+        t->client_addr.sin_port = htons(1024 + i);
+        t->transfer_id = i;
+        t->waiting_approval = i == max_transfers - 1;
+        t->timeout = TFTP_DEFAULT_TIMEOUT;
+        t->packet_len = 4;
+        transfer_arm(t, now);
+    }
+}
+
+static void bench_table_find_peer(uint64_t n) {
+    struct sockaddr_in addr = transfers[max_transfers - 1].client_addr;
+    for (uint64_t i = 0; i < n; i++) sink += (uintptr_t)transfer_find_peer(&addr);
+}
+
+static void bench_table_find_pending(uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) sink += (uintptr_t)transfer_find_pending(max_transfers - 1);
+}
+
+static void bench_table_client_count(uint64_t n) {
+    struct in_addr addr = transfers[max_transfers - 1].client_addr.sin_addr;
+    for (uint64_t i = 0; i < n; i++) sink += transfer_client_count(&addr);
+}
+
+static void bench_timer_arm(uint64_t n) {
+    transfer_t *t = &transfers[0];
+    for (uint64_t i = 0; i < n; i++) {
+        transfer_arm(t, i);
+        sink += t->deadline;
+    }
+}
+
+static void bench_timer_next(uint64_t n) {
+    uint64_t now = monotonic_ms();
+    for (uint64_t i = 0; i < n; i++) sink += transfer_next_timeout(now, 1000);
+}
+
+static void bench_bufpool(uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        void *buf = bufpool_alloc(4 + 1468);
+        sink += (uintptr_t)buf;
+        bufpool_free(buf);
+    }
+}
+
+// File blocks as biportal reads them, from a file in the page cache
+#define FILE_SIZE (4 << 20)
+
+static char root[] = "/tmp/microbench.XXXXXX";
+static int file_fd = -1;
+static int gz_fd = -1;
+static zimage_t *gz_image;
+
+static bool make_file(void) {
+    if (!mkdtemp(root)) return false;
+    char path[sizeof(root) + 16];
+    snprintf(path, sizeof(path), "%s/image.bin", root);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    char block[65536];
+    for (size_t i = 0; i < sizeof(block); i++) block[i] = i * 31;
+    for (int i = 0; i < FILE_SIZE / (int)sizeof(block); i++) {
+        if (write(fd, block, sizeof(block)) != sizeof(block)) {
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+
+    // And compressed, to be served inflated
+    snprintf(path, sizeof(path), "%s/image.bin.gz", root);
+    gzFile gz = gzopen(path, "wb6");
+    if (!gz) return false;
+    for (int i = 0; i < FILE_SIZE / (int)sizeof(block); i++) {
+        if (gzwrite(gz, block, sizeof(block)) != sizeof(block)) {
+            gzclose(gz);
+            return false;
+        }
+    }
+    if (gzclose(gz) != Z_OK) return false;
+    if (pathcache_set_root(root) != 0) return false;
+
+    // The same tree as a pack
+    char config[sizeof(path) + 5];      // "pack=" and the path
+    snprintf(path, sizeof(path), "%s.pack", root);
+    snprintf(config, sizeof(config), "pack=%s", path);
+    return pack_build(root, path) == 0 && pack_configure(config);
+}
+
+static void remove_file(void) {
+    char path[sizeof(root) + 16];
+    snprintf(path, sizeof(path), "%s/image.bin", root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/image.bin.gz", root);
+    unlink(path);
+    rmdir(root);
+    pack_configure("pack=");
+    snprintf(path, sizeof(path), "%s.pack", root);
+    unlink(path);
+}
+
+static void bench_open_cached(uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        pathcache_entry_t *entry;
+        int fd;
+        struct stat st;
+        if (pathcache_open_read("image.bin", &entry, &fd, &st) == 0) {
+            sink += st.st_size;
+            pathcache_release(entry, fd);
+        }
+    }
+}
+
+static void bench_pack_lookup(uint64_t n) {
+    pack_file_t file;
+    for (uint64_t i = 0; i < n; i++) {
+        pack_t *pack = pack_lookup("image.bin", &file);
+        sink += file.size;
+        pack_release(pack);
+    }
+}
+
+static void read_blocks(uint64_t n, int block_size) {
+    off_t offset = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        sink += pread(file_fd, packet + 4, block_size, offset);
+        offset += block_size;
+        if (offset + block_size > FILE_SIZE) offset = 0;
+    }
+}
+
+static void bench_read_512(uint64_t n) { read_blocks(n, 512); }
+static void bench_read_1468(uint64_t n) { read_blocks(n, 1468); }
+static void bench_read_8192(uint64_t n) { read_blocks(n, 8192); }
+static void bench_read_65464(uint64_t n) { read_blocks(n, 65464); }
+
+static void bench_inflate_1468(uint64_t n) {
+    off_t offset = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        sink += zimage_read(gz_image, packet + 4, 1468, offset);
+        offset += 1468;
+        if (offset + 1468 > FILE_SIZE) offset = 0;
+    }
+}
+
+static void bench_hash_1468(uint64_t n) {
+    hash_ctx_t ctx;
+    hash_init(&ctx);
+    for (uint64_t i = 0; i < n; i++) hash_update(&ctx, packet + 4, 1468);
+    sink += ctx.sha256.length;
+}
+
+// The check every request goes through, spread over a few hundred sources
+// whose buckets never run dry
+static void bench_ratelimit(uint64_t n) {
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    ratelimit_configure("rate_limit=1000000");
+    for (uint64_t i = 0; i < n; i++) {
+        addr.sin_addr.s_addr = htonl(0x0a000000 + (i & 511));
+        sink += ratelimit_admit(-1, &addr, request, sizeof(request) - 1, i);
+    }
+}
+
+static void transmit_nothing(transfer_t *transfer) {
+    sink += transfer->packet_len;
+}
+
+// Block after block from transfers of mixed block sizes in a few subnets,
+// with caps high enough that none has to wait
+static void bench_shaper(uint64_t n) {
+    static transfer_t queued[16];
+    static const int sizes[] = { 516, 1472, 8196, 1432 };
+    for (int i = 0; i < 16; i++) {
+        memset(&queued[i], 0, sizeof(queued[i]));
+        queued[i].client_addr.sin_family = AF_INET;
+        queued[i].client_addr.sin_addr.s_addr = htonl(0x0a000001 + (i << 8));
+        queued[i].packet_len = sizes[i & 3];
+    }
+    shaper_configure("bandwidth=1000000000000");
+    shaper_configure("subnet_bandwidth=1000000000000");
+    for (uint64_t i = 0; i < n; i++) {
+        shaper_enqueue(&queued[i & 15]);
+        shaper_run(i, transmit_nothing);
+    }
+    shaper_configure("bandwidth=0");
+    shaper_configure("subnet_bandwidth=0");
+}
+
+typedef struct {
+    const char *name;
+    void (*run)(uint64_t n);
+    bool needs_file;
+} bench_t;
+
+static const bench_t benches[] = {
+    { "packet.parse_request", bench_parse_request, false },
+    { "packet.parse_options", bench_parse_options, false },
+    { "packet.encode_ack", bench_encode_ack, false },
+    { "packet.encode_data", bench_encode_data, false },
+    { "packet.encode_error", bench_encode_error, false },
+    { "packet.encode_oack", bench_encode_oack, false },
+    { "table.find_peer", bench_table_find_peer, false },
+    { "table.find_pending", bench_table_find_pending, false },
+    { "table.client_count", bench_table_client_count, false },
+    { "timer.arm", bench_timer_arm, false },
+    { "timer.next_timeout", bench_timer_next, false },
+    { "bufpool.alloc_free", bench_bufpool, false },
+    { "ratelimit.admit", bench_ratelimit, false },
+    { "shaper.run", bench_shaper, false },
+    { "file.open_cached", bench_open_cached, true },
+    { "file.pack_lookup", bench_pack_lookup, true },
+    { "file.read_512", bench_read_512, true },
+    { "file.read_1468", bench_read_1468, true },
+    { "file.read_8192", bench_read_8192, true },
+    { "file.read_65464", bench_read_65464, true },
+    { "file.inflate_1468", bench_inflate_1468, true },
+    { "hash.update_1468", bench_hash_1468, false },
+};
+
+#define BENCH_COUNT (int)(sizeof(benches) / sizeof(benches[0]))
+
+// Grow the iteration count until a run takes a tenth of the budget, scale
+// it to the whole budget, then keep the fastest of the repetitions
+static double measure(const bench_t *bench, uint64_t budget_ns, int repeats) {
+    uint64_t n = 1, elapsed;
+    for (;;) {
+        uint64_t start = now_ns();
+        bench->run(n);
+        elapsed = now_ns() - start;
+        if (elapsed >= budget_ns / 10 || n >= (1ULL << 40)) break;
+        n *= elapsed < budget_ns / 1000 ? 10 : 2;
+    }
+    if (elapsed) n = n * budget_ns / elapsed;
+    if (!n) n = 1;
+
+    double best = -1;
+    for (int r = 0; r < repeats; r++) {
+        uint64_t start = now_ns();
+        bench->run(n);
+        double ns = (double)(now_ns() - start) / n;
+        if (best < 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+typedef struct {
+    char name[64];
+    double ns;
+} baseline_t;
+
+static int load_baseline(const char *path, baseline_t *entries, int max) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    int count = 0;
+    while (count < max && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %lf", entries[count].name, &entries[count].ns) == 2) count++;
+    }
+    fclose(f);
+    return count;
+}
+
+static const baseline_t *find_baseline(const baseline_t *entries, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(entries[i].name, name)) return &entries[i];
+    }
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: microbench [-t MS] [-k REPEATS] [-f FILTER] [-w BASELINE]\n"
+            "                  [-c BASELINE] [-r PERCENT]\n"
+            "\n"
+            "  -t MS        time per repetition of each benchmark (default 100)\n"
+            "  -k REPEATS   repetitions, the fastest counts (default 5)\n"
+            "  -f FILTER    only run benchmarks whose name contains FILTER\n"
+            "  -w BASELINE  write the results as a new baseline\n"
+            "  -c BASELINE  compare with a baseline, fail on regressions\n"
+            "  -r PERCENT   slowdown that counts as a regression (default 25)\n");
+}
+
+int main(int argc, char **argv) {
+    uint64_t budget_ms = 100;
+    int repeats = 5;
+    const char *filter = NULL, *write_path = NULL, *compare_path = NULL;
+    double threshold = 25;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:k:f:w:c:r:")) != -1) {
+        switch (c) {
+            case 't': budget_ms = strtoull(optarg, NULL, 10); break;
+            case 'k': repeats = atoi(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'w': write_path = optarg; break;
+            case 'c': compare_path = optarg; break;
+            case 'r': threshold = atof(optarg); break;
+            default:
+                usage();
+                return 2;
+        }
+    }
+    if (optind != argc || !budget_ms || repeats < 1 || threshold < 0) {
+        usage();
+        return 2;
+    }
+
+    baseline_t baseline[BENCH_COUNT * 2];
+    int baseline_count = 0;
+    if (compare_path) {
+        baseline_count = load_baseline(compare_path, baseline, BENCH_COUNT * 2);
+        if (baseline_count < 0) {
+            fprintf(stderr, "Can't read baseline '%s': %s\n", compare_path, strerror(errno));
+            return 2;
+        }
+    }
+
+    FILE *out = NULL;
+    if (write_path) {
+        out = fopen(write_path, "w");
+        if (!out) {
+            fprintf(stderr, "Can't write baseline '%s': %s\n", write_path, strerror(errno));
+            return 2;
+        }
+        fprintf(out, "# name\tns/op\n");
+    }
+
+    memcpy(request, REQUEST, sizeof(request));
+    fill_table();
+    if (!make_file()) {
+        fprintf(stderr, "Can't set up the test file: %s\n", strerror(errno));
+        return 2;
+    }
+    char path[sizeof(root) + 16];
+    snprintf(path, sizeof(path), "%s/image.bin", root);
+    file_fd = open(path, O_RDONLY);
+    snprintf(path, sizeof(path), "%s/image.bin.gz", root);
+    gz_fd = open(path, O_RDONLY);
+    struct stat st;
+    if (gz_fd >= 0 && fstat(gz_fd, &st) == 0) gz_image = zimage_open(gz_fd, &st);
+    if (!gz_image) {
+        fprintf(stderr, "Can't set up the compressed test file: %s\n", strerror(errno));
+        return 2;
+    }
+
+    printf(compare_path ? "# name\tns/op\tbaseline\tchange%%\n" : "# name\tns/op\n");
+    int regressions = 0;
+    for (int i = 0; i < BENCH_COUNT; i++) {
+        const bench_t *bench = &benches[i];
+        if (filter && !strstr(bench->name, filter)) continue;
+        if (bench->needs_file && file_fd < 0) continue;
+
+        double ns = measure(bench, budget_ms * 1000000, repeats);
+        if (out) fprintf(out, "%s\t%.2f\n", bench->name, ns);
+        if (!compare_path) {
+            printf("%s\t%.2f\n", bench->name, ns);
+            fflush(stdout);
+            continue;
+        }
+
+        const baseline_t *base = find_baseline(baseline, baseline_count, bench->name);
+        if (!base || base->ns <= 0) {
+            printf("%s\t%.2f\t-\t-\n", bench->name, ns);
+        } else {
+            double change = (ns / base->ns - 1) * 100;
+            bool regressed = change > threshold;
+            printf("%s\t%.2f\t%.2f\t%+.1f%s\n", bench->name, ns, base->ns, change,
+                   regressed ? "\tREGRESSION" : "");
+            if (regressed) regressions++;
+        }
+        fflush(stdout);
+    }
+
+    if (out) fclose(out);
+    if (file_fd >= 0) close(file_fd);
+    zimage_close(gz_image);
+    close(gz_fd);
+    remove_file();
+
+    if (regressions) {
+        fprintf(stderr, "%d benchmark%s more than %g%% slower than the baseline\n",
+                regressions, regressions == 1 ? "" : "s", threshold);
+        return 1;
+    }
+    return 0;
+}
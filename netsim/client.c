@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "biportal.h"
+#include "client.h"
+
+#define CLIENT_PACKET_MAX 65536
+
+typedef struct {
+    int sock;
+    struct sockaddr_in server;      // request address, then the transfer TID
+    bool have_tid;
+    const tftp_client_opts_t *opts;
+    tftp_client_result_t *result;
+    char *last;                     // retransmitted on timeout
+    int last_len;
+    int retries;
+    uint64_t deadline;
+    char *in;
+} session_t;
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool fail(session_t *s, const char *fmt, const char *detail) {
+    snprintf(s->result->error, sizeof(s->result->error), fmt, detail);
+    return false;
+}
+
+static bool open_session(session_t *s, const struct sockaddr_in *server,
+                         const tftp_client_opts_t *opts, tftp_client_result_t *result) {
+    memset(s, 0, sizeof(*s));
+    memset(result, 0, sizeof(*result));
+    s->server = *server;
+    s->opts = opts;
+    s->result = result;
+    result->block_size = 512;
+
+    s->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    s->last = malloc(CLIENT_PACKET_MAX);
+    s->in = malloc(CLIENT_PACKET_MAX);
+    if (s->sock < 0 || !s->last || !s->in) return fail(s, "%s", strerror(errno));
+    return true;
+}
+
+static void close_session(session_t *s) {
+    if (s->sock >= 0) close(s->sock);
+    free(s->last);
+    free(s->in);
+}
+
+static void send_last(session_t *s) {
+    sendto(s->sock, s->last, s->last_len, 0, (struct sockaddr *)&s->server, sizeof(s->server));
+}
+
+static void send_new(session_t *s, int len) {
+    s->last_len = len;
+    s->retries = 0;
+    s->deadline = now_ms() + s->opts->timeout_ms;
+    send_last(s);
+}
+
+static int build_request(session_t *s, int opcode, const char *name, long long tsize) {
+    char *p = s->last, *end = s->last + 512;
+    *(uint16_t *)p = htons(opcode);
+    p += 2;
+    p += snprintf(p, end - p, "%s", name) + 1;
+    p += snprintf(p, end - p, "octet") + 1;
+    if (s->opts->block_size != 512) {
+        p += snprintf(p, end - p, "blksize") + 1;
+        p += snprintf(p, end - p, "%d", s->opts->block_size) + 1;
+    }
+    p += snprintf(p, end - p, "tsize") + 1;
+    p += snprintf(p, end - p, "%lld", tsize) + 1;
+    return p - s->last;
+}
+
+static void send_ack(session_t *s, uint16_t block) {
+    *(uint16_t *)s->last = htons(TFTP_ACK);
+    *(uint16_t *)(s->last + 2) = htons(block);
+    send_new(s, 4);
+}
+
+// Wait for the next packet from the transfer's peer, retransmitting on the
+// way. Returns its length, 0 after giving up, -1 on a socket error.
+static int receive(session_t *s) {
+    for (;;) {
+        uint64_t now = now_ms();
+        if (now >= s->deadline) {
+            if (s->retries >= s->opts->max_retries) return 0;
+            s->retries++;
+            s->result->retransmits++;
+            s->deadline = now + s->opts->timeout_ms;
+            send_last(s);
+            continue;
+        }
+
+        struct pollfd pfd = { s->sock, POLLIN, 0 };
+        int r = poll(&pfd, 1, (int)(s->deadline - now));
+        if (r < 0 && errno != EINTR) return -1;
+        if (r <= 0) continue;
+
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(s->sock, s->in, CLIENT_PACKET_MAX, 0, (struct sockaddr *)&from, &from_len);
+        if (n < 0) return -1;
+        if (n < 4) continue;
+
+        if (!s->have_tid) {
+            s->server = from;
+            s->have_tid = true;
+        } else if (from.sin_port != s->server.sin_port || from.sin_addr.s_addr != s->server.sin_addr.s_addr) {
+            char err[] = "\0\5\0\5Unknown transfer ID";
+            sendto(s->sock, err, sizeof(err), 0, (struct sockaddr *)&from, from_len);
+            continue;
+        }
+        return n;
+    }
+}
+
+static void parse_oack(session_t *s, int len) {
+    char *p = s->in + 2, *end = s->in + len;
+    while (p < end && *p) {
+        char *value = p + strlen(p) + 1;
+        if (value >= end) break;
+        if (!strcasecmp(p, "blksize")) s->result->block_size = atoi(value);
+        p = value + strlen(value) + 1;
+    }
+}
+
+static bool error_packet(session_t *s, int len) {
+    s->in[len - 1] = '\0';
+    return fail(s, "server error: %s", s->in + 4);
+}
+
+bool tftp_get(const struct sockaddr_in *server, const char *name,
+              const tftp_client_opts_t *opts, tftp_client_result_t *result) {
+    session_t s;
+    bool ok = false;
+    if (!open_session(&s, server, opts, result)) goto out;
+
+    hash_ctx_t hash;
+    hash_init(&hash);
+    uint16_t expected = 1;
+    uint64_t started = now_ms();
+    send_new(&s, build_request(&s, TFTP_RRQ, name, 0));
+
+    for (;;) {
+        int n = receive(&s);
+        if (n <= 0) {
+            fail(&s, "%s", n ? strerror(errno) : "timed out");
+            goto out;
+        }
+        uint16_t op = ntohs(*(uint16_t *)s.in), block = ntohs(*(uint16_t *)(s.in + 2));
+
+        if (op == TFTP_ERROR) {
+            error_packet(&s, n);
+            goto out;
+        }
+        if (op == TFTP_OACK) {
+            if (expected != 1) continue;
+            parse_oack(&s, n);
+            send_ack(&s, 0);
+            continue;
+        }
+        if (op != TFTP_DATA) continue;
+
+        if (block != expected) {
+            // The server missed our ACK, tell it again
+            if (block == (uint16_t)(expected - 1)) {
+                result->duplicates++;
+                result->retransmits++;
+                send_last(&s);
+            }
+            continue;
+        }
+
+        hash_update(&hash, s.in + 4, n - 4);
+        result->bytes += n - 4;
+        send_ack(&s, block);
+        expected++;
+        if (n - 4 < result->block_size) break;
+    }
+
+    result->elapsed_ms = now_ms() - started;
+    char xxh64[HASH_XXH64_HEX];
+    hash_final(&hash, result->sha256, xxh64);
+    ok = true;
+
+out:
+    close_session(&s);
+    return ok;
+}
+
+bool tftp_put(const struct sockaddr_in *server, const char *name, const char *data, size_t len,
+              const tftp_client_opts_t *opts, tftp_client_result_t *result) {
+    session_t s;
+    bool ok = false;
+    if (!open_session(&s, server, opts, result)) goto out;
+
+    uint16_t block = 0;
+    size_t offset = 0, chunk = 0;
+    uint64_t started = now_ms();
+    send_new(&s, build_request(&s, TFTP_WRQ, name, (long long)len));
+
+    for (;;) {
+        int n = receive(&s);
+        if (n <= 0) {
+            fail(&s, "%s", n ? strerror(errno) : "timed out");
+            goto out;
+        }
+        uint16_t op = ntohs(*(uint16_t *)s.in), acked = ntohs(*(uint16_t *)(s.in + 2));
+
+        if (op == TFTP_ERROR) {
+            error_packet(&s, n);
+            goto out;
+        }
+        if (op == TFTP_OACK && block == 0) {
+            parse_oack(&s, n);
+            acked = 0;
+        } else if (op != TFTP_ACK) {
+            continue;
+        } else if (acked != block) {
+            // Answering a repeated ACK would double every DATA from here on
+            result->duplicates++;
+            continue;
+        }
+
+        if (block > 0) {
+            offset += chunk;
+            result->bytes += chunk;
+            if (chunk < (size_t)result->block_size) break;
+        }
+
+        chunk = len - offset < (size_t)result->block_size ? len - offset : (size_t)result->block_size;
+        block++;
+        *(uint16_t *)s.last = htons(TFTP_DATA);
+        *(uint16_t *)(s.last + 2) = htons(block);
+        memcpy(s.last + 4, data + offset, chunk);
+        send_new(&s, 4 + chunk);
+    }
+
+    result->elapsed_ms = now_ms() - started;
+    hash_ctx_t hash;
+    char xxh64[HASH_XXH64_HEX];
+    hash_init(&hash);
+    hash_update(&hash, data, len);
+    hash_final(&hash, result->sha256, xxh64);
+    ok = true;
+
+out:
+    close_session(&s);
+    return ok;
+}
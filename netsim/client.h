@@ -0,0 +1,39 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "hash.h"
+
+// Minimal lockstep TFTP client with the usual retransmission rules: resend
+// the last packet on timeout, re-acknowledge a repeated DATA block, never
+// answer a repeated ACK (Sorcerer's Apprentice).
+
+typedef struct {
+    int block_size;             // 512 doesn't negotiate anything
+    int timeout_ms;
+    int max_retries;
+} tftp_client_opts_t;
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t elapsed_ms;
+    unsigned retransmits;       // packets we had to send again
+    unsigned duplicates;        // packets we got more than once
+    int block_size;             // as negotiated
+    char sha256[HASH_SHA256_HEX];
+    char error[128];
+} tftp_client_result_t;
+
+// Fetch a file, hashing what arrives. Returns false with result->error set.
+bool tftp_get(const struct sockaddr_in *server, const char *name,
+              const tftp_client_opts_t *opts, tftp_client_result_t *result);
+
+// Upload len bytes of data as name.
+bool tftp_put(const struct sockaddr_in *server, const char *name, const char *data, size_t len,
+              const tftp_client_opts_t *opts, tftp_client_result_t *result);
+
+#endif
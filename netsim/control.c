@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "biportal.h"
+#include "control.h"
+
+static int ctl = -1;
+static char ctl_dir[64];
+
+static int usage(void) {
+    fprintf(stderr, "Usage: netsim capture [-m off|headers|full] [-z BYTES] [-o OUT.pcap]\n");
+    return 2;
+}
+
+// Send a message to biportal, with fd attached if it isn't -1
+static bool send_ctl(int cmd, const char *data, int fd) {
+    ipc_message_t msg;
+    struct sockaddr_un to;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { &msg, 0 };
+    struct msghdr mh;
+
+    msg.cmd = cmd;
+    msg.transfer_id = 0;
+    snprintf(msg.data, sizeof(msg.data), "%s", data);
+    iov.iov_len = 4 + strlen(msg.data) + 1;
+    memset(&to, 0, sizeof(to));
+    to.sun_family = AF_UNIX;
+    strncpy(to.sun_path, SOCKET_PATH, sizeof(to.sun_path) - 1);
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &to;
+    mh.msg_namelen = sizeof(to);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    if (sendmsg(ctl, &mh, 0) < 0) {
+        fprintf(stderr, "Can't reach biportal on %s: %s\n", SOCKET_PATH, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Ask for a dump into out and wait for the answer, which comes back to our
+// own address rather than to PumpKIN
+static bool dump(const char *out) {
+    int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Can't create %s: %s\n", out, strerror(errno));
+        return false;
+    }
+    bool sent = send_ctl(CMD_CAPTURE_DUMP, "", fd);
+    close(fd);
+    if (!sent) return false;
+
+    struct timeval tv = { 5, 0 };
+    setsockopt(ctl, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ipc_message_t msg;
+    for (;;) {
+        ssize_t n = recv(ctl, &msg, sizeof(msg) - 1, 0);
+        if (n < 0) {
+            fprintf(stderr, "biportal didn't answer: %s\n", strerror(errno));
+            return false;
+        }
+        if (n > 4 && msg.cmd == CMD_CAPTURE_DUMP) {
+            ((char *)&msg)[n] = '\0';
+            printf("%s: %s\n", out, msg.data);
+            return !strncmp(msg.data, "OK", 2);
+        }
+    }
+}
+
+int capture_main(int argc, char **argv) {
+    const char *mode = NULL, *size = NULL, *out = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "m:z:o:")) != -1) {
+        switch (c) {
+            case 'm': mode = optarg; break;
+            case 'z': size = optarg; break;
+            case 'o': out = optarg; break;
+            default:
+                return usage();
+        }
+    }
+    if (argc != optind || (!mode && !size && !out)) return usage();
+
+    // Answers need an address to come back to
+    strcpy(ctl_dir, "/tmp/netsim-ctl-XXXXXX");
+    if (!mkdtemp(ctl_dir)) {
+        fprintf(stderr, "Can't create a temporary directory: %s\n", strerror(errno));
+        return 1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ctl.sock", ctl_dir);
+    ctl = socket(AF_UNIX, SOCK_DGRAM, 0);
+    bool ok = ctl >= 0 && bind(ctl, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!ok) fprintf(stderr, "Failed to bind control socket: %s\n", strerror(errno));
+
+    char config[64];
+    if (ok && size) {
+        snprintf(config, sizeof(config), "capture_size=%s", size);
+        ok = send_ctl(CMD_CONFIG, config, -1);
+    }
+    if (ok && mode) {
+        snprintf(config, sizeof(config), "capture=%s", mode);
+        ok = send_ctl(CMD_CONFIG, config, -1);
+    }
+    if (ok && out) ok = dump(out);
+
+    if (ctl >= 0) close(ctl);
+    unlink(addr.sun_path);
+    rmdir(ctl_dir);
+    return ok ? 0 : 1;
+}
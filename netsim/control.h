@@ -0,0 +1,11 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+// netsim capture [-m MODE] [-z BYTES] [-o OUT.pcap]
+//
+// Talks to a running biportal over its control socket, as the user who
+// started it: switches its packet capture on or off, and has it write what
+// it captured so far to a file opened here and passed along.
+int capture_main(int argc, char **argv);
+
+#endif
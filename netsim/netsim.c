@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "biportal.h"
+#include "proxy.h"
+#include "client.h"
+#include "server.h"
+#include "replay.h"
+#include "control.h"
+
+// Reproducible benchmark of the biportal engine behind a lossy link, and the
+// same lossy link as a standalone shim for any client and server.
+//
+//   netsim proxy [impairments] LISTEN_PORT SERVER_ADDR SERVER_PORT
+//   netsim bench [options] PATH_TO_BIPORTAL
+//   netsim replay [options] CAPTURE.pcap PATH_TO_BIPORTAL
+//
+// The bench starts biportal on loopback, approves its requests over the IPC
+// socket and runs transfers through the proxy for every profile asked for,
+// reporting completion time, goodput and retransmissions. With -g or -m it
+// exits non-zero when a run falls short, so it can gate a change; each
+// profile can have its own limits. The loss pattern is fixed by the seed;
+// timings are real and vary a little.
+
+#define BENCH_MAX_LIMITS 32
+
+typedef struct {
+    const char *profile;        // NULL for the profiles without limits of their own
+    double min_goodput;         // KiB/s, 0 for none
+    uint64_t max_time;          // ms, 0 for none
+} bench_limit_t;
+
+typedef struct {
+    const char *biportal;
+    int port;
+    int runs;
+    uint64_t seed;
+    size_t size;
+    bool upload;
+    bench_limit_t limits[BENCH_MAX_LIMITS];
+    int nlimits;
+    bool verbose;
+    tftp_client_opts_t client;
+} bench_opts_t;
+
+static void usage(void) {
+    int count;
+    const impair_profile_t *profiles = impair_profiles(&count);
+
+    fprintf(stderr,
+            "Usage: netsim proxy [impairments] LISTEN_PORT SERVER_ADDR SERVER_PORT\n"
+            "       netsim bench [options] PATH_TO_BIPORTAL\n"
+            "       netsim replay [-x SPEED] [-n MAX_SESSIONS] [-t MS] [-P PORT] [-v]\n"
+            "                     CAPTURE.pcap PATH_TO_BIPORTAL\n"
+            "       netsim capture [-m off|headers|full] [-z BYTES] [-o OUT.pcap]\n"
+            "\n"
+            "Impairments (either command):\n"
+            "  -p PROFILE   built-in profile, bench takes several or \"all\"; the flags\n"
+            "               below adjust it (proxy) or add a \"custom\" one (bench)\n"
+            "  -l PERCENT   loss          -d PERCENT   duplication\n"
+            "  -r PERCENT   reordering    -D MS        delay          -j MS   jitter\n"
+            "  -s SEED      seed for the packet fates (default 1)\n"
+            "\n"
+            "Bench options:\n"
+            "  -n RUNS      runs per profile (default 3)\n"
+            "  -z BYTES     file size (default 262144)\n"
+            "  -b BLKSIZE   block size to ask for (default 1428)\n"
+            "  -t MS        client retransmission timeout (default 1000)\n"
+            "  -w           upload instead of download\n"
+            "  -g [PROFILE:]KIB/S  fail runs slower than this, of that profile only\n"
+            "                      if one is named, of every other one otherwise\n"
+            "  -m [PROFILE:]MS     fail runs that take longer than this, likewise\n"
+            "  -P PORT      port for biportal on 127.0.0.1 (default 16969)\n"
+            "  -v           show biportal's log afterwards\n"
+            "\n"
+            "Replay options:\n"
+            "  -x SPEED     time scale, 2 starts sessions twice as fast (default 1)\n"
+            "  -n SESSIONS  replay at most this many sessions (default 512)\n"
+            "  -t, -P, -v   as for bench\n"
+            "\n"
+            "Capture options, for the biportal already running:\n"
+            "  -m MODE      what to keep of each datagram from now on\n"
+            "  -z BYTES     size of the capture ring\n"
+            "  -o FILE      write what was captured so far to FILE as pcap\n"
+            "\n"
+            "Profiles:\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "  ");
+        impair_describe(stderr, &profiles[i]);
+    }
+}
+
+// Options shared by both commands, returns false if c isn't one of them
+static bool impairment_option(int c, const char *arg, impair_profile_t *custom, bool *customised, uint64_t *seed) {
+    switch (c) {
+        case 'l': custom->loss = atof(arg) / 100; break;
+        case 'd': custom->duplicate = atof(arg) / 100; break;
+        case 'r': custom->reorder = atof(arg) / 100; break;
+        case 'D': custom->delay_ms = atoi(arg); break;
+        case 'j': custom->jitter_ms = atoi(arg); break;
+        case 's': *seed = strtoull(arg, NULL, 0); return true;
+        default: return false;
+    }
+    *customised = true;
+    return true;
+}
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void on_signal(int signum) {
+    (void)signum;
+    interrupted = 1;
+}
+
+static int run_proxy(int argc, char **argv) {
+    impair_profile_t profile = { "custom", 0, 0, 0, 0, 0 };
+    bool customised = false;
+    uint64_t seed = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:l:d:r:D:j:s:")) != -1) {
+        if (c == 'p') {
+            const impair_profile_t *p = impair_profile(optarg);
+            if (!p) {
+                fprintf(stderr, "Unknown profile '%s'\n", optarg);
+                return 2;
+            }
+            profile = *p;
+        } else if (!impairment_option(c, optarg, &profile, &customised, &seed)) {
+            usage();
+            return 2;
+        }
+    }
+    if (argc - optind != 3) {
+        usage();
+        return 2;
+    }
+    if (customised) profile.name = "custom";
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(atoi(argv[optind + 2]));
+    if (inet_pton(AF_INET, argv[optind + 1], &server.sin_addr) != 1) {
+        fprintf(stderr, "Bad server address '%s'\n", argv[optind + 1]);
+        return 2;
+    }
+
+    proxy_t *proxy = proxy_start(&profile, seed, &server, atoi(argv[optind]));
+    if (!proxy) {
+        fprintf(stderr, "Failed to start proxy: %s\n", strerror(errno));
+        return 1;
+    }
+    fprintf(stderr, "Forwarding 127.0.0.1:%u to %s:%s, ", proxy_port(proxy), argv[optind + 1], argv[optind + 2]);
+    impair_describe(stderr, &profile);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    while (!interrupted) pause();
+
+    proxy_stats_t st;
+    proxy_stats(proxy, &st);
+    proxy_stop(proxy);
+    fprintf(stderr, "%u forwarded, %u dropped, %u duplicated, %u reordered\n",
+            st.forwarded, st.dropped, st.duplicated, st.reordered);
+    return 0;
+}
+
+// The entry for a profile's limits, or the default one for NULL; NULL when
+// there is no room for another
+static bench_limit_t *bench_limit(bench_opts_t *o, const char *profile) {
+    for (int i = 0; i < o->nlimits; i++) {
+        const char *name = o->limits[i].profile;
+        if (name == profile || (name && profile && !strcmp(name, profile))) return &o->limits[i];
+    }
+    if (o->nlimits == BENCH_MAX_LIMITS) return NULL;
+    bench_limit_t *limit = &o->limits[o->nlimits++];
+    memset(limit, 0, sizeof(*limit));
+    limit->profile = profile;
+    return limit;
+}
+
+// "-g [PROFILE:]VALUE" and "-m [PROFILE:]VALUE"
+static bool limit_option(bench_opts_t *o, int c, char *arg) {
+    char *value = strchr(arg, ':');
+    const char *profile = NULL;
+    if (value) {
+        *value++ = '\0';
+        if (!impair_profile(arg) && strcmp(arg, "custom")) {
+            fprintf(stderr, "Unknown profile '%s'\n", arg);
+            return false;
+        }
+        profile = arg;
+    } else {
+        value = arg;
+    }
+    bench_limit_t *limit = bench_limit(o, profile);
+    if (!limit) {
+        fprintf(stderr, "Too many limits\n");
+        return false;
+    }
+    if (c == 'g') limit->min_goodput = atof(value);
+    else limit->max_time = strtoull(value, NULL, 0);
+    return true;
+}
+
+// A profile's own limits, with the defaults for those it doesn't set
+static bench_limit_t limits_for(const bench_opts_t *o, const char *profile) {
+    bench_limit_t limits = { profile, 0, 0 }, defaults = { NULL, 0, 0 };
+    for (int i = 0; i < o->nlimits; i++) {
+        const bench_limit_t *l = &o->limits[i];
+        if (!l->profile) defaults = *l;
+        else if (!strcmp(l->profile, profile)) limits = *l;
+    }
+    if (!limits.min_goodput) limits.min_goodput = defaults.min_goodput;
+    if (!limits.max_time) limits.max_time = defaults.max_time;
+    return limits;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Run one profile, returns the number of failed runs
+static int bench_profile(const bench_opts_t *o, const impair_profile_t *profile,
+                         const char *image, const char *expected, int *upload_seq) {
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(o->port);
+
+    uint64_t times[o->runs];
+    int failures = 0, completed = 0;
+    bench_limit_t limits = limits_for(o, profile->name);
+
+    for (int run = 0; run < o->runs; run++) {
+        proxy_t *proxy = proxy_start(profile, o->seed + run, &server, 0);
+        if (!proxy) {
+            fprintf(stderr, "Failed to start proxy: %s\n", strerror(errno));
+            return o->runs - run + failures;
+        }
+
+        struct sockaddr_in via = server;
+        via.sin_port = htons(proxy_port(proxy));
+        tftp_client_result_t r;
+        bool ok;
+        if (o->upload) {
+            char name[32];
+            snprintf(name, sizeof(name), "upload-%d.bin", (*upload_seq)++);
+            ok = tftp_put(&via, name, image, o->size, &o->client, &r);
+        } else {
+            ok = tftp_get(&via, "image.bin", &o->client, &r);
+        }
+
+        proxy_stats_t st;
+        proxy_stats(proxy, &st);
+        proxy_stop(proxy);
+
+        if (ok && (r.bytes != o->size || strcmp(r.sha256, expected))) {
+            snprintf(r.error, sizeof(r.error), "corrupted, %llu bytes sha256=%s",
+                     (unsigned long long)r.bytes, r.sha256);
+            ok = false;
+        }
+        if (!ok) {
+            printf("%-10s run %d: FAILED %s (%u retransmits, proxy dropped %u)\n",
+                   profile->name, run + 1, r.error, r.retransmits, st.dropped);
+            failures++;
+            continue;
+        }
+
+        double goodput = r.elapsed_ms ? r.bytes / 1024.0 * 1000 / r.elapsed_ms : 0;
+        bool slow = (limits.min_goodput > 0 && goodput < limits.min_goodput)
+                 || (limits.max_time && r.elapsed_ms > limits.max_time);
+        printf("%-10s run %d: %llu bytes in %llu ms, %.1f KiB/s, blksize %d, %u retransmits, "
+               "%u duplicates; proxy dropped %u, duplicated %u, reordered %u%s\n",
+               profile->name, run + 1, (unsigned long long)r.bytes, (unsigned long long)r.elapsed_ms,
+               goodput, r.block_size, r.retransmits, r.duplicates,
+               st.dropped, st.duplicated, st.reordered, slow ? " SLOW" : "");
+        if (slow) failures++;
+        times[completed++] = r.elapsed_ms;
+    }
+
+    if (completed) {
+        qsort(times, completed, sizeof(times[0]), cmp_u64);
+        uint64_t median = times[completed / 2];
+        printf("%-10s median %llu ms, %.1f KiB/s, worst %llu ms, %d/%d failed\n",
+               profile->name, (unsigned long long)median,
+               median ? o->size / 1024.0 * 1000 / median : 0,
+               (unsigned long long)times[completed - 1], failures, o->runs);
+    }
+    fflush(stdout);
+    return failures;
+}
+
+static int run_bench(int argc, char **argv) {
+    bench_opts_t o = {
+        .port = 16969, .runs = 3, .seed = 1, .size = 262144,
+        .client = { .block_size = 1428, .timeout_ms = 1000, .max_retries = 5 },
+    };
+    const impair_profile_t *selected[32];
+    int nselected = 0, count;
+    const impair_profile_t *all = impair_profiles(&count);
+    impair_profile_t custom = { "custom", 0, 0, 0, 0, 0 };
+    bool customised = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:l:d:r:D:j:s:n:z:b:t:wg:m:P:v")) != -1) {
+        switch (c) {
+            case 'p':
+                if (!strcmp(optarg, "all")) {
+                    for (int i = 0; i < count && nselected < 32; i++) selected[nselected++] = &all[i];
+                } else if (impair_profile(optarg) && nselected < 32) {
+                    selected[nselected++] = impair_profile(optarg);
+                } else {
+                    fprintf(stderr, "Unknown profile '%s'\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'n': o.runs = atoi(optarg); break;
+            case 'z': o.size = strtoull(optarg, NULL, 0); break;
+            case 'b': o.client.block_size = atoi(optarg); break;
+            case 't': o.client.timeout_ms = atoi(optarg); break;
+            case 'w': o.upload = true; break;
+            case 'g':
+            case 'm':
+                if (!limit_option(&o, c, optarg)) return 2;
+                break;
+            case 'P': o.port = atoi(optarg); break;
+            case 'v': o.verbose = true; break;
+            default:
+                if (!impairment_option(c, optarg, &custom, &customised, &o.seed)) {
+                    usage();
+                    return 2;
+                }
+        }
+    }
+    if (argc - optind != 1 || o.runs < 1 || o.client.block_size < 8 || o.client.block_size > 65464) {
+        usage();
+        return 2;
+    }
+    o.biportal = argv[optind];
+    if (customised) selected[nselected++] = &custom;
+    if (!nselected) {
+        for (int i = 0; i < count; i++) selected[nselected++] = &all[i];
+    }
+
+    char *image = make_image(o.size, 0);
+    if (!image) {
+        fprintf(stderr, "Can't make a %zu byte image: %s\n", o.size, strerror(errno));
+        return 1;
+    }
+    char expected[HASH_SHA256_HEX], xxh64[HASH_XXH64_HEX];
+    hash_ctx_t hash;
+    hash_init(&hash);
+    hash_update(&hash, image, o.size);
+    hash_final(&hash, expected, xxh64);
+
+    int failures = 0;
+    if (!server_start(o.biportal, o.port) || !server_add_file("image.bin", image, o.size)) {
+        failures = 1;
+    } else {
+        int upload_seq = 0;
+        printf("%s %zu bytes, blksize %d, timeout %d ms, seed %llu, %d runs per profile\n",
+               o.upload ? "Upload" : "Download", o.size, o.client.block_size,
+               o.client.timeout_ms, (unsigned long long)o.seed, o.runs);
+        for (int i = 0; i < nselected && !interrupted; i++) {
+            failures += bench_profile(&o, selected[i], image, expected, &upload_seq);
+        }
+    }
+
+    server_stop(o.verbose);
+    free(image);
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage();
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (!strcmp(argv[1], "proxy")) return run_proxy(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "bench")) return run_bench(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "replay")) return replay_main(argc - 1, argv + 1);
+    if (!strcmp(argv[1], "capture")) return capture_main(argc - 1, argv + 1);
+    usage();
+    return 2;
+}
@@ -0,0 +1,293 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "proxy.h"
+
+#define PROXY_PACKET_MAX 65536
+#define REORDER_HOLD_MS 20      // how long a reordered datagram is held back
+
+static const impair_profile_t profiles[] = {
+    { "clean",     0,     0,     0,    0,   0 },
+    { "lossy",     0.02,  0,     0,    1,   0 },
+    { "lossy-10",  0.10,  0,     0,    1,   0 },
+    { "reorder",   0,     0.02,  0.05, 5,   0 },
+    { "jitter",    0,     0,     0,    20,  15 },
+    { "wan",       0.005, 0.001, 0.01, 40,  10 },
+    { "satellite", 0.01,  0,     0,    300, 20 },
+};
+
+enum { TO_SERVER, TO_CLIENT };
+
+typedef struct pending {
+    struct pending *next;
+    uint64_t due_us;
+    int dir;
+    int len;
+    char data[];
+} pending_t;
+
+struct proxy {
+    impair_profile_t profile;
+    uint64_t rng[2];
+    int down;                   // faces the client
+    int up;                     // faces the server
+    int wake[2];
+    uint16_t port;
+    struct sockaddr_in server;      // where requests go
+    struct sockaddr_in server_tid;  // where the current transfer lives
+    bool have_tid;
+    struct sockaddr_in client;
+    bool have_client;
+    pending_t *queue;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    proxy_stats_t stats;
+};
+
+const impair_profile_t *impair_profile(const char *name) {
+    for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+        if (!strcmp(profiles[i].name, name)) return &profiles[i];
+    }
+    return NULL;
+}
+
+const impair_profile_t *impair_profiles(int *count) {
+    *count = sizeof(profiles) / sizeof(profiles[0]);
+    return profiles;
+}
+
+void impair_describe(FILE *out, const impair_profile_t *p) {
+    fprintf(out, "%-10s loss %.1f%%, duplicate %.1f%%, reorder %.1f%%, delay %d+-%d ms\n",
+            p->name, p->loss * 100, p->duplicate * 100, p->reorder * 100, p->delay_ms, p->jitter_ms);
+}
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// splitmix64, one stream per direction
+static double draw(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void schedule(proxy_t *proxy, int dir, const char *data, int len, uint64_t due) {
+    pending_t *p = malloc(sizeof(pending_t) + len);
+    if (!p) return;
+    p->due_us = due;
+    p->dir = dir;
+    p->len = len;
+    memcpy(p->data, data, len);
+
+    // Keep the queue in delivery order, equal times stay first come first served
+    pending_t **at = &proxy->queue;
+    while (*at && (*at)->due_us <= due) at = &(*at)->next;
+    p->next = *at;
+    *at = p;
+}
+
+static void impair(proxy_t *proxy, int dir, const char *data, int len) {
+    const impair_profile_t *pr = &proxy->profile;
+    uint64_t *rng = &proxy->rng[dir];
+
+    // Always draw all four so one packet's fate doesn't shift the next one's
+    double lost = draw(rng), dup = draw(rng), late = draw(rng), jitter = draw(rng);
+
+    pthread_mutex_lock(&proxy->lock);
+    if (lost < pr->loss) {
+        proxy->stats.dropped++;
+        pthread_mutex_unlock(&proxy->lock);
+        return;
+    }
+    proxy->stats.forwarded++;
+
+    int64_t delay = (int64_t)pr->delay_ms * 1000;
+    if (pr->jitter_ms) delay += (int64_t)((jitter * 2 - 1) * pr->jitter_ms * 1000);
+    if (late < pr->reorder) {
+        delay += REORDER_HOLD_MS * 1000;
+        proxy->stats.reordered++;
+    }
+    if (delay < 0) delay = 0;
+
+    uint64_t due = now_us() + delay;
+    schedule(proxy, dir, data, len, due);
+    if (dup < pr->duplicate) {
+        proxy->stats.duplicated++;
+        schedule(proxy, dir, data, len, due);
+    }
+    pthread_mutex_unlock(&proxy->lock);
+}
+
+static void deliver(proxy_t *proxy, pending_t *p) {
+    if (p->dir == TO_SERVER) {
+        struct sockaddr_in *to = proxy->have_tid ? &proxy->server_tid : &proxy->server;
+        sendto(proxy->up, p->data, p->len, 0, (struct sockaddr *)to, sizeof(*to));
+    } else if (proxy->have_client) {
+        sendto(proxy->down, p->data, p->len, 0, (struct sockaddr *)&proxy->client, sizeof(proxy->client));
+    }
+}
+
+static void flush_queue(proxy_t *proxy) {
+    while (proxy->queue) {
+        pending_t *p = proxy->queue;
+        proxy->queue = p->next;
+        free(p);
+    }
+}
+
+static void *proxy_main(void *arg) {
+    proxy_t *proxy = arg;
+    char *buffer = malloc(PROXY_PACKET_MAX);
+    if (!buffer) return NULL;
+
+    for (;;) {
+        struct pollfd fds[3] = {
+            { proxy->down, POLLIN, 0 },
+            { proxy->up, POLLIN, 0 },
+            { proxy->wake[0], POLLIN, 0 },
+        };
+        int timeout = -1;
+        if (proxy->queue) {
+            uint64_t now = now_us();
+            timeout = proxy->queue->due_us > now ? (int)((proxy->queue->due_us - now + 999) / 1000) : 0;
+        }
+        if (poll(fds, 3, timeout) < 0 && errno != EINTR) break;
+        if (fds[2].revents) break;
+
+        if (fds[0].revents & POLLIN) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int n = recvfrom(proxy->down, buffer, PROXY_PACKET_MAX, 0, (struct sockaddr *)&from, &from_len);
+            if (n > 0) {
+                if (!proxy->have_client || from.sin_port != proxy->client.sin_port
+                    || from.sin_addr.s_addr != proxy->client.sin_addr.s_addr) {
+                    // New client, whatever is still in flight belongs to the old one
+                    proxy->client = from;
+                    proxy->have_client = true;
+                    proxy->have_tid = false;
+                    flush_queue(proxy);
+                }
+                impair(proxy, TO_SERVER, buffer, n);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            int n = recvfrom(proxy->up, buffer, PROXY_PACKET_MAX, 0, (struct sockaddr *)&from, &from_len);
+            if (n > 0) {
+                if (!proxy->have_tid) {
+                    proxy->server_tid = from;
+                    proxy->have_tid = true;
+                }
+                impair(proxy, TO_CLIENT, buffer, n);
+            }
+        }
+
+        uint64_t now = now_us();
+        while (proxy->queue && proxy->queue->due_us <= now) {
+            pending_t *p = proxy->queue;
+            proxy->queue = p->next;
+            deliver(proxy, p);
+            free(p);
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static int bound_socket(uint16_t port) {
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0) return -1;
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+proxy_t *proxy_start(const impair_profile_t *profile, uint64_t seed,
+                     const struct sockaddr_in *server, uint16_t listen_port) {
+    proxy_t *proxy = calloc(1, sizeof(proxy_t));
+    if (!proxy) return NULL;
+
+    proxy->profile = *profile;
+    proxy->rng[TO_SERVER] = seed;
+    proxy->rng[TO_CLIENT] = seed ^ 0x5DEECE66DULL;
+    proxy->server = *server;
+    proxy->down = bound_socket(listen_port);
+    proxy->up = bound_socket(0);
+    proxy->wake[0] = proxy->wake[1] = -1;
+    pthread_mutex_init(&proxy->lock, NULL);
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (proxy->down < 0 || proxy->up < 0 || pipe(proxy->wake) < 0
+        || getsockname(proxy->down, (struct sockaddr *)&addr, &addr_len) < 0) {
+        goto fail;
+    }
+    proxy->port = ntohs(addr.sin_port);
+
+    int err = pthread_create(&proxy->thread, NULL, proxy_main, proxy);
+    if (err) {
+        errno = err;
+        goto fail;
+    }
+    return proxy;
+
+fail:
+    {
+        int err = errno;
+        if (proxy->down >= 0) close(proxy->down);
+        if (proxy->up >= 0) close(proxy->up);
+        if (proxy->wake[0] >= 0) close(proxy->wake[0]);
+        if (proxy->wake[1] >= 0) close(proxy->wake[1]);
+        pthread_mutex_destroy(&proxy->lock);
+        free(proxy);
+        errno = err;
+    }
+    return NULL;
+}
+
+uint16_t proxy_port(const proxy_t *proxy) {
+    return proxy->port;
+}
+
+void proxy_stats(const proxy_t *proxy, proxy_stats_t *stats) {
+    pthread_mutex_lock((pthread_mutex_t *)&proxy->lock);
+    *stats = proxy->stats;
+    pthread_mutex_unlock((pthread_mutex_t *)&proxy->lock);
+}
+
+void proxy_stop(proxy_t *proxy) {
+    ssize_t w = write(proxy->wake[1], "", 1);
+    (void)w;
+    pthread_join(proxy->thread, NULL);
+    flush_queue(proxy);
+    close(proxy->down);
+    close(proxy->up);
+    close(proxy->wake[0]);
+    close(proxy->wake[1]);
+    pthread_mutex_destroy(&proxy->lock);
+    free(proxy);
+}
@@ -0,0 +1,49 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+// UDP shim that sits between a TFTP client and server and mistreats the
+// datagrams passing through it. Every datagram draws the same number of
+// values from a per-direction generator seeded up front, so the fate of the
+// n-th packet in each direction only depends on the seed and the profile.
+//
+// The client talks to the proxy's port only; the proxy follows the server
+// onto its transfer TID and hides that from the client. One client at a
+// time: a datagram from a new client address starts a new session.
+
+typedef struct {
+    const char *name;
+    double loss;        // probability that a datagram is dropped
+    double duplicate;   // ... that it is delivered twice
+    double reorder;     // ... that it is held back and overtaken
+    int delay_ms;       // one-way delay
+    int jitter_ms;      // uniform +/- variation of the delay
+} impair_profile_t;
+
+typedef struct {
+    unsigned forwarded;
+    unsigned dropped;
+    unsigned duplicated;
+    unsigned reordered;
+} proxy_stats_t;
+
+typedef struct proxy proxy_t;
+
+// Built-in profiles, "all" isn't one of them but callers may treat it so
+const impair_profile_t *impair_profile(const char *name);
+const impair_profile_t *impair_profiles(int *count);
+void impair_describe(FILE *out, const impair_profile_t *profile);
+
+// Start forwarding on 127.0.0.1:listen_port (0 picks a free port) to the
+// server in a background thread. Returns NULL with errno set on failure.
+proxy_t *proxy_start(const impair_profile_t *profile, uint64_t seed,
+                     const struct sockaddr_in *server, uint16_t listen_port);
+uint16_t proxy_port(const proxy_t *proxy);
+void proxy_stats(const proxy_t *proxy, proxy_stats_t *stats);
+void proxy_stop(proxy_t *proxy);
+
+#endif
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "biportal.h"
+#include "client.h"
+#include "server.h"
+#include "replay.h"
+
+#define REPLAY_MAX_FILES 1024
+
+typedef struct {
+    // From the capture
+    struct in_addr client, server;
+    uint16_t cport, sport;          // network order, sport is where the request went
+    bool upload;
+    char name[256];
+    int block_size;
+    uint64_t start_us, end_us;
+    uint64_t size;
+    uint16_t expected;              // next DATA block
+    bool complete;
+    bool refused;                   // answered with an ERROR
+    int file;
+
+    // From the replay
+    pthread_t thread;
+    uint64_t due_us;
+    bool ok;
+    tftp_client_result_t result;
+} session_t;
+
+typedef struct {
+    char name[256];
+    uint64_t size;
+} file_t;
+
+static session_t *sessions;
+static int session_count, session_alloc;
+static file_t files[REPLAY_MAX_FILES];
+static int file_count;
+static int replay_port = 16969;
+static tftp_client_opts_t client_opts = { 512, 1000, 5 };
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t get32(const uint8_t *p, bool swap) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+// Offset of the IPv4 header behind the link layer header, -1 if it isn't IPv4
+static int ip_offset(uint32_t linktype, const uint8_t *p, uint32_t len) {
+    switch (linktype) {
+        case 101:   // RAW
+        case 228:   // IPV4
+            return len >= 1 && (p[0] >> 4) == 4 ? 0 : -1;
+        case 1: {   // Ethernet, possibly with one VLAN tag
+            if (len < 14) return -1;
+            int off = 12;
+            if (p[off] == 0x81 && p[off + 1] == 0x00) off += 4;
+            if (len < (uint32_t)off + 2 || p[off] != 0x08 || p[off + 1] != 0x00) return -1;
+            return off + 2;
+        }
+        case 113:   // Linux cooked
+            return len >= 16 && p[14] == 0x08 && p[15] == 0x00 ? 16 : -1;
+        case 276:   // Linux cooked v2
+            return len >= 20 && p[0] == 0x08 && p[1] == 0x00 ? 20 : -1;
+        case 0:     // BSD loopback, family in host order of the capturing box
+        case 108:
+            return len >= 4 && (p[0] == 2 || p[3] == 2) ? 4 : -1;
+        default:
+            return -1;
+    }
+}
+
+static session_t *find_session(struct in_addr addr, uint16_t port) {
+    for (int i = session_count - 1; i >= 0; i--) {
+        session_t *s = &sessions[i];
+        if (s->client.s_addr == addr.s_addr && s->cport == port) return s;
+    }
+    return NULL;
+}
+
+static void add_request(uint64_t ts, struct in_addr src, uint16_t sport, struct in_addr dst, uint16_t dport,
+                        bool upload, const uint8_t *p, size_t len) {
+    session_t *s = find_session(src, sport);
+    if (s && s->server.s_addr == dst.s_addr && s->sport == dport) return;    // retransmitted request
+
+    if (session_count == session_alloc) {
+        int n = session_alloc ? session_alloc * 2 : 64;
+        session_t *grown = realloc(sessions, n * sizeof(session_t));
+        if (!grown) return;
+        sessions = grown;
+        session_alloc = n;
+    }
+    s = &sessions[session_count++];
+    memset(s, 0, sizeof(*s));
+    s->client = src;
+    s->cport = sport;
+    s->server = dst;
+    s->sport = dport;
+    s->upload = upload;
+    s->block_size = 512;
+    s->start_us = s->end_us = ts;
+    s->expected = 1;
+    s->file = -1;
+
+    size_t n = strnlen((const char *)p + 2, len - 2);
+    if (n >= sizeof(s->name)) n = sizeof(s->name) - 1;
+    memcpy(s->name, p + 2, n);
+}
+
+static void add_packet(uint64_t ts, const uint8_t *ip, uint32_t caplen) {
+    if (caplen < 20) return;
+    int ihl = (ip[0] & 0x0f) * 4;
+    if (ip[9] != IPPROTO_UDP || caplen < (uint32_t)ihl + 12) return;
+    if ((((ip[6] & 0x1f) << 8) | ip[7]) != 0) return;      // not the first fragment
+
+    struct in_addr src, dst;
+    memcpy(&src, ip + 12, 4);
+    memcpy(&dst, ip + 16, 4);
+    const uint8_t *udp = ip + ihl;
+    uint16_t sport, dport;
+    memcpy(&sport, udp, 2);
+    memcpy(&dport, udp + 2, 2);
+    int payload_len = ((udp[4] << 8) | udp[5]) - 8;        // as sent, even if we only have the start
+    const uint8_t *p = udp + 8;
+    size_t have = caplen - ihl - 8;
+    if (payload_len < 4 || have < 4) return;
+
+    uint16_t op = (p[0] << 8) | p[1], block = (p[2] << 8) | p[3];
+    if (op == TFTP_RRQ || op == TFTP_WRQ) {
+        add_request(ts, src, sport, dst, dport, op == TFTP_WRQ, p, have);
+        return;
+    }
+
+    bool from_client = true;
+    session_t *s = find_session(src, sport);
+    if (!s) {
+        s = find_session(dst, dport);
+        from_client = false;
+    }
+    if (!s || s->complete || s->refused) return;
+    s->end_us = ts;
+
+    switch (op) {
+        case TFTP_OACK:
+            for (const uint8_t *o = p + 2, *end = p + have; !from_client && o < end; ) {
+                size_t klen = strnlen((const char *)o, end - o);
+                const uint8_t *v = o + klen + 1;
+                if (v >= end) break;
+                size_t vlen = strnlen((const char *)v, end - v);
+                if (v + vlen >= end) break;
+                if (!strcasecmp((const char *)o, "blksize")) s->block_size = atoi((const char *)v);
+                o = v + vlen + 1;
+            }
+            break;
+        case TFTP_DATA:
+            if (from_client != s->upload || block != s->expected) break;
+            s->size += payload_len - 4;
+            s->expected++;
+            if (payload_len - 4 < s->block_size) s->complete = true;
+            break;
+        case TFTP_ERROR:
+            if (s->expected == 1) s->refused = true;
+            break;
+    }
+}
+
+static bool load_capture(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    uint8_t header[24];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header)) {
+        fprintf(stderr, "%s is too short for a pcap file\n", path);
+        fclose(f);
+        return false;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, header, 4);
+    bool swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    bool nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+    if (!swap && !nsec && magic != 0xa1b2c3d4) {
+        fprintf(stderr, "%s isn't a pcap file (pcapng isn't supported)\n", path);
+        fclose(f);
+        return false;
+    }
+    uint32_t linktype = get32(header + 20, swap) & 0xffff;
+
+    uint8_t *buf = malloc(262144);
+    uint8_t rec[16];
+    while (buf && fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+        uint32_t sec = get32(rec, swap), frac = get32(rec + 4, swap), caplen = get32(rec + 8, swap);
+        if (caplen > 262144 || fread(buf, 1, caplen, f) != caplen) break;
+
+        uint64_t ts = (uint64_t)sec * 1000000 + (nsec ? frac / 1000 : frac);
+        int off = ip_offset(linktype, buf, caplen);
+        if (off >= 0) add_packet(ts, buf + off, caplen - off);
+    }
+    free(buf);
+    fclose(f);
+    return true;
+}
+
+static void *session_main(void *arg) {
+    session_t *s = arg;
+    uint64_t now = now_us();
+    if (s->due_us > now) {
+        uint64_t wait = s->due_us - now;
+        struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+        }
+    }
+
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server.sin_port = htons(replay_port);
+
+    tftp_client_opts_t opts = client_opts;
+    opts.block_size = s->block_size;
+    char name[32];
+    if (s->upload) {
+        snprintf(name, sizeof(name), "upload-%ld.bin", (long)(s - sessions));
+        char *data = make_image(s->size, (unsigned)(s - sessions));
+        s->ok = data && tftp_put(&server, name, data, s->size, &opts, &s->result);
+        free(data);
+    } else {
+        snprintf(name, sizeof(name), "f%d.bin", s->file);
+        s->ok = tftp_get(&server, name, &opts, &s->result) && s->result.bytes == files[s->file].size;
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void percentiles(const char *what, uint64_t *v, int n) {
+    qsort(v, n, sizeof(v[0]), cmp_u64);
+    printf("%-9s p50 %llu ms, p90 %llu ms, max %llu ms\n", what,
+           (unsigned long long)v[n / 2], (unsigned long long)v[n * 9 / 10],
+           (unsigned long long)v[n - 1]);
+}
+
+static int usage(void) {
+    fprintf(stderr, "Usage: netsim replay [-x SPEED] [-n MAX_SESSIONS] [-t MS] [-P PORT] [-v] "
+                    "CAPTURE.pcap PATH_TO_BIPORTAL\n");
+    return 2;
+}
+
+int replay_main(int argc, char **argv) {
+    double speed = 1;
+    int max_sessions = 512;
+    bool verbose = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "x:n:t:P:v")) != -1) {
+        switch (c) {
+            case 'x': speed = atof(optarg); break;
+            case 'n': max_sessions = atoi(optarg); break;
+            case 't': client_opts.timeout_ms = atoi(optarg); break;
+            case 'P': replay_port = atoi(optarg); break;
+            case 'v': verbose = true; break;
+            default:
+                return usage();
+        }
+    }
+    if (argc - optind != 2 || speed <= 0 || max_sessions < 1) return usage();
+    if (!load_capture(argv[optind])) return 1;
+
+    // Keep what can be replayed and give every distinct download name a file
+    // as large as the largest transfer of it we saw
+    int kept = 0, refused = 0, partial = 0, reads = 0;
+    for (int i = 0; i < session_count; i++) {
+        session_t *s = &sessions[i];
+        if (s->refused || (!s->size && !s->complete) || kept == max_sessions) {
+            refused += s->refused;
+            continue;
+        }
+        partial += !s->complete;
+        if (!s->upload) {
+            int f;
+            for (f = 0; f < file_count && strcmp(files[f].name, s->name); f++) {
+            }
+            if (f == file_count) {
+                if (file_count == REPLAY_MAX_FILES) continue;
+                strcpy(files[file_count].name, s->name);
+                files[file_count++].size = 0;
+            }
+            if (s->size > files[f].size) files[f].size = s->size;
+            s->file = f;
+            reads++;
+        }
+        sessions[kept++] = *s;
+    }
+    session_count = kept;
+    if (!session_count) {
+        fprintf(stderr, "No TFTP sessions to replay in %s\n", argv[optind]);
+        return 1;
+    }
+
+    int failures = 0;
+    bool started = server_start(argv[optind + 1], replay_port);
+    for (int f = 0; started && f < file_count; f++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%d.bin", f);
+        char *data = make_image(files[f].size, f);
+        if (!data || !server_add_file(name, data, files[f].size)) started = false;
+        free(data);
+    }
+    if (!started) {
+        server_stop(verbose);
+        return 1;
+    }
+
+    printf("Replaying %d sessions (%d reads of %d files, %d writes, %d cut short) at %.2fx, %d refused ones skipped\n",
+           session_count, reads, file_count, session_count - reads, partial, speed, refused);
+    fflush(stdout);
+
+    uint64_t first = sessions[0].start_us;
+    for (int i = 1; i < session_count; i++) {
+        if (sessions[i].start_us < first) first = sessions[i].start_us;
+    }
+    uint64_t t0 = now_us() + 100000;
+    int running = 0;
+    for (int i = 0; i < session_count; i++) {
+        session_t *s = &sessions[i];
+        s->due_us = t0 + (uint64_t)((s->start_us - first) / speed);
+        if (pthread_create(&s->thread, NULL, session_main, s) != 0) {
+            fprintf(stderr, "Failed to start session %d: %s\n", i, strerror(errno));
+            break;
+        }
+        running++;
+    }
+
+    uint64_t bytes = 0, end = t0;
+    uint64_t *captured = calloc(running ? running : 1, sizeof(uint64_t));
+    uint64_t *replayed = calloc(running ? running : 1, sizeof(uint64_t));
+    int done = 0;
+    for (int i = 0; i < running; i++) {
+        session_t *s = &sessions[i];
+        pthread_join(s->thread, NULL);
+        uint64_t took = s->result.elapsed_ms;
+        if (verbose || !s->ok) {
+            printf("  %-3s %-32s %10llu bytes, blksize %5d: captured %llu ms, replayed %s%llu ms%s%s\n",
+                   s->upload ? "WRQ" : "RRQ", s->name, (unsigned long long)s->size, s->block_size,
+                   (unsigned long long)((s->end_us - s->start_us) / 1000),
+                   s->ok ? "" : "FAILED ", (unsigned long long)took,
+                   s->result.error[0] ? ", " : "", s->result.error);
+        }
+        if (!s->ok) {
+            failures++;
+            continue;
+        }
+        bytes += s->result.bytes;
+        captured[done] = (s->end_us - s->start_us) / 1000;
+        replayed[done++] = took;
+        uint64_t finished = s->due_us + took * 1000;
+        if (finished > end) end = finished;
+    }
+
+    if (done) {
+        uint64_t wall_ms = (end - t0) / 1000;
+        printf("%d/%d sessions completed, %llu bytes in %llu ms, %.1f KiB/s aggregate\n",
+               done, running, (unsigned long long)bytes, (unsigned long long)wall_ms,
+               wall_ms ? bytes / 1024.0 * 1000 / wall_ms : 0);
+        percentiles("captured", captured, done);
+        percentiles("replayed", replayed, done);
+    }
+    free(captured);
+    free(replayed);
+    free(sessions);
+    server_stop(verbose);
+    return failures || running < session_count ? 1 : 0;
+}
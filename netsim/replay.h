@@ -0,0 +1,13 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// netsim replay [options] CAPTURE.pcap PATH_TO_BIPORTAL
+//
+// Rebuilds the TFTP sessions found in a capture (biportal's own capture dump
+// or tcpdump output) and plays them against a fresh biportal on loopback
+// with their original start times, file sizes, block sizes and overlap.
+// Files keep their identity, so a capture where many devices fetch the same
+// image exercises the caches the same way.
+int replay_main(int argc, char **argv);
+
+#endif
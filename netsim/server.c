@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "biportal.h"
+#include "server.h"
+
+extern char **environ;
+
+static char workdir[64];
+static pid_t server_pid = -1;
+static int ipc = -1;
+static pthread_t approver;
+static bool approving = false;
+static atomic_bool approver_stop;
+
+static void send_ipc(int cmd, int transfer_id, const char *data) {
+    ipc_message_t msg;
+    struct sockaddr_un to;
+
+    msg.cmd = cmd;
+    msg.transfer_id = transfer_id;
+    snprintf(msg.data, sizeof(msg.data), "%s", data);
+    memset(&to, 0, sizeof(to));
+    to.sun_family = AF_UNIX;
+    strncpy(to.sun_path, SOCKET_PATH, sizeof(to.sun_path) - 1);
+    sendto(ipc, &msg, 4 + strlen(msg.data) + 1, 0, (struct sockaddr *)&to, sizeof(to));
+}
+
+// Stand in for PumpKIN: approve whatever biportal asks about
+static void *approver_main(void *arg) {
+    (void)arg;
+    struct timeval tv = { 0, 100000 };
+    setsockopt(ipc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (!atomic_load(&approver_stop)) {
+        ipc_message_t msg;
+        ssize_t n = recv(ipc, &msg, sizeof(msg), 0);
+        if (n < 4) continue;
+        if (msg.cmd == CMD_TRANSFER_REQUEST) send_ipc(CMD_TRANSFER_APPROVE, msg.transfer_id, "");
+    }
+    return NULL;
+}
+
+const char *server_root(void) {
+    return workdir;
+}
+
+bool server_add_file(const char *name, const char *data, size_t len) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", workdir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write(fd, data, len) == (ssize_t)len;
+    close(fd);
+    return ok;
+}
+
+bool server_start(const char *biportal, int port) {
+    strcpy(workdir, "/tmp/netsim.XXXXXX");
+    if (!mkdtemp(workdir)) {
+        fprintf(stderr, "mkdtemp failed: %s\n", strerror(errno));
+        workdir[0] = '\0';
+        return false;
+    }
+
+    char port_arg[16], log_path[128];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(log_path, sizeof(log_path), "%s/biportal.log", workdir);
+
+    int out[2];
+    if (pipe(out) < 0) return false;
+
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&fa, out[0]);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    char *args[] = { (char *)biportal, "127.0.0.1", port_arg, NULL };
+    int err = posix_spawn(&server_pid, biportal, &fa, NULL, args, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    close(out[1]);
+    if (err) {
+        close(out[0]);
+        fprintf(stderr, "Failed to start %s: %s\n", biportal, strerror(err));
+        server_pid = -1;
+        return false;
+    }
+
+    // biportal reports "0" once it listens, anything else is an errno
+    char status[32] = "";
+    ssize_t n = read(out[0], status, sizeof(status) - 1);
+    close(out[0]);
+    if (n <= 0 || atoi(status) != 0 || status[0] != '0') {
+        fprintf(stderr, "biportal failed to start (%s), see %s\n", n > 0 ? status : "no status", log_path);
+        return false;
+    }
+
+    // Introduce ourselves from a bound socket so replies can reach us
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ctl.sock", workdir);
+    ipc = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (ipc < 0 || bind(ipc, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Failed to bind IPC socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    char config[128];
+    snprintf(config, sizeof(config), "tftp_root=%s", workdir);
+    send_ipc(CMD_CONFIG, 0, config);
+    send_ipc(CMD_HELLO, 0, "HELLO");
+
+    // The answer to HELLO means the root is set, requests may come now
+    struct timeval tv = { 2, 0 };
+    setsockopt(ipc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ipc_message_t msg;
+    ssize_t got;
+    while ((got = recv(ipc, &msg, sizeof(msg), 0)) >= 4 && msg.cmd != CMD_READY) {
+    }
+    if (got < 4) {
+        fprintf(stderr, "biportal didn't answer on %s\n", SOCKET_PATH);
+        return false;
+    }
+
+    atomic_store(&approver_stop, false);
+    approving = pthread_create(&approver, NULL, approver_main, NULL) == 0;
+    return approving;
+}
+
+void server_stop(bool show_log) {
+    if (approving) {
+        atomic_store(&approver_stop, true);
+        pthread_join(approver, NULL);
+        approving = false;
+    }
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+        server_pid = -1;
+    }
+    if (ipc >= 0) {
+        close(ipc);
+        ipc = -1;
+    }
+    if (!workdir[0]) return;
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/biportal.log", workdir);
+    if (show_log) {
+        FILE *f = fopen(path, "r");
+        char line[512];
+        while (f && fgets(line, sizeof(line), f)) fputs(line, stderr);
+        if (f) fclose(f);
+    }
+
+    // Everything left is ours: images, uploads, the log and the IPC socket
+    DIR *dir = opendir(workdir);
+    struct dirent *de;
+    while (dir && (de = readdir(dir))) {
+        if (de->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", workdir, de->d_name);
+        unlink(path);
+    }
+    if (dir) closedir(dir);
+    rmdir(workdir);
+    workdir[0] = '\0';
+}
+
+char *make_image(size_t size, unsigned seed) {
+    char *data = malloc(size ? size : 1);
+    uint64_t x = 0x2545F4914F6CDD1DULL + seed;
+    for (size_t i = 0; data && i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = (char)x;
+    }
+    return data;
+}
@@ -0,0 +1,22 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Runs biportal on 127.0.0.1 with a fresh temporary TFTP root, standing in
+// for PumpKIN on the IPC socket and approving every transfer it asks about.
+
+bool server_start(const char *biportal, int port);
+const char *server_root(void);
+
+// Put a file into the root
+bool server_add_file(const char *name, const char *data, size_t len);
+
+// Stop biportal, optionally copying its log to stderr, and remove the root
+void server_stop(bool show_log);
+
+// The same pseudo-random content for a given size and seed, every time
+char *make_image(size_t size, unsigned seed);
+
+#endif
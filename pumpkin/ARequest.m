@@ -3,6 +3,7 @@
 #import "ARequest.h"
 #import "ReceiveXFer.h"
 #import "SendXFer.h"
+#include "../biportal/pmtu.h"
 
 static void cbHost(CFHostRef h,CFHostInfoType hi,const CFStreamError *e,void *i) {
     [(ARequest*)i hostCallbackWithHost:h info:hi andError:e];
@@ -103,8 +104,10 @@ static void cbHost(CFHostRef h,CFHostInfoType hi,const CFStreamError *e,void *i)
 	self.errorLabel = el; self.doTouchMe = YES; return;
     }
     [self saveDefaults];
+    // No block size given means the largest one the path to the peer carries whole
+    uint16_t bs = blockSize.unsignedIntValue ? blockSize.unsignedIntValue : pmtu_block_size(&peer);
     [[[requestIsGet?ReceiveXFer.class:SendXFer.class alloc]
-      initWithLocalFile:localFile peerAddress:&peer remoteFile:remoteFile xferType:xferType blockSize:blockSize.unsignedIntValue andTimeout:timeout.intValue]
+      initWithLocalFile:localFile peerAddress:&peer remoteFile:remoteFile xferType:xferType blockSize:bs andTimeout:timeout.intValue]
      autorelease];
     [self.window performClose:nil];
 }
@@ -157,6 +157,54 @@ static void cbListener(CFSocketRef sockie, CFSocketCallBackType cbt, CFDataRef c
     } else {
         [pumpkin log:@"Configuration sent to TFTP helper"];
     }
+    
+    // Fetch files we don't have from an upstream server, if one is set
+    NSString *upstream = [pumpkin.theDefaults.values valueForKey:@"upstreamServer"];
+    if (upstream.length) {
+        snprintf(msg.data, sizeof(msg.data), "upstream=%s", [upstream UTF8String]);
+        data = [NSData dataWithBytes:&msg length:4 + strlen(msg.data) + 1];
+        if (CFSocketSendData(sockie, NULL, (CFDataRef)data, 0) != kCFSocketSuccess) {
+            [pumpkin log:@"Failed to send upstream server to TFTP helper"];
+        }
+    }
+    
+    // Serve what's in the pack from memory, if one is set
+    NSString *pack = [pumpkin.theDefaults.values valueForKey:@"packFile"];
+    if (pack.length) {
+        snprintf(msg.data, sizeof(msg.data), "pack=%s", [[pack stringByExpandingTildeInPath] UTF8String]);
+        data = [NSData dataWithBytes:&msg length:4 + strlen(msg.data) + 1];
+        if (CFSocketSendData(sockie, NULL, (CFDataRef)data, 0) != kCFSocketSuccess) {
+            [pumpkin log:@"Failed to send pack file to TFTP helper"];
+        }
+    }
+    
+    // Keep the datagrams on the wire for "netsim capture -o" to write out
+    NSString *capture = [pumpkin.theDefaults.values valueForKey:@"packetCapture"];
+    if (capture.length) {
+        snprintf(msg.data, sizeof(msg.data), "capture=%s", [capture UTF8String]);
+        data = [NSData dataWithBytes:&msg length:4 + strlen(msg.data) + 1];
+        if (CFSocketSendData(sockie, NULL, (CFDataRef)data, 0) != kCFSocketSuccess) {
+            [pumpkin log:@"Failed to send packet capture mode to TFTP helper"];
+        }
+    }
+    
+    // Remember the popular files and warm them up when we start again; the
+    // locking has to be set before the manifest sets off the warm-up
+    NSString *manifest = [pumpkin.theDefaults.values valueForKey:@"warmManifest"];
+    if (manifest.length) {
+        BOOL lock = [[pumpkin.theDefaults.values valueForKey:@"warmLock"] boolValue];
+        NSArray *configs = @[
+            lock ? @"warm_lock=on" : @"warm_lock=off",
+            [@"manifest=" stringByAppendingString:[manifest stringByExpandingTildeInPath]]
+        ];
+        for (NSString *config in configs) {
+            snprintf(msg.data, sizeof(msg.data), "%s", [config UTF8String]);
+            data = [NSData dataWithBytes:&msg length:4 + strlen(msg.data) + 1];
+            if (CFSocketSendData(sockie, NULL, (CFDataRef)data, 0) != kCFSocketSuccess) {
+                [pumpkin log:@"Failed to send warm-start manifest to TFTP helper"];
+            }
+        }
+    }
 }
 
 -(DaemonListener*)initWithAddress:(struct sockaddr_in*)sin {
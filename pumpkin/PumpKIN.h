@@ -18,6 +18,10 @@ enum {
     NSTableView *xfersView;
     XFersViewDatasource *xvDatasource;
     NSToolbar *toolbar;
+    NSFileHandle *logHandle;
+    NSString *logHandleFile;
+    NSMutableString *logPending;
+    NSMutableData *logPendingFile;
 }
 
 @property (assign) IBOutlet NSWindow *window;
@@ -9,6 +9,14 @@
 #import "ARequest.h"
 
 
+// A shell word that survives inside an AppleScript string literal
+static NSString *shellWord(NSString *word) {
+    NSString *quoted = [NSString stringWithFormat:@"'%@'",
+                        [word stringByReplacingOccurrencesOfString:@"'" withString:@"'\\''"]];
+    return [[quoted stringByReplacingOccurrencesOfString:@"\\" withString:@"\\\\"]
+            stringByReplacingOccurrencesOfString:@"\"" withString:@"\\\""];
+}
+
 @implementation PumpKIN
 @synthesize toolbar;
 @synthesize preferencesWindow;
@@ -148,30 +156,54 @@
     va_list vl; va_start(vl, fmt);
     NSString *s = [[[[NSString alloc] initWithFormat:fmt arguments:vl] autorelease] stringByAppendingString:@"\n"];
     va_end(vl);
+    // Messages are collected and written out in one go shortly after, so a busy
+    // transfer doesn't reopen the log file and relayout the text view per line
+    if(!logPending) {
+	logPending = [[NSMutableString alloc] initWithCapacity:1024];
+	logPendingFile = [[NSMutableData alloc] initWithCapacity:1024];
+	[self performSelector:@selector(flushLog) withObject:nil afterDelay:0.25];
+    }
+    [logPending appendString:s];
+    NSString *lf = [theDefaults.values valueForKey:@"logFile"];
+    if(lf && ![lf isEqualTo:@""])
+	[logPendingFile appendData:[[NSString stringWithFormat:@"[%@] %@",[[NSDate date] description],s] dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+- (void)flushLog {
     NSString *lf = [theDefaults.values valueForKey:@"logFile"];
-    if(lf && ![lf isEqualTo:@""]) {
-	NSFileHandle *l = [NSFileHandle fileHandleForWritingAtPath:lf];
-	if(!l) {
-	    [[NSFileManager defaultManager] createFileAtPath:lf contents:nil attributes:nil];
-	    l = [NSFileHandle fileHandleForWritingAtPath:lf];
+    if(logPendingFile.length && lf && ![lf isEqualTo:@""]) {
+	if(logHandle && ![logHandleFile isEqualToString:lf]) {
+	    [logHandle closeFile]; [logHandle release]; logHandle = nil;
+	    [logHandleFile release]; logHandleFile = nil;
 	}
-	if(!l) {
-	    static NSString *bl = nil;
-	    if(!(bl && [bl isEqualToString:lf])) {
-		[[logger textStorage] appendAttributedString:[[[NSAttributedString alloc] initWithString:
-							   [NSString stringWithFormat:@"Failed to open/create '%@' log file\n",lf] ] autorelease]];
-		if(bl) [bl release];
-		bl = [NSString stringWithString:lf];
+	if(!logHandle) {
+	    NSFileHandle *l = [NSFileHandle fileHandleForWritingAtPath:lf];
+	    if(!l) {
+		[[NSFileManager defaultManager] createFileAtPath:lf contents:nil attributes:nil];
+		l = [NSFileHandle fileHandleForWritingAtPath:lf];
 	    }
-	}else{
-	    [l seekToEndOfFile];
-	    [l writeData:[[NSString stringWithFormat:@"[%@] %@",[[NSDate date] description],s] dataUsingEncoding:NSUTF8StringEncoding]];
-	    [l closeFile];
+	    if(!l) {
+		static NSString *bl = nil;
+		if(!(bl && [bl isEqualToString:lf])) {
+		    [logPending appendFormat:@"Failed to open/create '%@' log file\n",lf];
+		    if(bl) [bl release];
+		    bl = [[NSString alloc] initWithString:lf];
+		}
+	    }else{
+		logHandle = [l retain];
+		logHandleFile = [lf copy];
+	    }
+	}
+	if(logHandle) {
+	    [logHandle seekToEndOfFile];
+	    [logHandle writeData:logPendingFile];
 	}
     }
     [[logger textStorage] appendAttributedString:[[[NSAttributedString alloc] initWithString:
-						  s ] autorelease]];
+						  logPending ] autorelease]];
     [logger scrollToEndOfDocument:nil];
+    [logPending release]; logPending = nil;
+    [logPendingFile release]; logPendingFile = nil;
 }
 
 -(void)registerXfer:(id)xfer {
@@ -288,10 +320,23 @@
             NSTask *task = [[NSTask alloc] init];
             [task setLaunchPath:@"/usr/bin/osascript"];
             
-            // Create a command that will launch biportal directly
+            // Sink rules go on the command line the administrator approves,
+            // biportal doesn't take them over its control socket
+            NSMutableString *sinkArgs = [NSMutableString string];
+            NSArray *sinks = [theDefaults.values valueForKey:@"sinkRules"];
+            if ([sinks isKindOfClass:[NSArray class]]) {
+                for (NSString *rule in sinks) {
+                    [sinkArgs appendFormat:@" -s %@", shellWord(rule)];
+                }
+            }
+            
+            // Create a command that will launch biportal directly; it runs
+            // as root, -u tells it who its control socket is for
             NSString *osascriptCommand = [NSString stringWithFormat:
-                                         @"do shell script \"'%@' %@ %@\" with administrator privileges",
+                                         @"do shell script \"'%@' -u %d%@ %@ %@\" with administrator privileges",
                                          biportalPath, 
+                                         (int)getuid(),
+                                         sinkArgs,
                                          [NSString stringWithUTF8String:args[1]], // host address
                                          [NSString stringWithUTF8String:args[2]]]; // port
             
@@ -81,7 +81,7 @@
     NSMutableDictionary *o = [NSMutableDictionary dictionaryWithCapacity:4];
     [initialPacket.rqOptions enumerateKeysAndObjectsUsingBlock:^(NSString* k,NSString *v,BOOL *s) {
 	if([k isEqualToString:@"blksize"]) {
-	    [o setValue:[NSString stringWithFormat:@"%u",blockSize=v.intValue] forKey:@"blksize"];
+	    [o setValue:[NSString stringWithFormat:@"%u",blockSize=[self fitBlockSize:v.intValue]] forKey:@"blksize"];
 	}else if([k isEqualToString:@"tsize"]) {
 	    [o setValue:[NSString stringWithFormat:@"%lld",xferSize=v.longLongValue] forKey:@"tsize"];
 	}else if([k isEqualToString:@"timeout"]) {
@@ -125,6 +125,7 @@
 		[theFile seekToFileOffset:(p.block-1)*blockSize];
 		[theFile writeData:d];
 		[theFile truncateFileAtOffset:(p.block-1)*blockSize+d.length];
+		[self hashBlock:p.block withData:d];
 	    }@catch (NSException *e) {
 		[self queuePacket:[TFTPPacket packetErrorWithCode:tftpErrUndefined andMessage:e.reason]];
 		break;
@@ -68,7 +68,7 @@
     NSMutableDictionary *o = [NSMutableDictionary dictionaryWithCapacity:4];
     [[initialPacket rqOptions] enumerateKeysAndObjectsUsingBlock:^(NSString* k, NSString* v, BOOL *stop) {
 	if([k isEqualToString:@"blksize"]) {
-	    [o setValue:[NSString stringWithFormat:@"%u",blockSize=v.intValue] forKey:@"blksize"];
+	    [o setValue:[NSString stringWithFormat:@"%u",blockSize=[self fitBlockSize:v.intValue]] forKey:@"blksize"];
 	}else if([k isEqualToString:@"tsize"]) {
 	    [o setValue:[NSString stringWithFormat:@"%lld",xferSize] forKey:@"tsize"];
 	}else if([k isEqualToString:@"timeout"]) {
@@ -94,7 +94,9 @@
 - (void) xfer {
     NSAssert(theFile,@"no file!");
     [theFile seekToFileOffset:acked*blockSize];
-    [self queuePacket:[TFTPPacket packetDataWithBlock:acked+1 andData:[theFile readDataOfLength:blockSize]]];
+    NSData *d = [theFile readDataOfLength:blockSize];
+    [self hashBlock:acked+1 withData:d];
+    [self queuePacket:[TFTPPacket packetDataWithBlock:acked+1 andData:d]];
 }
 
 - (void) eatTFTPPacket:(TFTPPacket*)p from:(struct sockaddr_in*)sin{
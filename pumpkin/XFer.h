@@ -3,6 +3,7 @@
 #import "PumpKIN.h"
 #include <netinet/in.h>
 #import "TFTPPacket.h"
+#include "../biportal/hash.h"
 
 enum XFerState {
     xferStateNone = 0,
@@ -35,6 +36,10 @@ enum XFerState {
     NSString *localFile;
 
     NSMutableArray *queue;
+
+    hash_ctx_t hash;
+    BOOL hashing;
+    uint16_t hashedBlocks;
 }
 @property (readonly) struct sockaddr_in *peer;
 @property (readonly) TFTPPacket *initialPacket;
@@ -65,4 +70,8 @@ enum XFerState {
 
 - (BOOL) makeLocalFileName:(NSString*)xf;
 
+- (void) hashBlock:(uint16_t)b withData:(NSData*)d;
+- (NSString*) digests;
+- (uint16_t) fitBlockSize:(int)bs;
+
 @end
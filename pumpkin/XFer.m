@@ -1,6 +1,7 @@
 #import "XFer.h"
 #import "TFTPPacket.h"
 #import "StringsAttached.h"
+#include "../biportal/pmtu.h"
 
 static void cbXfer(CFSocketRef sockie,CFSocketCallBackType cbt,CFDataRef cba,
 		       const void *cbd,void *i) {
@@ -30,6 +31,7 @@ static void cbXfer(CFSocketRef sockie,CFSocketCallBackType cbt,CFDataRef cba,
     lastPacket = nil; retryTimer = nil;
     giveupTimer = nil;
     initialPacket = nil;
+    hash_init(&hash); hashing = YES; hashedBlocks = 0;
     return self;
     
 }
@@ -45,14 +47,46 @@ static void cbXfer(CFSocketRef sockie,CFSocketCallBackType cbt,CFDataRef cba,
 
 - (BOOL) makeLocalFileName:(NSString *)xf {
     NSString *fn = [xf stringByReplacingOccurrencesOfString:@"\\" withString:@"/"];
-    if([fn hasPrefix:@"../"] || [fn hasSuffix:@"/.."] || [fn rangeOfString:@"/../"].location!=NSNotFound) {
+    NSString *root = [[pumpkin.theDefaults.values valueForKey:@"tftpRoot"] stringByResolvingSymlinksInPath];
+    NSString *lf = [root stringByAppendingPathComponent:fn];
+    // Check components rather than substrings and make sure symlinks don't lead us out of the root
+    NSString *rp = [lf stringByResolvingSymlinksInPath];
+    if([fn.pathComponents containsObject:@".."]
+       || !([rp isEqualToString:root] || [rp hasPrefix:[root stringByAppendingString:@"/"]])) {
 	[self queuePacket:[TFTPPacket packetErrorWithCode:tftpErrAccessViolation andMessage:@"bad path"]];
 	return NO;
     }
-    localFile = [[[pumpkin.theDefaults.values valueForKey:@"tftpRoot"] stringByAppendingPathComponent:fn] retain];
+    localFile = [lf retain];
     return YES;
 }
 
+// Digest the data as it goes by, so nobody has to read the file again to verify it.
+// Only an unbroken run of blocks makes a digest, a gap gives up on it.
+- (void) hashBlock:(uint16_t)b withData:(NSData*)d {
+    if(!hashing || b!=(uint16_t)(hashedBlocks+1)) {
+	if(b>hashedBlocks+1) hashing = NO;
+	return;
+    }
+    hash_update(&hash,d.bytes,d.length);
+    hashedBlocks = b;
+}
+
+- (NSString*) digests {
+    if(!hashing || hashedBlocks!=acked) return nil;
+    char s[HASH_SHA256_HEX], x[HASH_XXH64_HEX];
+    hash_final(&hash,s,x); hashing = NO;
+    return [NSString stringWithFormat:@"sha256=%s xxh64=%s",s,x];
+}
+
+// What we answer a blksize option with. Asking for more than the path to the
+// peer carries unfragmented gets the most that it does.
+- (uint16_t) fitBlockSize:(int)bs {
+    if(bs>PMTU_BLKSIZE_MAX) bs = PMTU_BLKSIZE_MAX;
+    if(bs<=PMTU_BLKSIZE_MIN) return bs<8 ? PMTU_BLKSIZE_MIN : bs;
+    int fits = pmtu_block_size(&peer);
+    return bs>fits ? fits : bs;
+}
+
 - (void) retryTimeout {
     [self queuePacket:lastPacket]; [lastPacket release]; lastPacket = nil;
 }
@@ -114,7 +148,11 @@ static void cbXfer(CFSocketRef sockie,CFSocketCallBackType cbt,CFDataRef cba,
                 if([queue count] || state == xferStateShutdown)
                     CFSocketEnableCallBacks(sockie, kCFSocketWriteCallBack);
             } else if(state == xferStateShutdown) {
-                [pumpkin log:@"%@ Transfer of '%@' finished.", xferPrefix, xferFilename];
+                NSString *dg = [self digests];
+                if(dg)
+                    [pumpkin log:@"%@ Transfer of '%@' finished, %@.", xferPrefix, xferFilename, dg];
+                else
+                    [pumpkin log:@"%@ Transfer of '%@' finished.", xferPrefix, xferFilename];
                 [self disappear];
             }
             break;